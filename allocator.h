@@ -0,0 +1,275 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <new>
+#include <utility>
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
+
+// Buffers for tensors: aligned to a cache line (or whatever is asked for),
+// not zero filled unless asked, and for big ones backed by 2MB pages, since
+// at tens of GB the dTLB misses of 4KB pages dominate a permute. A permute
+// overwrites every element of its output, so zero filling it first is just
+// another pass over memory.
+//
+// When huge pages are asked for, buffers of at least huge_page_bytes are
+// mmap'd on a huge page boundary. With huge_pages_t::advise they are
+// madvise(MADV_HUGEPAGE)'d, which is what transparent huge pages in
+// "madvise" mode need. With reserved they come from the pool of huge pages
+// the admin set aside (MAP_HUGETLB) when there are enough, and are advised
+// ones otherwise. Fresh pages from the kernel are zero already, so zero
+// costs nothing for those.
+//
+// Huge pages are opt in: under a hypervisor that backs the guest with 4KB
+// pages they don't save any TLB misses, and on one such VM the 8192x8192
+// transpose was 60% slower on them (see the benchmarks).
+
+int64_t constexpr huge_page_bytes = 2 << 20;
+
+enum class huge_pages_t {
+  none,    // plain aligned allocations
+  advise,  // transparent huge pages, asked for with madvise
+  reserved // explicit huge pages (MAP_HUGETLB), else advise
+};
+
+struct buffer_t {
+  buffer_t(): data(nullptr), bytes(0), mapped(0) {}
+
+  // bytes of memory aligned to align (a power of two, at most a page)
+  explicit buffer_t(
+    int64_t bytes,
+    int64_t align = 64,
+    huge_pages_t huge = huge_pages_t::none,
+    bool zero = false):
+      data(nullptr), bytes(bytes), mapped(0)
+  {
+#if defined(__linux__)
+    if(huge != huge_pages_t::none && bytes >= huge_page_bytes) {
+      map(huge);
+    }
+#endif
+    if(data == nullptr) {
+      data = std::aligned_alloc(align, std::max(align, ((bytes + align - 1) / align) * align));
+      if(data == nullptr) {
+        throw std::bad_alloc();
+      }
+      if(zero) {
+        std::memset(data, 0, bytes);
+      }
+    }
+  }
+
+  buffer_t(buffer_t const&) = delete;
+  buffer_t& operator=(buffer_t const&) = delete;
+
+  buffer_t(buffer_t&& other):
+    data(other.data), bytes(other.bytes), mapped(other.mapped)
+  {
+    other.data = nullptr;
+    other.bytes = 0;
+    other.mapped = 0;
+  }
+
+  buffer_t& operator=(buffer_t&& other) {
+    std::swap(data, other.data);
+    std::swap(bytes, other.bytes);
+    std::swap(mapped, other.mapped);
+    return *this;
+  }
+
+  ~buffer_t() {
+    release();
+  }
+
+  template <typename T>
+  T* as() const { return static_cast<T*>(data); }
+
+  // Whether this was mmap'd (and so is on a huge page boundary)
+  bool is_mapped() const { return mapped > 0; }
+
+  void* data;
+  int64_t bytes;
+
+private:
+#if defined(__linux__)
+  void map(huge_pages_t huge) {
+    int64_t len = ((bytes + huge_page_bytes - 1) / huge_page_bytes) * huge_page_bytes;
+
+    if(huge == huge_pages_t::reserved) {
+      void* p = mmap(
+        nullptr, len, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+      if(p != MAP_FAILED) {
+        data = p;
+        mapped = len;
+        return;
+      }
+    }
+
+    // Map an extra huge page and trim to a huge page boundary, so that
+    // every 2MB of the buffer can be a huge page
+    void* p = mmap(
+      nullptr, len + huge_page_bytes, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(p == MAP_FAILED) {
+      return;
+    }
+    uintptr_t beg = uintptr_t(p);
+    uintptr_t aligned = (beg + huge_page_bytes - 1) & ~uintptr_t(huge_page_bytes - 1);
+    if(aligned > beg) {
+      munmap(p, aligned - beg);
+    }
+    uintptr_t end = beg + len + huge_page_bytes;
+    if(end > aligned + len) {
+      munmap((void*)(aligned + len), end - (aligned + len));
+    }
+    madvise((void*)aligned, len, MADV_HUGEPAGE);
+    data = (void*)aligned;
+    mapped = len;
+  }
+#endif
+
+  void release() {
+#if defined(__linux__)
+    if(mapped > 0) {
+      munmap(data, mapped);
+      data = nullptr;
+      return;
+    }
+#endif
+    std::free(data);
+    data = nullptr;
+  }
+
+  // The length of the mapping, 0 if not mmap'd
+  int64_t mapped;
+};
+
+// Buffers given back for reuse, so that repeated calls (the benchmarks, or a
+// server permuting the same shapes over and over) don't pay for the
+// allocation and the page faults every time. A request is served by the
+// smallest free buffer that is big enough, as long as it is at most twice
+// the size; what is held is capped at capacity bytes, dropping the biggest
+// buffers first. Reused buffers hold whatever was in them before.
+struct buffer_pool_t {
+  struct stats_t {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    int64_t held_bytes;
+  };
+
+  // A buffer from the pool that goes back to it when destroyed
+  struct pooled_t {
+    pooled_t(buffer_pool_t* pool, buffer_t&& buffer):
+      pool(pool), buffer(std::move(buffer))
+    {}
+
+    pooled_t(pooled_t const&) = delete;
+    pooled_t& operator=(pooled_t const&) = delete;
+
+    pooled_t(pooled_t&& other):
+      pool(other.pool), buffer(std::move(other.buffer))
+    {
+      other.pool = nullptr;
+    }
+
+    ~pooled_t() {
+      if(pool != nullptr && buffer.data != nullptr) {
+        pool->give_back(std::move(buffer));
+      }
+    }
+
+    template <typename T>
+    T* as() const { return buffer.as<T>(); }
+
+    void* data() const { return buffer.data; }
+
+    buffer_pool_t* pool;
+    buffer_t buffer;
+  };
+
+  explicit buffer_pool_t(
+    int64_t capacity,
+    int64_t align = 64,
+    huge_pages_t huge = huge_pages_t::none):
+      capacity(capacity), align(align), huge(huge),
+      held(0), hits(0), misses(0), evictions(0)
+  {}
+
+  static buffer_pool_t& global() {
+    static buffer_pool_t ret(int64_t(1) << 30);
+    return ret;
+  }
+
+  pooled_t acquire(int64_t bytes) {
+    {
+      std::unique_lock<std::mutex> lk(mutex);
+      auto iter = free_list.lower_bound(bytes);
+      if(iter != free_list.end() && iter->first <= 2*std::max(bytes, int64_t(1))) {
+        hits++;
+        held -= iter->first;
+        buffer_t ret = std::move(iter->second);
+        free_list.erase(iter);
+        return pooled_t(this, std::move(ret));
+      }
+      misses++;
+    }
+
+    // Allocate without holding the lock
+    return pooled_t(this, buffer_t(bytes, align, huge));
+  }
+
+  stats_t stats() const {
+    std::unique_lock<std::mutex> lk(mutex);
+    return stats_t { hits, misses, evictions, held };
+  }
+
+  // Free every buffer held and zero the counters
+  void clear() {
+    std::unique_lock<std::mutex> lk(mutex);
+    free_list.clear();
+    held = 0;
+    hits = 0;
+    misses = 0;
+    evictions = 0;
+  }
+
+private:
+  void give_back(buffer_t&& buffer) {
+    std::unique_lock<std::mutex> lk(mutex);
+    if(buffer.bytes > capacity) {
+      evictions++;
+      return;
+    }
+    held += buffer.bytes;
+    free_list.emplace(buffer.bytes, std::move(buffer));
+    while(held > capacity) {
+      auto last = std::prev(free_list.end());
+      held -= last->first;
+      free_list.erase(last);
+      evictions++;
+    }
+  }
+
+  mutable std::mutex mutex;
+  int64_t capacity;
+  int64_t align;
+  huge_pages_t huge;
+
+  // The buffers that are free, by size
+  std::multimap<int64_t, buffer_t> free_list;
+  int64_t held;
+
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+};
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <vector>
+#include <tuple>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+
+#include "permute.h"
+
+// Finds the best permute_t settings for a shape on the machine it runs on.
+//
+// For one (dims, perm, elem_size), every candidate block size is tried with
+// regular and with streaming stores. Each setting builds its own plan (so the
+// plan cache isn't involved), is run once to warm up and then timed repeat
+// times, keeping the fastest. The winner is recorded in a permute_tuning_t
+// under the shape class of (dims, perm, elem_size), and so is used for every
+// shape in that class. Save the tuning to disk and permute_t(0) picks it up
+// on the next launch:
+//
+//   autotuner_t tuner;
+//   tuner.tune({8000,20000}, {1,0});
+//   permute_tuning_t::global().save(permute_tuning_t::default_path());
+struct autotuner_t {
+  autotuner_t(
+    int repeat = 3,
+    std::vector<int> block_sizes = {32, 64, 128, 256, 512, 1024, 2048, 4096, 8192}):
+      repeat(repeat), block_sizes(block_sizes)
+  {}
+
+  // Returns the winning setting, after recording it into tuning
+  permute_tuning_t::setting_t tune(
+    std::vector<int> const& dims,
+    std::vector<int> const& perm,
+    int elem_size = sizeof(float),
+    permute_tuning_t& tuning = permute_tuning_t::global()) const
+  {
+    int64_t bytes = elem_size;
+    for(int const& d: dims) {
+      bytes *= d;
+    }
+
+    // Cache line aligned, so that the streaming stores get to stream
+    int64_t alloc = ((bytes + 63) / 64) * 64;
+    unsigned char* inn = (unsigned char*)std::aligned_alloc(64, alloc);
+    unsigned char* out = (unsigned char*)std::aligned_alloc(64, alloc);
+    for(int64_t i = 0; i != bytes; ++i) {
+      inn[i] = i % 251;
+      out[i] = 0;
+    }
+
+    permute_tuning_t::setting_t best { permute_tuning_t::fallback_block_size, store_mode_t::regular };
+    double best_time = -1.0;
+    for(int const& block_size: block_sizes) {
+      for(store_mode_t stores: { store_mode_t::regular, store_mode_t::streaming }) {
+        permute_plan_t plan(dims, perm, block_size * sizeof(float), elem_size, 0, stores);
+        double time = time_plan(plan, inn, out);
+        if(best_time < 0.0 || time < best_time) {
+          best_time = time;
+          best = { block_size, stores };
+        }
+      }
+    }
+
+    std::free(inn);
+    std::free(out);
+
+    tuning.set(permute_tuning_t::shape_class(dims, perm, elem_size), best);
+    return best;
+  }
+
+private:
+  // The fastest of repeat runs, in seconds
+  double time_plan(permute_plan_t const& plan, void const* inn, void* out) const {
+    plan.execute(inn, out);
+
+    double ret = -1.0;
+    for(int i = 0; i != repeat; ++i) {
+      auto start = std::chrono::steady_clock::now();
+      plan.execute(inn, out);
+      auto stop = std::chrono::steady_clock::now();
+      double time = std::chrono::duration<double>(stop - start).count();
+      if(ret < 0.0 || time < ret) {
+        ret = time;
+      }
+    }
+    return ret;
+  }
+
+  int repeat;
+  std::vector<int> block_sizes;
+};
@@ -0,0 +1,261 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <map>
+#include <chrono>
+#include <functional>
+#include <algorithm>
+#include <iostream>
+#include <iomanip>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#include "perf_counters.h"
+
+// A small benchmark harness.
+//
+// Every run is warmed up, then timed repeat times. The timings are reported
+// in microseconds as min, median and 95th percentile, along with the effective
+// bandwidth (bytes read plus bytes written, over the median) and how that
+// compares to a memcpy of the same size on the same machine. A ratio of 1.0
+// is memcpy speed.
+//
+// The timed runs are also counted with the hardware counters (see
+// perf_counters.h), reported per call, when there are any.
+//
+// Results are kept in the order they were run and can be printed as a table,
+// as JSON or as CSV, so that runs from different commits can be diffed.
+struct benchmark_t {
+  struct result_t {
+    std::string name;
+    std::string shape;
+    int64_t bytes;    // the size of the output
+    int repeat;
+    double min_us;
+    double median_us;
+    double p95_us;
+    double gbps;
+    double memcpy_ratio;
+    perf_stats_t counters; // per call
+  };
+
+  enum class format_t { table, json, csv };
+
+  benchmark_t(int warmup = 1, int repeat = 5):
+    warmup(warmup), repeat(std::max(1, repeat))
+  {}
+
+  // f should move bytes bytes from one buffer to another
+  result_t const& run(
+    std::string const& name,
+    std::string const& shape,
+    int64_t bytes,
+    std::function<void()> const& f)
+  {
+    perf_stats_t counters;
+    std::vector<double> times = time(f, &counters, 2 * bytes);
+    double baseline = memcpy_median_us(bytes);
+
+    result_t ret;
+    ret.name = name;
+    ret.shape = shape;
+    ret.bytes = bytes;
+    ret.repeat = repeat;
+    ret.min_us = times.front();
+    ret.median_us = times[times.size() / 2];
+    ret.p95_us = times[std::min(times.size() - 1, (95 * times.size() + 99) / 100 - 1)];
+    ret.gbps = 2.0 * bytes / (ret.median_us * 1e3);
+    ret.memcpy_ratio = baseline / ret.median_us;
+    ret.counters = per_call(counters);
+
+    results.push_back(ret);
+    return results.back();
+  }
+
+  std::vector<result_t> const& get_results() const { return results; }
+
+  void print(std::ostream& os, format_t format) const {
+    if(format == format_t::json) {
+      print_json(os);
+    } else if(format == format_t::csv) {
+      print_csv(os);
+    } else {
+      print_table(os);
+    }
+  }
+
+  static void print_table_header(std::ostream& os) {
+    os << std::left << std::setw(44) << "name" << std::setw(48) << "shape"
+       << std::right
+       << std::setw(12) << "min us"
+       << std::setw(12) << "median us"
+       << std::setw(12) << "p95 us"
+       << std::setw(10) << "GB/s"
+       << std::setw(10) << "/memcpy"
+       << std::setw(8)  << "cyc/B"
+       << std::setw(8)  << "IPC"
+       << std::setw(8)  << "L1/KB"
+       << std::setw(8)  << "LLC/KB"
+       << std::setw(8)  << "TLB/KB" << "\n";
+  }
+
+  static void print_table_row(std::ostream& os, result_t const& r) {
+    os << std::left << std::setw(44) << r.name << std::setw(48) << r.shape
+       << std::right << std::fixed
+       << std::setprecision(1)
+       << std::setw(12) << r.min_us
+       << std::setw(12) << r.median_us
+       << std::setw(12) << r.p95_us
+       << std::setprecision(2)
+       << std::setw(10) << r.gbps
+       << std::setw(10) << r.memcpy_ratio;
+
+    // Cycles per byte moved, instructions per cycle, and misses per KB moved
+    perf_stats_t const& c = r.counters;
+    if(c.available && c.bytes > 0 && c.cycles > 0) {
+      double kb = c.bytes / 1024.0;
+      os << std::setw(8) << double(c.cycles) / c.bytes
+         << std::setw(8) << double(c.instructions) / c.cycles
+         << std::setw(8) << c.l1d_misses / kb
+         << std::setw(8) << c.llc_misses / kb
+         << std::setw(8) << c.dtlb_misses / kb;
+    } else {
+      for(int i = 0; i != 5; ++i) {
+        os << std::setw(8) << "-";
+      }
+    }
+    os << "\n";
+    os.unsetf(std::ios::floatfield);
+  }
+
+private:
+  // The sorted timings of repeat runs, in microseconds. If counters isn't
+  // null, each timed run is counted into it as moving bytes bytes.
+  std::vector<double> time(
+    std::function<void()> const& f,
+    perf_stats_t* counters = nullptr,
+    uint64_t bytes = 0)
+  {
+    for(int i = 0; i != warmup; ++i) {
+      f();
+    }
+
+    std::vector<double> ret;
+    ret.reserve(repeat);
+    for(int i = 0; i != repeat; ++i) {
+      if(counters != nullptr) {
+        perf.start();
+      }
+      auto start = std::chrono::steady_clock::now();
+      f();
+      auto stop = std::chrono::steady_clock::now();
+      if(counters != nullptr) {
+        *counters += perf.stop(bytes);
+      }
+      ret.push_back(std::chrono::duration<double, std::micro>(stop - start).count());
+    }
+    std::sort(ret.begin(), ret.end());
+    return ret;
+  }
+
+  static perf_stats_t per_call(perf_stats_t total) {
+    if(total.calls > 1) {
+      total.cycles       /= total.calls;
+      total.instructions /= total.calls;
+      total.l1d_misses   /= total.calls;
+      total.llc_misses   /= total.calls;
+      total.dtlb_misses  /= total.calls;
+      total.bytes        /= total.calls;
+      total.calls = 1;
+    }
+    return total;
+  }
+
+  // Measured once per size
+  double memcpy_median_us(int64_t bytes) {
+    auto iter = memcpy_us.find(bytes);
+    if(iter != memcpy_us.end()) {
+      return iter->second;
+    }
+
+    int64_t alloc = ((bytes + 63) / 64) * 64;
+    char* inn = (char*)std::aligned_alloc(64, alloc);
+    char* out = (char*)std::aligned_alloc(64, alloc);
+    std::memset(inn, 1, bytes);
+    std::memset(out, 0, bytes);
+
+    std::vector<double> times = time([&] { std::memcpy(out, inn, bytes); });
+
+    std::free(inn);
+    std::free(out);
+
+    double ret = times[times.size() / 2];
+    memcpy_us.emplace(bytes, ret);
+    return ret;
+  }
+
+  static std::string escape(std::string const& s) {
+    std::string ret;
+    for(char c: s) {
+      if(c == '"' || c == '\\') {
+        ret += '\\';
+      }
+      ret += c;
+    }
+    return ret;
+  }
+
+  void print_table(std::ostream& os) const {
+    print_table_header(os);
+    for(auto const& r: results) {
+      print_table_row(os, r);
+    }
+  }
+
+  void print_json(std::ostream& os) const {
+    os << "[\n";
+    for(int i = 0; i != results.size(); ++i) {
+      auto const& r = results[i];
+      os << "  {\"name\": \"" << escape(r.name) << "\""
+         << ", \"shape\": \"" << escape(r.shape) << "\""
+         << ", \"bytes\": " << r.bytes
+         << ", \"repeat\": " << r.repeat
+         << ", \"min_us\": " << r.min_us
+         << ", \"median_us\": " << r.median_us
+         << ", \"p95_us\": " << r.p95_us
+         << ", \"gbps\": " << r.gbps
+         << ", \"memcpy_ratio\": " << r.memcpy_ratio
+         << ", \"counters\": " << (r.counters.available ? "true" : "false")
+         << ", \"cycles\": " << r.counters.cycles
+         << ", \"instructions\": " << r.counters.instructions
+         << ", \"l1d_misses\": " << r.counters.l1d_misses
+         << ", \"llc_misses\": " << r.counters.llc_misses
+         << ", \"dtlb_misses\": " << r.counters.dtlb_misses
+         << "}" << (i + 1 == results.size() ? "" : ",") << "\n";
+    }
+    os << "]\n";
+  }
+
+  void print_csv(std::ostream& os) const {
+    os << "name,shape,bytes,repeat,min_us,median_us,p95_us,gbps,memcpy_ratio,"
+       << "counters,cycles,instructions,l1d_misses,llc_misses,dtlb_misses\n";
+    for(auto const& r: results) {
+      os << "\"" << r.name << "\",\"" << r.shape << "\","
+         << r.bytes << "," << r.repeat << ","
+         << r.min_us << "," << r.median_us << "," << r.p95_us << ","
+         << r.gbps << "," << r.memcpy_ratio << ","
+         << int(r.counters.available) << ","
+         << r.counters.cycles << "," << r.counters.instructions << ","
+         << r.counters.l1d_misses << "," << r.counters.llc_misses << ","
+         << r.counters.dtlb_misses << "\n";
+    }
+  }
+
+  int warmup;
+  int repeat;
+  perf_counters_t perf;
+  std::vector<result_t> results;
+  std::map<int64_t, double> memcpy_us;
+};
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstdint>
+
+#if defined(__linux__)
+#include <unistd.h>
+#endif
+
+// Cache sizes of the machine we are running on, in bytes. On Linux these come
+// from sysconf; anywhere that doesn't know, a guess for a typical
+// desktop-class x86 core is used instead.
+
+inline int64_t cache_size_or(int name, int64_t fallback) {
+#if defined(__linux__)
+  long ret = sysconf(name);
+  if(ret > 0) {
+    return ret;
+  }
+#endif
+  return fallback;
+}
+
+inline int64_t l1_cache_bytes() {
+#if defined(_SC_LEVEL1_DCACHE_SIZE)
+  static int64_t ret = cache_size_or(_SC_LEVEL1_DCACHE_SIZE, 32 << 10);
+#else
+  static int64_t ret = 32 << 10;
+#endif
+  return ret;
+}
+
+inline int64_t l2_cache_bytes() {
+#if defined(_SC_LEVEL2_CACHE_SIZE)
+  static int64_t ret = cache_size_or(_SC_LEVEL2_CACHE_SIZE, 1 << 20);
+#else
+  static int64_t ret = 1 << 20;
+#endif
+  return ret;
+}
+
+// The last level cache
+inline int64_t llc_cache_bytes() {
+#if defined(_SC_LEVEL3_CACHE_SIZE)
+  static int64_t ret = cache_size_or(_SC_LEVEL3_CACHE_SIZE, l2_cache_bytes());
+#else
+  static int64_t ret = 32 << 20;
+#endif
+  return ret;
+}
+
+int constexpr cache_line_bytes = 64;
@@ -0,0 +1,238 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <utility>
+
+#include "simd_transpose.h"
+
+// Epilogues: elementwise functions that the permute applies on the way out,
+// out = e(permute(inn)), so that a scale, a cast or an activation after a
+// permute doesn't need its own pass over memory.
+//
+// Any function object that takes an input element will do; what it returns
+// is converted to the output element type. The ones here also take the
+// registers of the transpose kernels (__m128, __m256, __m512 of floats and
+// __m256d of doubles, whichever the compiler is allowed to emit), so they are
+// applied before the rows are stored (see simd_transpose.h). Elsewhere they are
+// applied one element at a time inside the leaf loops, where the data is
+// already in a register anyway.
+//
+// They compose with then: scale_t{0.5f}.then(to_bf16_t()) is x*0.5 rounded
+// to bf16.
+
+template <typename A, typename B>
+struct compose_epilogue_t;
+
+template <typename Self>
+struct epilogue_base_t {
+  template <typename B>
+  compose_epilogue_t<Self, B> then(B const& b) const {
+    return { static_cast<Self const&>(*this), b };
+  }
+};
+
+// b(a(x)); only as vectorized as both of them are
+template <typename A, typename B>
+struct compose_epilogue_t: epilogue_base_t<compose_epilogue_t<A, B>> {
+  compose_epilogue_t(A const& a, B const& b): a(a), b(b) {}
+
+  template <typename X>
+  auto operator()(X const& x) const -> decltype(std::declval<B const&>()(
+    std::declval<A const&>()(x)))
+  {
+    return b(a(x));
+  }
+
+  A a;
+  B b;
+};
+
+// x * alpha
+struct scale_t: epilogue_base_t<scale_t> {
+  // (a double, so that double tensors are scaled at full precision)
+  explicit scale_t(double alpha): alpha(alpha) {}
+
+  float  operator()(float  x) const { return x * float(alpha); }
+  double operator()(double x) const { return x * alpha; }
+#if defined(__SSE__)
+  __m128 operator()(__m128 x) const { return _mm_mul_ps(x, _mm_set1_ps(float(alpha))); }
+#endif
+#if defined(__AVX__)
+  __m256  operator()(__m256  x) const { return _mm256_mul_ps(x, _mm256_set1_ps(float(alpha))); }
+  __m256d operator()(__m256d x) const { return _mm256_mul_pd(x, _mm256_set1_pd(alpha)); }
+#endif
+#if defined(__AVX512F__)
+  __m512 operator()(__m512 x) const { return _mm512_mul_ps(x, _mm512_set1_ps(float(alpha))); }
+#endif
+
+  double alpha;
+};
+
+// x + beta
+struct add_scalar_t: epilogue_base_t<add_scalar_t> {
+  explicit add_scalar_t(float beta): beta(beta) {}
+
+  float  operator()(float  x) const { return x + beta; }
+  double operator()(double x) const { return x + double(beta); }
+#if defined(__SSE__)
+  __m128 operator()(__m128 x) const { return _mm_add_ps(x, _mm_set1_ps(beta)); }
+#endif
+#if defined(__AVX__)
+  __m256  operator()(__m256  x) const { return _mm256_add_ps(x, _mm256_set1_ps(beta)); }
+  __m256d operator()(__m256d x) const { return _mm256_add_pd(x, _mm256_set1_pd(beta)); }
+#endif
+#if defined(__AVX512F__)
+  __m512 operator()(__m512 x) const { return _mm512_add_ps(x, _mm512_set1_ps(beta)); }
+#endif
+
+  float beta;
+};
+
+// max(x, 0)
+struct relu_t: epilogue_base_t<relu_t> {
+  float  operator()(float  x) const { return x > 0.0f ? x : 0.0f; }
+  double operator()(double x) const { return x > 0.0  ? x : 0.0;  }
+#if defined(__SSE__)
+  __m128 operator()(__m128 x) const { return _mm_max_ps(x, _mm_setzero_ps()); }
+#endif
+#if defined(__AVX__)
+  __m256  operator()(__m256  x) const { return _mm256_max_ps(x, _mm256_setzero_ps()); }
+  __m256d operator()(__m256d x) const { return _mm256_max_pd(x, _mm256_setzero_pd()); }
+#endif
+#if defined(__AVX512F__)
+  __m512 operator()(__m512 x) const { return _mm512_max_ps(x, _mm512_setzero_ps()); }
+#endif
+};
+
+// float to bf16 (kept in a uint16_t), rounding to nearest even. NaNs stay
+// NaNs (quiet ones).
+struct to_bf16_t: epilogue_base_t<to_bf16_t> {
+  uint16_t operator()(float x) const {
+    uint32_t u;
+    std::memcpy(&u, &x, 4);
+    if(std::isnan(x)) {
+      return uint16_t((u >> 16) | 0x40);
+    }
+    u += 0x7FFF + ((u >> 16) & 1);
+    return uint16_t(u >> 16);
+  }
+
+#if defined(__AVX2__)
+  __m128i operator()(__m256 x) const {
+    __m256i u = _mm256_castps_si256(x);
+    __m256i lsb = _mm256_and_si256(_mm256_srli_epi32(u, 16), _mm256_set1_epi32(1));
+    __m256i r = _mm256_srli_epi32(
+      _mm256_add_epi32(u, _mm256_add_epi32(lsb, _mm256_set1_epi32(0x7FFF))), 16);
+    __m256i nan = _mm256_or_si256(_mm256_srli_epi32(u, 16), _mm256_set1_epi32(0x40));
+    r = _mm256_blendv_epi8(r, nan, _mm256_castps_si256(_mm256_cmp_ps(x, x, _CMP_UNORD_Q)));
+    // (packus works within 128 bit lanes, so gather the low halves)
+    __m256i p = _mm256_packus_epi32(r, r);
+    return _mm256_castsi256_si128(_mm256_permute4x64_epi64(p, 0x08));
+  }
+#endif
+#if defined(__AVX512F__)
+  __m256i operator()(__m512 x) const {
+    __m512i u = _mm512_castps_si512(x);
+    __m512i lsb = _mm512_and_si512(_mm512_srli_epi32(u, 16), _mm512_set1_epi32(1));
+    __m512i r = _mm512_srli_epi32(
+      _mm512_add_epi32(u, _mm512_add_epi32(lsb, _mm512_set1_epi32(0x7FFF))), 16);
+    __m512i nan = _mm512_or_si512(_mm512_srli_epi32(u, 16), _mm512_set1_epi32(0x40));
+    r = _mm512_mask_mov_epi32(r, _mm512_cmp_ps_mask(x, x, _CMP_UNORD_Q), nan);
+    return _mm512_cvtepi32_epi16(r);
+  }
+#endif
+};
+
+// float to IEEE half (kept in a uint16_t), rounding to nearest even. With
+// F16C this is the hardware conversion.
+struct to_fp16_t: epilogue_base_t<to_fp16_t> {
+  uint16_t operator()(float x) const {
+#if defined(__F16C__)
+    return uint16_t(_cvtss_sh(x, _MM_FROUND_TO_NEAREST_INT));
+#else
+    uint32_t u;
+    std::memcpy(&u, &x, 4);
+    uint32_t sign = (u >> 16) & 0x8000;
+    uint32_t a = u & 0x7FFFFFFF;
+    if(a >= 0x7F800000) {
+      // inf or NaN
+      return uint16_t(sign | (a > 0x7F800000 ? 0x7E00 : 0x7C00));
+    }
+    if(a >= 0x477FF000) {
+      // rounds to more than the largest half
+      return uint16_t(sign | 0x7C00);
+    }
+    if(a < 0x38800000) {
+      // a half subnormal (or zero); x * 2^24 is exact and lands on the
+      // encoding, rounded to nearest even by the default rounding mode
+      float f;
+      std::memcpy(&f, &a, 4);
+      return uint16_t(sign | uint32_t(std::nearbyint(f * 16777216.0f)));
+    }
+    // rebias the exponent from 127 to 15 and round off 13 bits of mantissa
+    a += 0xC8000FFF + ((a >> 13) & 1);
+    return uint16_t(sign | (a >> 13));
+#endif
+  }
+
+#if defined(__F16C__)
+  __m128i operator()(__m256 x) const {
+    return _mm256_cvtps_ph(x, _MM_FROUND_TO_NEAREST_INT);
+  }
+#endif
+#if defined(__AVX512F__)
+  __m256i operator()(__m512 x) const {
+    return _mm512_cvtps_ph(x, _MM_FROUND_TO_NEAREST_INT);
+  }
+#endif
+};
+
+// out = alpha*x + beta*out, for accumulating a permute into an existing
+// output (see is_accumulating in simd_transpose.h). The output is read, so
+// beta = 0 still turns NaNs already in it into NaNs; permute_t::accumulate
+// uses scale_t instead in that case.
+struct accumulate_t {
+  static constexpr bool accumulates = true;
+
+  // (doubles, so that double tensors accumulate at full precision; float
+  //  ones use them rounded to float)
+  accumulate_t(double alpha, double beta): alpha(alpha), beta(beta) {}
+
+  float operator()(float x, float old) const {
+    return float(alpha)*x + float(beta)*old;
+  }
+  double operator()(double x, double old) const {
+    return alpha*x + beta*old;
+  }
+#if defined(__SSE__)
+  __m128 operator()(__m128 x, __m128 old) const {
+    return _mm_add_ps(
+      _mm_mul_ps(_mm_set1_ps(float(alpha)), x),
+      _mm_mul_ps(_mm_set1_ps(float(beta)),  old));
+  }
+#endif
+#if defined(__AVX__)
+  __m256 operator()(__m256 x, __m256 old) const {
+    return _mm256_add_ps(
+      _mm256_mul_ps(_mm256_set1_ps(float(alpha)), x),
+      _mm256_mul_ps(_mm256_set1_ps(float(beta)),  old));
+  }
+  __m256d operator()(__m256d x, __m256d old) const {
+    return _mm256_add_pd(
+      _mm256_mul_pd(_mm256_set1_pd(alpha), x),
+      _mm256_mul_pd(_mm256_set1_pd(beta),  old));
+  }
+#endif
+#if defined(__AVX512F__)
+  __m512 operator()(__m512 x, __m512 old) const {
+    return _mm512_add_ps(
+      _mm512_mul_ps(_mm512_set1_ps(float(alpha)), x),
+      _mm512_mul_ps(_mm512_set1_ps(float(beta)),  old));
+  }
+#endif
+
+  double alpha;
+  double beta;
+};
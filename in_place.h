@@ -0,0 +1,75 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <utility>
+#include <cstdint>
+#include <cstring>
+
+#include "simd_transpose.h"
+
+// In-place kernels. Both work on one contiguous tensor of n elements of type
+// T with offsets computed in I (see index_type.h).
+
+// Move data[p] to data[dest(p)] for every p in [0,n), where dest is a
+// bijection on [0,n), by following each cycle of dest once. A bitmap of n
+// bits records which elements are already in place, so the only extra memory
+// is n/8 bytes. (visited is the bitmap; passing the same one to every call
+// saves allocating it each time.)
+template <typename I, typename T, typename F>
+void permute_cycles_in_place(I n, T* data, F dest, std::vector<uint64_t>& visited) {
+  visited.assign((int64_t(n) + 63) / 64, 0);
+  auto mark = [&](I p) { visited[p >> 6] |= uint64_t(1) << (p & 63); };
+  auto seen = [&](I p) { return (visited[p >> 6] >> (p & 63)) & 1; };
+
+  for(I start = 0; start != n; ++start) {
+    if(seen(start)) {
+      continue;
+    }
+    mark(start);
+
+    // carry the element that belongs at q around the cycle until it gets
+    // back to start
+    T carry = data[start];
+    for(I q = dest(start); q != start; q = dest(q)) {
+      std::swap(carry, data[q]);
+      mark(q);
+    }
+    data[start] = carry;
+  }
+}
+
+// Transpose the n x n matrix at data in place, a pair of block x block tiles
+// at a time. Each tile above the diagonal is transposed into a buffer, its
+// mirror below the diagonal is transposed into its place, and the buffer is
+// copied into the mirror's place, so the off-diagonal tiles still go through
+// the register tile kernels (see simd_transpose.h). The tiles on the diagonal
+// are transposed within themselves.
+template <typename I, typename T>
+void transpose_square_in_place(I n, T* data, int block) {
+  block = std::max(1, block);
+  std::vector<T> buffer(int64_t(block)*block);
+  for(I bj = 0; bj < n; bj += block) {
+    I ej = std::min(n, bj + I(block));
+    I nj = ej - bj;
+
+    for(I bi = 0; bi < bj; bi += block) {
+      I ei = std::min(n, bi + I(block));
+      I ni = ei - bi;
+      T* above = data + bi + n*bj;
+      T* below = data + bj + n*bi;
+      transpose_tile(ni, nj, above, n, buffer.data(), nj);
+      transpose_tile(nj, ni, below, n, above, n);
+      for(I i = 0; i != ni; ++i) {
+        std::memcpy(below + n*i, buffer.data() + nj*i, nj*sizeof(T));
+      }
+    }
+
+    // the diagonal tile
+    for(I j = bj; j != ej; ++j) {
+      for(I i = bj; i != j; ++i) {
+        std::swap(data[i + n*j], data[j + n*i]);
+      }
+    }
+  }
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <cstdint>
+#include <limits>
+
+// The kernels are templated on the integer type they do offset arithmetic in.
+// An int is what they always used and is the fast path, so int64_t is only
+// picked when some offset into the tensor could overflow an int.
+//
+// Calls f(int()) if every offset in [0, num_elems) fits in an int, and
+// f(int64_t()) otherwise; f is expected to be a generic lambda that takes the
+// index type from its argument:
+//   with_index_type(n, [&](auto i) { using I = decltype(i); ... });
+template <typename F>
+inline void with_index_type(int64_t num_elems, F f) {
+  if(num_elems <= int64_t(std::numeric_limits<int>::max()) + 1) {
+    f(int(0));
+  } else {
+    f(int64_t(0));
+  }
+}
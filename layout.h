@@ -0,0 +1,366 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <cassert>
+
+#include "permute.h"
+
+using std::vector;
+
+// Blocked layouts, like the NCHWc of convolution kernels or the MR x KC
+// panels of GEMM kernels, and conversions to and from them.
+//
+// A layout_t starts from a plain (column major) tensor with dims, splits
+// some of its axes into an inner block and an outer one, and then orders the
+// resulting axes. Splitting axis i with block b replaces it by two axes,
+// inner (b) and outer (ceil(dims[i]/b)), so a dims[i] that isn't a multiple
+// of b gets padded: the padding is zero when packing and ignored when
+// unpacking. reorder numbers the axes after splitting, a split axis being
+// its inner axis followed by its outer one. With W fastest, dims
+// [W,H,C,N] to NCHWc with c = 8 is
+//   layout_t({W,H,C,N}).split(2, 8).reorder({2,0,1,3,4})
+// and packing an M x K matrix into MR x KC panels is
+//   layout_t({M,K}).split(0, MR).split(1, KC).reorder({0,2,1,3})
+//
+// Without padding a split is just a reshape, so a conversion is a permute.
+// With it, every split axis is cut into its whole blocks and the last,
+// partial one, and each combination of those is a strided permute with the
+// given permute_t: 2^s of them for s axes with a partial block, each
+// element still read and written once. The padding is then zero filled a
+// run at a time. The permutes are planned as usual (and cached), so the
+// inner blocks get the register transposes or the contiguous runs kernel,
+// whichever fits. The default leaves are bigger than permute_t's usual
+// 1024, since the blocked side is strided in short pieces: with 4096 the
+// NCHWc and panel packs below come out level with or ahead of the plain
+// loop nests that write them.
+struct layout_t {
+  explicit layout_t(vector<int> const& dims):
+    dims(dims), blocks(dims.size(), 0)
+  {
+    for(int i = 0; i != dims.size(); ++i) {
+      order.push_back(i);
+    }
+  }
+
+  // The same layout with axis (of dims) split into an inner block of block
+  // and an outer one. Any earlier reorder is undone.
+  layout_t split(int axis, int block) const {
+    assert(blocks[axis] == 0 && block > 0);
+    layout_t ret = *this;
+    ret.blocks[axis] = block;
+    ret.order.clear();
+    for(int k = 0; k != ret.num_axes(); ++k) {
+      ret.order.push_back(k);
+    }
+    return ret;
+  }
+
+  // The same layout with the split axes in the given order; the blocked
+  // tensor's axis k is split axis order[k]
+  layout_t reorder(vector<int> const& order) const {
+    assert(order.size() == num_axes());
+    layout_t ret = *this;
+    ret.order = order;
+    return ret;
+  }
+
+  // The number of axes after splitting
+  int num_axes() const {
+    int ret = 0;
+    for(int const& b: blocks) {
+      ret += b > 0 ? 2 : 1;
+    }
+    return ret;
+  }
+
+  // The extents of the axes after splitting, and the stride of each in the
+  // plain tensor
+  vector<int> split_dims() const {
+    vector<int> ret;
+    for(int i = 0; i != dims.size(); ++i) {
+      if(blocks[i] > 0) {
+        ret.push_back(blocks[i]);
+        ret.push_back((dims[i] + blocks[i] - 1) / blocks[i]);
+      } else {
+        ret.push_back(dims[i]);
+      }
+    }
+    return ret;
+  }
+
+  vector<int64_t> plain_strides() const {
+    vector<int64_t> ret;
+    int64_t m = 1;
+    for(int i = 0; i != dims.size(); ++i) {
+      ret.push_back(m);
+      if(blocks[i] > 0) {
+        ret.push_back(m * blocks[i]);
+      }
+      m *= dims[i];
+    }
+    return ret;
+  }
+
+  // The dims of the blocked tensor, padding included
+  vector<int> blocked_dims() const {
+    vector<int> split = split_dims();
+    vector<int> ret;
+    for(int const& k: order) {
+      ret.push_back(split[k]);
+    }
+    return ret;
+  }
+
+  // The stride of each split axis in the blocked tensor
+  vector<int64_t> blocked_strides() const {
+    vector<int> split = split_dims();
+    vector<int64_t> ret(split.size());
+    int64_t m = 1;
+    for(int const& k: order) {
+      ret[k] = m;
+      m *= split[k];
+    }
+    return ret;
+  }
+
+  int64_t blocked_elems() const {
+    int64_t ret = 1;
+    for(int const& d: split_dims()) {
+      ret *= d;
+    }
+    return ret;
+  }
+
+  vector<int> dims;
+  vector<int> blocks; // 0 for the axes that aren't split
+  vector<int> order;
+};
+
+struct layout_convert_t {
+  explicit layout_convert_t(permute_t f = permute_t(4096)): f(f) {}
+
+  // plain (dims) to blocked (blocked_dims), padding with zeros
+  template <typename T>
+  void pack(layout_t const& layout, T const* plain, T* blocked) const {
+    static_assert(std::is_trivially_copyable<T>::value,
+      "permute_t only moves trivially copyable elements");
+    convert(layout, sizeof(T), plain, blocked, true);
+  }
+
+  void pack(layout_t const& layout, int elem_size, void const* plain, void* blocked) const {
+    convert(layout, elem_size, plain, blocked, true);
+  }
+
+  // The inverse: blocked to plain, leaving out the padding
+  template <typename T>
+  void unpack(layout_t const& layout, T const* blocked, T* plain) const {
+    static_assert(std::is_trivially_copyable<T>::value,
+      "permute_t only moves trivially copyable elements");
+    convert(layout, sizeof(T), blocked, plain, false);
+  }
+
+  void unpack(layout_t const& layout, int elem_size, void const* blocked, void* plain) const {
+    convert(layout, elem_size, blocked, plain, false);
+  }
+
+private:
+  void convert(
+    layout_t const& layout, int elem_size,
+    void const* inn, void* out, bool pack) const
+  {
+    int num_axes = layout.num_axes();
+    vector<int> split = layout.split_dims();
+    vector<int64_t> str_plain = layout.plain_strides();
+    vector<int64_t> str_blocked = layout.blocked_strides();
+    vector<int> const& order = layout.order;
+
+    // (an axis of extent 0 leaves nothing to move and no padding either)
+    for(int const& d: split) {
+      if(d == 0) {
+        return;
+      }
+    }
+
+    // Which split axis is the inner one of each axis with a partial block,
+    // and how much of that block there is
+    vector<int> partial;
+    vector<int> rem;
+    {
+      int k = 0;
+      for(int i = 0; i != layout.dims.size(); ++i) {
+        int b = layout.blocks[i];
+        if(b > 0 && layout.dims[i] % b != 0) {
+          partial.push_back(k);
+          rem.push_back(layout.dims[i] % b);
+        }
+        k += b > 0 ? 2 : 1;
+      }
+    }
+
+    vector<int> origin(num_axes);
+    vector<int> extent(num_axes);
+    for(int64_t piece = 0; piece != (int64_t(1) << partial.size()); ++piece) {
+      // The whole blocks of the partial axes, or the last block
+      extent = split;
+      std::fill(origin.begin(), origin.end(), 0);
+      bool empty = false;
+      for(int p = 0; p != partial.size(); ++p) {
+        int k = partial[p];
+        if(piece & (int64_t(1) << p)) {
+          extent[k] = rem[p];
+          origin[k+1] = split[k+1] - 1;
+          extent[k+1] = 1;
+        } else {
+          extent[k+1] = split[k+1] - 1;
+          empty = empty || extent[k+1] == 0;
+        }
+      }
+      if(empty) {
+        continue;
+      }
+
+      // A plan batches over one outermost unpermuted dimension. When there
+      // are more of those that don't fuse (as the outer block and N of
+      // NCHWc do, once C is padded), all but the last are looped over here
+      // so that each call is a batch of the plain permute underneath.
+      vector<int> outer;
+      for(int k = num_axes - 2; k >= 0 && order[k] == k && order[k+1] == k+1; --k) {
+        bool fuses =
+          str_plain[k+1]   == str_plain[k]   * extent[k] &&
+          str_blocked[k+1] == str_blocked[k] * extent[k];
+        if(!fuses && extent[k] > 1) {
+          outer.push_back(k);
+        }
+      }
+      vector<int> counts;
+      for(int const& k: outer) {
+        counts.push_back(extent[k]);
+        extent[k] = 1;
+      }
+
+      vector<int> idx(outer.size(), 0);
+      do {
+        vector<int> at = origin;
+        for(int j = 0; j != outer.size(); ++j) {
+          at[outer[j]] += idx[j];
+        }
+        run_piece(layout, at, extent, elem_size, inn, out, pack);
+      } while(increment(idx, counts));
+    }
+
+    if(pack) {
+      // The padding of each partial axis: the rest of its last block, for
+      // everything along the other axes
+      for(int p = 0; p != partial.size(); ++p) {
+        int k = partial[p];
+        std::fill(origin.begin(), origin.end(), 0);
+        extent = split;
+        origin[k] = rem[p];
+        extent[k] = split[k] - rem[p];
+        origin[k+1] = split[k+1] - 1;
+        extent[k+1] = 1;
+        zero_box(layout, origin, extent, elem_size, (char*)out);
+      }
+    }
+  }
+
+  // Convert the box at origin with extent (by split axis) with one permute
+  void run_piece(
+    layout_t const& layout,
+    vector<int> const& origin, vector<int> const& extent,
+    int elem_size, void const* inn, void* out, bool pack) const
+  {
+    int num_axes = layout.num_axes();
+    vector<int64_t> str_plain = layout.plain_strides();
+    vector<int64_t> str_blocked = layout.blocked_strides();
+    vector<int> const& order = layout.order;
+
+    int64_t at_plain = 0;
+    int64_t at_blocked = 0;
+    for(int k = 0; k != num_axes; ++k) {
+      at_plain   += origin[k] * str_plain[k];
+      at_blocked += origin[k] * str_blocked[k];
+    }
+
+    if(pack) {
+      // (the plain tensor's split axes, to the blocked order)
+      vector<int64_t> strides_out;
+      for(int const& k: order) {
+        strides_out.push_back(str_blocked[k]);
+      }
+      f(extent, order, str_plain, strides_out, elem_size,
+        (char const*)inn + at_plain * elem_size,
+        (char*)out + at_blocked * elem_size);
+    } else {
+      vector<int> dims_b;
+      vector<int64_t> strides_inn;
+      vector<int> perm(num_axes);
+      for(int k = 0; k != num_axes; ++k) {
+        dims_b.push_back(extent[order[k]]);
+        strides_inn.push_back(str_blocked[order[k]]);
+        perm[order[k]] = k;
+      }
+      f(dims_b, perm, strides_inn, str_plain, elem_size,
+        (char const*)inn + at_blocked * elem_size,
+        (char*)out + at_plain * elem_size);
+    }
+  }
+
+  // Column major increment of idx within counts; false once it wraps around
+  static bool increment(vector<int>& idx, vector<int> const& counts) {
+    for(int i = 0; i != int(idx.size()); ++i) {
+      if(++idx[i] != counts[i]) {
+        return true;
+      }
+      idx[i] = 0;
+    }
+    return false;
+  }
+
+  // Zero the box of the blocked tensor at origin with extent (by split
+  // axis), a contiguous run along its innermost axis at a time
+  static void zero_box(
+    layout_t const& layout,
+    vector<int> const& origin, vector<int> const& extent,
+    int elem_size, char* out)
+  {
+    vector<int> const& order = layout.order;
+    vector<int64_t> str_blocked = layout.blocked_strides();
+    int n = order.size();
+    for(int const& x: extent) {
+      if(x == 0) {
+        return;
+      }
+    }
+
+    int64_t at = 0;
+    for(int k = 0; k != n; ++k) {
+      at += origin[k] * str_blocked[k];
+    }
+    int64_t run = int64_t(extent[order[0]]) * elem_size;
+
+    vector<int> idx(n, 0);
+    while(true) {
+      int64_t pos = at;
+      for(int j = 1; j != n; ++j) {
+        pos += idx[j] * str_blocked[order[j]];
+      }
+      std::memset(out + pos * elem_size, 0, run);
+
+      int j = 1;
+      for(; j != n; ++j) {
+        if(++idx[j] != extent[order[j]]) {
+          break;
+        }
+        idx[j] = 0;
+      }
+      if(j == n) {
+        return;
+      }
+    }
+  }
+
+  permute_t f;
+};
@@ -3,10 +3,26 @@
 #include <chrono>
 #include <tuple>
 #include <string>
+#include <sstream>
 #include <functional>
-
+#include <cstring>
+#include <cstdint>
+#include <cstdlib>
+#include <cstdio>
+#include <cmath>
+#include <limits>
+
+#include "thread_pool.h"
 #include "transpose.h"
 #include "permute.h"
+#include "allocator.h"
+#include "out_of_core.h"
+#include "permute_stream.h"
+#include "permute_async.h"
+#include "layout.h"
+#include "tensor.h"
+#include "autotune.h"
+#include "benchmark.h"
 #include "print_vector.h"
 
 using std::vector;
@@ -39,52 +55,15 @@ T product(vector<T> const& ts) {
   return ret;
 }
 
-struct tensor_t {
-  tensor_t(std::vector<int> dims, float* data):
-    dims(dims), own(false), data(data)
-  {}
-
-  tensor_t(std::vector<int> dims):
-    dims(dims), own(true)
-  {
-    int sz = product(dims);
-    data = new float[sz];
-    std::fill(data, data + sz, 0.0);
-  }
-
-  float& operator[](std::vector<int> const& idx) {
-    int p = 1;
-    int total = 0;
-    for(int i = 0; i != dims.size(); ++i) {
-      total += p*idx[i];
-      p *= dims[i];
-    }
-    return data[total];
-  }
-
-  int size() const {
-    return product(dims);
-  }
-
-  ~tensor_t() {
-    if(own)
-      delete[] data;
-  }
-
-  vector<int> dims;
-  float* data;
-  bool own;
-};
-
 struct indexer_t {
   indexer_t(vector<int> const& szs_):
     szs(szs_),
     idx(szs_.size(), 0)
   {}
 
-  int operator()() const {
-    int p = 1;
-    int total = 0;
+  int64_t operator()() const {
+    int64_t p = 1;
+    int64_t total = 0;
     for(int i = 0; i != idx.size(); ++i) {
       total += p*idx[i];
       p *= szs[i];
@@ -175,57 +154,6 @@ void test_permutation(vector<int> dims, vector<int> perm, permute_f f) {
   std::cout << "Was it correct? " << (check(perm, inn, out) ? "yes" : "no") << std::endl;
 }
 
-void performance_transpose(
-  int repeat,
-  int ni, int nj,
-  vector<tuple<string, transpose_f>> tests)
-{
-  std::cout << "Initializing..." << std::endl;
-
-  tensor_t inn({ni,nj});
-  tensor_t out({nj,ni});
-
-  for(int i = 0; i != ni; ++i) {
-  for(int j = 0; j != nj; ++j) {
-    inn[{i,j}] = 1 + i + 7*j;
-  }}
-
-  std::cout << "Running..." << std::endl;
-  for(auto const& [msg, f]: tests) {
-    for(int i = 0; i != repeat; ++i) {
-      raii_timer_t timer(msg);
-      f(ni, nj, inn.data, out.data);
-    }
-  }
-
-}
-
-void performance_permute(
-  int repeat,
-  vector<int> dims,
-  vector<int> perm,
-  vector<tuple<string, permute_f>> tests)
-{
-  std::cout << "Initializing..." << std::endl;
-
-  tensor_t inn(dims);
-  tensor_t out(permute(perm, dims));
-
-  indexer_t indexer(dims);
-  float cnt = 1.0;
-  do {
-    inn[indexer.idx] = cnt++;
-  } while(indexer.increment());
-
-  std::cout << "Running..." << std::endl;
-  for(auto const& [msg, f]: tests) {
-    for(int i = 0; i != repeat; ++i) {
-      raii_timer_t timer(msg);
-      f(dims, perm, inn.data, out.data);
-    }
-  }
-}
-
 void exp01() {
   vector<char> x{'i','j','k'};
   std::cout << x << "->" << permute({2,0,1}, x) << std::endl;
@@ -238,11 +166,11 @@ void exp02() {
   auto test = test_transpose;
 
   std::cout << "Naive hit inn -----------------------------------\n";
-  test(nx, ny, naive_hit_inn);
+  test(nx, ny, naive_hit_inn<float>);
   std::cout << std::endl;
 
   std::cout << "Naive hit out -----------------------------------\n";
-  test(nx, ny, naive_hit_inn);
+  test(nx, ny, naive_hit_inn<float>);
   std::cout << std::endl;
 
   std::cout << "With blocks 1 -----------------------------------\n";
@@ -278,6 +206,84 @@ void exp02() {
   std::cout << std::endl;
 }
 
+// Element types that aren't float. Every element gets a distinct byte
+// pattern, and every byte has to land where perm says.
+template <int N>
+struct opaque_t {
+  unsigned char data[N];
+};
+
+template <typename T>
+bool check_bytes(
+  vector<int> const& dims, vector<int> const& perm,
+  vector<T> const& inn, vector<T> const& out)
+{
+  // (an indexer always visits at least one index)
+  if(inn.empty()) {
+    return out.empty();
+  }
+  vector<int> out_dims = permute(perm, dims);
+  indexer_t indexer(dims);
+  do {
+    vector<int> idx_out = permute(perm, indexer.idx);
+    int64_t off_out = 0;
+    int64_t p = 1;
+    for(int i = 0; i != out_dims.size(); ++i) {
+      off_out += p*idx_out[i];
+      p *= out_dims[i];
+    }
+    if(std::memcmp(&inn[indexer()], &out[off_out], sizeof(T)) != 0) {
+      return false;
+    }
+  } while(indexer.increment());
+  return true;
+}
+
+template <typename T>
+vector<T> make_elems(int64_t n) {
+  vector<T> ret(n);
+  unsigned char* bytes = (unsigned char*)ret.data();
+  for(int64_t i = 0; i != n*int64_t(sizeof(T)); ++i) {
+    bytes[i] = (7*i + i/sizeof(T)) % 251;
+  }
+  return ret;
+}
+
+template <typename T>
+void test_permutation_elems(vector<int> dims, vector<int> perm, permute_t f) {
+  int64_t n = 1;
+  for(int const& d: dims) {
+    n *= d;
+  }
+  vector<T> inn = make_elems<T>(n);
+  vector<T> out(n);
+
+  std::cout << "Test dims = " << dims << ", element size " << sizeof(T) << std::endl;
+
+  f(dims, perm, inn.data(), out.data());
+  bool typed = check_bytes(dims, perm, inn, out);
+
+  std::fill((unsigned char*)out.data(), (unsigned char*)(out.data() + n), 0);
+  f(dims, perm, sizeof(T), inn.data(), out.data());
+  bool untyped = check_bytes(dims, perm, inn, out);
+
+  std::cout << "Was it correct? " << (typed && untyped ? "yes" : "no") << std::endl;
+}
+
+template <typename T>
+void test_transpose_elems(int ni, int nj, recursive_t f) {
+  vector<T> inn = make_elems<T>(int64_t(ni)*nj);
+  vector<T> out(int64_t(ni)*nj);
+
+  std::cout << "Test [num rows = " << ni << ", num cols = " << nj << "]"
+    << ", element size " << sizeof(T) << std::endl;
+
+  f(ni, nj, inn.data(), out.data());
+
+  std::cout << "Was it correct? "
+    << (check_bytes({ni,nj}, {1,0}, inn, out) ? "yes" : "no") << std::endl;
+}
+
 void exp03() {
   std::cout << "Permute 1024, rank 4" << std::endl;
   test_permutation({4,5,6,7,8}, {4,3,2,1,0}, permute_t(1024));
@@ -330,44 +336,1989 @@ void exp03() {
   std::cout << "Permute, fuse 3" << std::endl;
   test_permutation({2,2,2,2,2}, {0,1,4,2,3}, permute_t(1024));
   std::cout << std::endl;
+
+  std::cout << "Permute 64, rank 6" << std::endl;
+  test_permutation({2,3,4,3,2,3}, {5,4,3,2,1,0}, permute_t(64));
+  std::cout << std::endl;
+
+  std::cout << "Permute 64, rank 8" << std::endl;
+  test_permutation({2,3,2,3,2,3,2,3}, {1,3,5,7,0,2,4,6}, permute_t(64));
+  std::cout << std::endl;
+
+  std::cout << "Permute 64, rank 10" << std::endl;
+  test_permutation({2,3,2,3,2,3,2,3,2,3}, {9,8,7,6,5,4,3,2,1,0}, permute_t(64));
+  std::cout << std::endl;
+}
+
+
+void exp04() {
+  thread_pool_t pool(4);
+
+  std::cout << "Parallel recursive 4, grain 8" << std::endl;
+  test_transpose(37, 101, recursive_t(4, pool, 8));
+  std::cout << std::endl;
+
+  std::cout << "Parallel permute 16, grain 64, rank 5" << std::endl;
+  test_permutation({4,5,6,7,8}, {4,3,2,1,0}, permute_t(16, pool, 64));
+  std::cout << std::endl;
+
+  std::cout << "Parallel permute 16, grain 64, rank 4 batch" << std::endl;
+  test_permutation({4,5,6,7,3}, {2,1,0,3,4}, permute_t(16, pool, 64));
+  std::cout << std::endl;
+
+  std::cout << "Parallel permute 1024, grain 1, rank 2" << std::endl;
+  test_permutation({300,70}, {1,0}, permute_t(1024, pool, 1));
+  std::cout << std::endl;
+}
+
+void exp05() {
+  // Sizes that hit the 16x16, 8x8 and 4x4 register tiles and the scalar edges
+  for(auto const& [ni, nj]: vector<tuple<int,int>>{ {16,16}, {8,8}, {4,4}, {3,5}, {37,101}, {100,45} }) {
+    std::cout << "Recursive 32, register tiles" << std::endl;
+    test_transpose(ni, nj, recursive_t(32));
+    std::cout << std::endl;
+
+    std::cout << "With blocks 16, register tiles" << std::endl;
+    test_transpose(ni, nj, with_blocks_t(16));
+    std::cout << std::endl;
+
+    std::cout << "Permute 1024, register tiles" << std::endl;
+    test_permutation({ni, nj}, {1,0}, permute_t(1024));
+    std::cout << std::endl;
+  }
+}
+
+void exp06() {
+  thread_pool_t pool(3);
+
+  vector<tuple<vector<int>, vector<int>>> cases {
+    { {4,5,6,7},   {2,3,1,0} },
+    { {4,5,6,7,3}, {1,0,2,3,4} },
+    { {30,40},     {1,0} },
+    { {4,5},       {0,1} }
+  };
+
+  for(auto const& [dims, perm]: cases) {
+    permute_plan_t plan(dims, perm, 256);
+    auto f = [&plan](vector<int>, vector<int>, float* inn, float* out) {
+      plan.execute(inn, out);
+    };
+    auto g = [&plan, &pool](vector<int>, vector<int>, float* inn, float* out) {
+      plan.execute(inn, out, pool, 100);
+    };
+
+    std::cout << "Plan, executed twice" << std::endl;
+    test_permutation(dims, perm, f);
+    test_permutation(dims, perm, f);
+    std::cout << std::endl;
+
+    std::cout << "Plan, executed in parallel" << std::endl;
+    test_permutation(dims, perm, g);
+    std::cout << std::endl;
+  }
+
+  // Leaves of one element, more than a plan keeps, so the kept tiles are
+  // recursed into as they run
+  for(auto const& [dims, perm]: vector<tuple<vector<int>, vector<int>>>{
+    { {300,300},   {1,0}   },
+    { {50,40,40},  {2,0,1} },
+    { {20,50,90},  {0,2,1} }
+  }) {
+    permute_plan_t plan(dims, perm, 4);
+    auto f = [&plan](vector<int>, vector<int>, float* inn, float* out) {
+      plan.execute(inn, out);
+    };
+    auto g = [&plan, &pool](vector<int>, vector<int>, float* inn, float* out) {
+      plan.execute(inn, out, pool, 1000);
+    };
+
+    std::cout << "Plan with " << plan.get_num_tiles() << " tiles, at most "
+      << permute_plan_t::max_tiles << "? "
+      << (plan.get_num_tiles() <= permute_plan_t::max_tiles ? "yes" : "no") << std::endl;
+    test_permutation(dims, perm, f);
+    test_permutation(dims, perm, g);
+    std::cout << std::endl;
+  }
+}
+
+void print_cache_stats(permute_plan_cache_t const& cache) {
+  auto const& [hits, misses, evictions, size, bytes] = cache.stats();
+  std::cout << "hits " << hits << ", misses " << misses
+    << ", evictions " << evictions << ", size " << size
+    << ", bytes " << bytes << std::endl;
 }
 
+void exp07() {
+  auto& global = permute_plan_cache_t::global();
+  global.clear();
 
+  std::cout << "Cached permute, same shape three times" << std::endl;
+  for(int i = 0; i != 3; ++i) {
+    test_permutation({4,5,6,7}, {2,3,1,0}, permute_t(64));
+  }
+  print_cache_stats(global);
+  std::cout << std::endl;
+
+  std::cout << "Plan cache with capacity 2" << std::endl;
+  permute_plan_cache_t cache(2);
+  cache.get({4,5},   {1,0},   256);
+  cache.get({4,5,6}, {2,1,0}, 256);
+  cache.get({4,5},   {1,0},   256);
+  cache.get({6,7},   {1,0},   256); // evicts {4,5,6}
+  cache.get({4,5,6}, {2,1,0}, 256);
+  print_cache_stats(cache);
+  std::cout << std::endl;
 
-int main() {
-  exp03();
+  // Room for the small plans but not the big one, which still works
+  std::cout << "Plan cache bounded by bytes" << std::endl;
+  permute_plan_cache_t bounded(64, 16 << 10);
+  auto small = bounded.get({40,50}, {1,0}, 4096);
+  bounded.get({4,5,6}, {2,1,0}, 256);
+  auto big = bounded.get({300,300}, {1,0}, 4);
+  int64_t held = bounded.stats().bytes;
+  bool correct = big->get_bytes() > (16 << 10) && bounded.stats().size == 2 &&
+    held == small->get_bytes() + bounded.get({4,5,6}, {2,1,0}, 256)->get_bytes();
+  test_permutation({300,300}, {1,0}, [&big](vector<int>, vector<int>, float* inn, float* out) {
+    big->execute(inn, out);
+  });
+  bounded.set_max_bytes(held - 1);
+  correct = correct && bounded.stats().size == 1 && bounded.stats().bytes < held;
+  print_cache_stats(bounded);
+  std::cout << "Was it correct? " << (correct ? "yes" : "no") << std::endl;
+  std::cout << std::endl;
+}
+
+void exp08() {
+  // Forcing the 64 bit offsets on small tensors, since the sizes that need
+  // them don't fit in memory here
+  vector<tuple<vector<int>, vector<int>>> cases {
+    { {4,5,6,7,8}, {4,3,2,1,0} },
+    { {37,101},    {1,0} },
+    { {4,5,6,7,3}, {1,0,2,3,4} }
+  };
+
+  for(auto const& [dims, perm]: cases) {
+    permute_plan_t plan(dims, perm, 256, sizeof(float), 0, store_mode_t::regular, true);
+    std::cout << "Plan with 64 bit offsets" << std::endl;
+    test_permutation(dims, perm,
+      [&plan](vector<int>, vector<int>, float* inn, float* out) {
+        plan.execute(inn, out);
+      });
+    std::cout << std::endl;
+  }
+
+  std::cout << "Transpose tiles, 64 bit offsets" << std::endl;
+  test_transpose(37, 101, [](int ni, int nj, float* inn, float* out) {
+    for(int64_t j = 0; j < nj; j += 16) {
+    for(int64_t i = 0; i < ni; i += 16) {
+      transpose_tile(
+        std::min(int64_t(16), ni - i), std::min(int64_t(16), nj - j),
+        inn + i + ni*j, int64_t(ni),
+        out + j + nj*i, int64_t(nj));
+    }}
+  });
+  std::cout << std::endl;
+}
+
+void exp09() {
+  std::cout << "Element types, rank 5" << std::endl;
+  test_permutation_elems<uint8_t>    ({4,5,6,7,8}, {4,3,2,1,0}, permute_t(64));
+  test_permutation_elems<uint16_t>   ({4,5,6,7,8}, {4,3,2,1,0}, permute_t(64));
+  test_permutation_elems<double>     ({4,5,6,7,8}, {4,3,2,1,0}, permute_t(64));
+  test_permutation_elems<opaque_t<6>>({4,5,6,7,8}, {4,3,2,1,0}, permute_t(64));
+  test_permutation_elems<opaque_t<12>>({4,5,6,7,8}, {4,3,2,1,0}, permute_t(64));
+  test_permutation_elems<opaque_t<16>>({4,5,6,7,8}, {4,3,2,1,0}, permute_t(64));
+  test_permutation_elems<opaque_t<40>>({4,5,6,7,8}, {4,3,2,1,0}, permute_t(64));
+  std::cout << std::endl;
+
+  std::cout << "Element types, transposes and fusing" << std::endl;
+  test_permutation_elems<uint8_t>    ({37,101},  {1,0},   permute_t(1024));
+  test_permutation_elems<double>     ({37,101},  {1,0},   permute_t(1024));
+  test_permutation_elems<opaque_t<3>>({37,101},  {1,0},   permute_t(1024));
+  test_permutation_elems<opaque_t<24>>({5,6,7},  {0,2,1}, permute_t(64));
+  test_permutation_elems<uint16_t>   ({5,6,7,3}, {1,0,2,3}, permute_t(64));
+  test_permutation_elems<opaque_t<5>>({5,6},     {0,1},   permute_t(64));
+  std::cout << std::endl;
+
+  std::cout << "Element types, recursive transpose" << std::endl;
+  test_transpose_elems<uint8_t>     (37, 101, recursive_t(32));
+  test_transpose_elems<uint16_t>    (37, 101, recursive_t(32));
+  test_transpose_elems<double>      (37, 101, recursive_t(32));
+  test_transpose_elems<opaque_t<16>>(37, 101, recursive_t(32));
+  std::cout << std::endl;
+}
+
+void exp10() {
+  std::cout << "Streaming stores" << std::endl;
+  permute_t streaming = permute_t(64).with_stores(store_mode_t::streaming);
+  test_permutation({4,5,6,7,8}, {4,3,2,1,0}, streaming);
+  test_permutation({37,101},    {1,0},       streaming);
+  test_permutation({64,100},    {1,0},       permute_t(1024).with_stores(store_mode_t::streaming));
+  test_permutation({5,6,7},     {0,2,1},     streaming);
+  test_permutation({4,5,6,7},   {2,3,1,0},   streaming);
+  test_permutation({4,5},       {0,1},       streaming);
+  test_permutation({2,3,2,3,2,3,2,3,2,3}, {9,8,7,6,5,4,3,2,1,0}, streaming);
+  test_permutation_elems<uint8_t>     ({4,5,6,7,8}, {4,3,2,1,0}, streaming);
+  test_permutation_elems<double>      ({37,101},    {1,0},       streaming);
+  test_permutation_elems<opaque_t<16>>({4,5,6,7,8}, {4,3,2,1,0}, streaming);
+  std::cout << std::endl;
+
+  std::cout << "Streaming stores, parallel" << std::endl;
+  thread_pool_t pool(4);
+  test_permutation({4,5,6,7,8}, {4,3,2,1,0},
+    permute_t(16, pool, 64).with_stores(store_mode_t::streaming));
+  test_permutation({300,70}, {1,0},
+    permute_t(1024, pool, 1).with_stores(store_mode_t::streaming));
+  std::cout << std::endl;
+
+  std::cout << "Streaming stores, recursive transpose" << std::endl;
+  test_transpose(37, 101, recursive_t(8).with_stores(store_mode_t::streaming));
+  test_transpose(300, 700, recursive_t(32).with_stores(store_mode_t::streaming));
+  test_transpose(300, 700, recursive_t(32, pool, 1000).with_stores(store_mode_t::streaming));
+  test_transpose_elems<double>(37, 101, recursive_t(32).with_stores(store_mode_t::streaming));
+  std::cout << std::endl;
+}
+
+void print_setting(permute_tuning_t::setting_t const& setting) {
+  std::cout << "min_block_size " << setting.min_block_size << ", "
+    << (setting.stores == store_mode_t::streaming ? "streaming" : "regular")
+    << " stores" << std::endl;
+}
+
+void exp11() {
+  std::cout << "Shape classes" << std::endl;
+  auto print_class = [](permute_tuning_t::class_t const& c) {
+    std::cout << "rank " << c[0] << ", carrier " << c[1] << ", batched " << c[2]
+      << ", log2 bytes " << c[3] << std::endl;
+  };
+  print_class(permute_tuning_t::shape_class({30,40},       {1,0}));
+  print_class(permute_tuning_t::shape_class({2,2,2,2,2},   {4,0,1,2,3}));
+  print_class(permute_tuning_t::shape_class({4,5,6,7,3},   {1,0,2,3,4}));
+  print_class(permute_tuning_t::shape_class({30,40},       {1,0}, 6));
+  std::cout << std::endl;
+
+  std::cout << "Tuning, nearest size and save/load" << std::endl;
+  permute_tuning_t tuning;
+  tuning.set(permute_tuning_t::shape_class({30,40},   {1,0}), { 64,  store_mode_t::regular });
+  tuning.set(permute_tuning_t::shape_class({300,400}, {1,0}), { 512, store_mode_t::streaming });
+  print_setting(tuning.lookup(permute_tuning_t::shape_class({32,40},   {1,0}), { 1, store_mode_t::regular }));
+  print_setting(tuning.lookup(permute_tuning_t::shape_class({200,400}, {1,0}), { 1, store_mode_t::regular }));
+  print_setting(tuning.lookup(permute_tuning_t::shape_class({4,5,6},   {2,1,0}), { 1, store_mode_t::regular }));
+
+  std::string path = "permute_tuning_exp11.txt";
+  tuning.save(path);
+  permute_tuning_t loaded(path);
+  std::remove(path.c_str());
+  std::cout << "Same after load? "
+    << (loaded.get_settings().size() == 2 &&
+        loaded.lookup(permute_tuning_t::shape_class({300,400}, {1,0}), { 1, store_mode_t::regular }).min_block_size == 512
+          ? "yes" : "no")
+    << std::endl;
+  std::cout << std::endl;
+
+  std::cout << "Autotuned permute" << std::endl;
+  autotuner_t tuner(1, {16, 256});
+  print_setting(tuner.tune({4,5,6,7}, {2,3,1,0}));
+  print_setting(tuner.tune({37,101},  {1,0}, sizeof(double)));
+  test_permutation({4,5,6,7}, {2,3,1,0}, permute_t(0));
+  test_permutation({4,5,6,7,8}, {4,3,2,1,0}, permute_t(0));
+  test_permutation_elems<double>({37,101}, {1,0}, permute_t(0));
+  std::cout << std::endl;
+
+  // Back to what was on disk for the benchmarks
+  permute_tuning_t::global().clear();
+  permute_tuning_t::global().load(permute_tuning_t::default_path());
+}
+
+void print_perf_stats(perf_stats_t const& stats) {
+  std::cout << "calls " << stats.calls << ", bytes " << stats.bytes;
+  if(stats.available) {
+    std::cout << ", cycles " << stats.cycles
+      << ", instructions " << stats.instructions
+      << ", L1d misses " << stats.l1d_misses
+      << ", LLC misses " << stats.llc_misses
+      << ", dTLB misses " << stats.dtlb_misses;
+  } else {
+    std::cout << ", no hardware counters";
+  }
+  std::cout << std::endl;
+}
+
+void exp12() {
+  std::cout << "Hardware counters" << std::endl;
+  perf_stats_t permute_stats;
+  permute_t counted = permute_t(64).with_counters(permute_stats);
+  test_permutation({4,5,6,7,8}, {4,3,2,1,0}, counted);
+  test_permutation({37,101},    {1,0},       counted);
+  test_permutation_elems<double>({4,5,6}, {2,0,1}, counted);
+  print_perf_stats(permute_stats);
+
+  perf_stats_t transpose_stats;
+  test_transpose(300, 700, recursive_t(32).with_counters(transpose_stats));
+  print_perf_stats(transpose_stats);
+  std::cout << std::endl;
+}
+
+// In place: copy the input over to out, then permute out where it is
+permute_f in_place_permute(permute_t f) {
+  return [f](vector<int> dims, vector<int> perm, float* inn, float* out) {
+    std::copy(inn, inn + product(vector<int64_t>(dims.begin(), dims.end())), out);
+    f.in_place(dims, perm, out);
+  };
+}
+
+transpose_f in_place_transpose(transpose_in_place_t f) {
+  return [f](int ni, int nj, float* inn, float* out) {
+    std::copy(inn, inn + int64_t(ni)*nj, out);
+    f(ni, nj, out);
+  };
+}
+
+template <typename T>
+void test_in_place_elems(vector<int> dims, vector<int> perm, permute_t f) {
+  int64_t n = product(vector<int64_t>(dims.begin(), dims.end()));
+  vector<T> inn = make_elems<T>(n);
+  vector<T> out = inn;
+
+  std::cout << "Test dims = " << dims << ", element size " << sizeof(T) << std::endl;
+
+  f.in_place(dims, perm, out.data());
+
+  std::cout << "Was it correct? "
+    << (check_bytes(dims, perm, inn, out) ? "yes" : "no") << std::endl;
+}
+
+void exp13() {
+  std::cout << "In place permute" << std::endl;
+  permute_t f(64);
+  test_permutation({4,5,6,7,8}, {4,3,2,1,0}, in_place_permute(f));
+  test_permutation({37,101},    {1,0},       in_place_permute(f));
+  test_permutation({64,64},     {1,0},       in_place_permute(f));
+  test_permutation({45,45,3},   {1,0,2},     in_place_permute(f));
+  test_permutation({5,6,7,3},   {2,0,1,3},   in_place_permute(f));
+  test_permutation({4,5},       {0,1},       in_place_permute(f));
+  test_permutation({2,3,2,3,2,3,2,3,2,3}, {9,8,7,6,5,4,3,2,1,0}, in_place_permute(f));
+  test_in_place_elems<uint8_t>     ({4,5,6,7,8}, {4,3,2,1,0}, f);
+  test_in_place_elems<double>      ({37,37},     {1,0},       f);
+  test_in_place_elems<opaque_t<12>>({4,5,6},     {2,0,1},     f);
+  std::cout << std::endl;
+
+  std::cout << "In place transpose" << std::endl;
+  test_transpose(37, 101, in_place_transpose(transpose_in_place_t(8)));
+  test_transpose(100, 100, in_place_transpose(transpose_in_place_t(8)));
+  test_transpose(101, 101, in_place_transpose(transpose_in_place_t(32)));
+  test_transpose(1, 50, in_place_transpose(transpose_in_place_t(32)));
+  std::cout << std::endl;
+}
+
+vector<int64_t> dense_strides(vector<int> const& dims) {
+  vector<int64_t> ret;
+  int64_t m = 1;
+  for(int const& d: dims) {
+    ret.push_back(m);
+    m *= d;
+  }
+  return ret;
+}
+
+// Permute a dims tensor that sits inside of a bigger one, padded by pad_inn
+// along each dimension, into an output that is padded by pad_out. The padding
+// on the output has to be left alone.
+template <typename T>
+void test_strided(
+  vector<int> dims, vector<int> perm,
+  vector<int> pad_inn, vector<int> pad_out,
+  permute_t f)
+{
+  vector<int> out_dims = permute(perm, dims);
+  vector<int> big_inn = dims;
+  vector<int> big_out = out_dims;
+  for(int i = 0; i != dims.size(); ++i) {
+    big_inn[i] += pad_inn[i];
+    big_out[i] += pad_out[i];
+  }
+  vector<int64_t> str_inn = dense_strides(big_inn);
+  vector<int64_t> str_out = dense_strides(big_out);
+
+  vector<T> inn = make_elems<T>(product(vector<int64_t>(big_inn.begin(), big_inn.end())));
+  vector<T> out(product(vector<int64_t>(big_out.begin(), big_out.end())));
+  std::fill((unsigned char*)out.data(), (unsigned char*)(out.data() + out.size()), 0xAB);
+  vector<T> untouched = out;
+
+  std::cout << "Test dims = " << dims << ", padding " << pad_inn << " -> " << pad_out
+    << ", element size " << sizeof(T) << std::endl;
+
+  f(dims, perm, str_inn, str_out, inn.data(), out.data());
+
+  bool correct = true;
+  vector<bool> written(out.size(), false);
+  indexer_t indexer(dims);
+  do {
+    vector<int> idx_out = permute(perm, indexer.idx);
+    int64_t off_inn = 0;
+    int64_t off_out = 0;
+    for(int i = 0; i != dims.size(); ++i) {
+      off_inn += indexer.idx[i] * str_inn[i];
+      off_out += idx_out[i] * str_out[i];
+    }
+    correct = correct && std::memcmp(&inn[off_inn], &out[off_out], sizeof(T)) == 0;
+    written[off_out] = true;
+  } while(indexer.increment());
+
+  // everything but the written elements is still the way it was
+  for(int64_t i = 0; i != out.size(); ++i) {
+    correct = correct && (written[i] ||
+      std::memcmp(&out[i], &untouched[i], sizeof(T)) == 0);
+  }
+
+  std::cout << "Was it correct? " << (correct ? "yes" : "no") << std::endl;
+}
+
+void exp14() {
+  std::cout << "Strided permute" << std::endl;
+  permute_t f(64);
+  test_strided<float>({37,101},   {1,0},     {3,0},     {0,5},     f);
+  test_strided<float>({4,5,6,7},  {2,3,1,0}, {0,0,0,0}, {1,0,0,0}, f);
+  test_strided<float>({4,5,6},    {2,0,1},   {0,0,0},   {0,3,0},   f);
+  test_strided<float>({4,5,6},    {2,0,1},   {0,0,2},   {2,0,0},   f); // fuses
+  test_strided<float>({4,5,6},    {1,0,2},   {1,0,0},   {0,2,0},   f); // batched
+  test_strided<float>({4,5},      {0,1},     {2,0},     {0,0},     f);
+  test_strided<float>({4,5},      {0,1},     {0,1},     {0,0},     f); // a copy
+  test_strided<float>({2,3,2,3,2,3,2,3,2,3}, {9,8,7,6,5,4,3,2,1,0},
+                      {1,0,0,0,0,0,0,0,0,1}, {0,0,0,0,0,0,0,0,0,1}, f);
+  test_strided<uint8_t>     ({4,5,6,7,8}, {4,3,2,1,0}, {1,0,1,0,1}, {0,1,0,1,0}, f);
+  test_strided<double>      ({37,101},    {1,0},       {0,0},       {0,3},       f);
+  test_strided<opaque_t<12>>({4,5,6},     {2,0,1},     {0,1,0},     {1,0,0},     f);
+  std::cout << std::endl;
+
+  std::cout << "Strided permute, parallel and streaming" << std::endl;
+  thread_pool_t pool(4);
+  test_strided<float>({4,5,6,7,8}, {4,3,2,1,0}, {1,0,0,0,0}, {0,0,0,0,2},
+    permute_t(16, pool, 64));
+  test_strided<float>({300,70},    {1,0},       {12,0},      {0,4},
+    permute_t(1024, pool, 1));
+  test_strided<float>({4,5,6,7,8}, {4,3,2,1,0}, {0,0,0,0,1}, {3,0,0,0,0},
+    permute_t(64).with_stores(store_mode_t::streaming));
+  std::cout << std::endl;
+
+  std::cout << "Strided recursive transpose" << std::endl;
+  for(auto const& [ni, nj, ldi, ldo]: vector<tuple<int,int,int,int>>{ {37,101,40,101}, {300,70,300,75} }) {
+    vector<float> inn(int64_t(ldi)*nj);
+    vector<float> out(int64_t(ldo)*ni, -1.0);
+    for(int64_t i = 0; i != inn.size(); ++i) {
+      inn[i] = i;
+    }
+    recursive_t(8)(ni, nj, inn.data(), ldi, out.data(), ldo);
+
+    bool correct = true;
+    for(int i = 0; i != ni; ++i) {
+    for(int j = 0; j != ldo; ++j) {
+      float expect = j < nj ? inn[i + int64_t(ldi)*j] : -1.0;
+      correct = correct && out[j + int64_t(ldo)*i] == expect;
+    }}
+    std::cout << "Test [num rows = " << ni << ", num cols = " << nj << "]"
+      << ", ldi " << ldi << ", ldo " << ldo << std::endl;
+    std::cout << "Was it correct? " << (correct ? "yes" : "no") << std::endl;
+  }
+  std::cout << std::endl;
+}
+
+// permute_t with the epilogue e vs. a plain permute followed by e
+template <typename TI, typename TO, typename E>
+void test_epilogue(vector<int> dims, vector<int> perm, E const& e, permute_t f) {
+  int64_t n = product(vector<int64_t>(dims.begin(), dims.end()));
+  vector<TI> inn(n);
+  for(int64_t i = 0; i != n; ++i) {
+    inn[i] = TI((i % 977) * 0.37 - 150.0);
+  }
+  vector<TI> permuted(n);
+  vector<TO> expect(n);
+  vector<TO> out(n);
+  permute_t(64)(dims, perm, inn.data(), permuted.data());
+  for(int64_t i = 0; i != n; ++i) {
+    expect[i] = TO(e(permuted[i]));
+  }
+
+  std::cout << "Test dims = " << dims << ", " << sizeof(TI) << " -> " << sizeof(TO)
+    << " bytes" << std::endl;
+
+  f(dims, perm, inn.data(), out.data(), e);
+  bool correct = std::memcmp(out.data(), expect.data(), n*sizeof(TO)) == 0;
+
+  std::cout << "Was it correct? " << (correct ? "yes" : "no") << std::endl;
+}
+
+void exp15() {
+  std::cout << "Epilogues" << std::endl;
+  permute_t f(64);
+  for(auto const& [dims, perm]: vector<tuple<vector<int>, vector<int>>>{
+    { {37,101},    {1,0}     },  // the transpose kernels
+    { {300,200},   {1,0}     },
+    { {4,5,6,7,8}, {4,3,2,1,0} },
+    { {64,64,5},   {1,0,2}   },  // batched
+    { {100,30},    {0,1}     }   // a copy
+  }) {
+    test_epilogue<float, float>   (dims, perm, scale_t(0.5f), f);
+    test_epilogue<float, float>   (dims, perm, add_scalar_t(3.0f).then(relu_t()), f);
+    test_epilogue<float, uint16_t>(dims, perm, to_bf16_t(), f);
+    test_epilogue<float, uint16_t>(dims, perm, scale_t(1000.0f).then(to_fp16_t()), f);
+  }
+  test_epilogue<double, double>(  {300,200}, {1,0}, scale_t(-2.0f), f);
+  test_epilogue<float, int>(      {30,20,10}, {2,0,1}, [](float x) { return int(x) / 3; }, f);
+  std::cout << std::endl;
+
+  std::cout << "Epilogues, parallel and streaming" << std::endl;
+  thread_pool_t pool(4);
+  test_epilogue<float, uint16_t>({300,200},   {1,0},       to_bf16_t(), permute_t(64, pool, 256));
+  test_epilogue<float, float>   ({100,30},    {0,1},       scale_t(2.0f), permute_t(64, pool, 256));
+  test_epilogue<float, uint16_t>({300,200},   {1,0},       to_fp16_t(),
+    permute_t(64).with_stores(store_mode_t::streaming));
+  test_epilogue<float, float>   ({4,5,6,7,8}, {4,3,2,1,0}, relu_t(),
+    permute_t(64).with_stores(store_mode_t::streaming));
+  std::cout << std::endl;
+
+  std::cout << "bf16 and fp16 rounding" << std::endl;
+  bool correct = true;
+  float inf = std::numeric_limits<float>::infinity();
+  for(auto const& [x, bf16, fp16]: vector<tuple<float, uint16_t, uint16_t>>{
+    { 1.0f,            0x3F80, 0x3C00 },
+    { -2.5f,           0xC020, 0xC100 },
+    { 1.00390625f,     0x3F80, 0x3C04 },  // a tie in bf16, down to even
+    { 1.01171875f,     0x3F82, 0x3C0C },  // a tie in bf16, up to even
+    { 65520.0f,        0x4780, 0x7C00 },  // past the largest half
+    { 5.9604645e-08f,  0x3380, 0x0001 },  // the smallest half subnormal
+    { inf,             0x7F80, 0x7C00 }
+  }) {
+    correct = correct && to_bf16_t()(x) == bf16 && to_fp16_t()(x) == fp16;
+  }
+  uint16_t nan = to_bf16_t()(std::numeric_limits<float>::quiet_NaN());
+  correct = correct && (nan & 0x7F80) == 0x7F80 && (nan & 0x7F) != 0;
+  std::cout << "Was it correct? " << (correct ? "yes" : "no") << std::endl;
+  std::cout << std::endl;
+}
+
+// out = beta*out + alpha*permute(inn) vs. a permute into a temporary and
+// then the sum. The sum may round differently, so this checks to a tolerance.
+template <typename T>
+void test_accumulate(
+  vector<int> dims, vector<int> perm,
+  double alpha, double beta, T start,
+  permute_t f)
+{
+  int64_t n = product(vector<int64_t>(dims.begin(), dims.end()));
+  vector<T> inn(n);
+  vector<T> out(n);
+  for(int64_t i = 0; i != n; ++i) {
+    inn[i] = T((i % 977) * 0.37 - 150.0);
+    out[i] = std::isnan(start) ? start : T(start + (i % 13));
+  }
+  vector<T> permuted(n);
+  permute_t(64)(dims, perm, inn.data(), permuted.data());
+
+  std::cout << "Test dims = " << dims << ", alpha " << alpha << ", beta " << beta
+    << ", element size " << sizeof(T) << std::endl;
+
+  vector<T> expect(n);
+  for(int64_t i = 0; i != n; ++i) {
+    expect[i] = beta == 0.0 ? T(alpha)*permuted[i] : T(alpha)*permuted[i] + T(beta)*out[i];
+  }
+
+  f.accumulate(dims, perm, alpha, inn.data(), beta, out.data());
+
+  // (doubles have to come out at double precision)
+  double tolerance = sizeof(T) == sizeof(double) ? 1e-13 : 1e-5;
+  bool correct = true;
+  for(int64_t i = 0; i != n; ++i) {
+    T diff = out[i] - expect[i];
+    correct = correct && std::abs(diff) <= tolerance * (1 + std::abs(expect[i]));
+  }
+  std::cout << "Was it correct? " << (correct ? "yes" : "no") << std::endl;
+}
+
+void exp16() {
+  std::cout << "Accumulating permute" << std::endl;
+  permute_t f(64);
+  for(auto const& [dims, perm]: vector<tuple<vector<int>, vector<int>>>{
+    { {37,101},    {1,0}       },
+    { {300,200},   {1,0}       },
+    { {4,5,6,7,8}, {4,3,2,1,0} },
+    { {64,64,5},   {1,0,2}     },
+    { {100,30},    {0,1}       }
+  }) {
+    test_accumulate<float>(dims, perm, 0.5f, 2.0f,  1.0f, f);
+    test_accumulate<float>(dims, perm, -1.0f, 1.0f, 3.0f, f);
+  }
+  test_accumulate<double>({300,200}, {1,0}, 0.25f, -3.0f, 1.0, f);
+  test_accumulate<double>({300,200}, {1,0}, 1.0/3, 0.1, 1.0, f);
+  test_accumulate<double>({4,5,6,7,8}, {4,3,2,1,0}, 1.0/3, 0.1, 1.0, f);
+  test_accumulate<double>({300,200}, {1,0}, 1.0/3, 0.0, 1.0, f);
+  // beta = 0 doesn't read the output, which may be garbage
+  float nan = std::numeric_limits<float>::quiet_NaN();
+  test_accumulate<float>({300,200},   {1,0},       2.0f, 0.0f, nan, f);
+  test_accumulate<float>({4,5,6,7,8}, {4,3,2,1,0}, 1.0f, 0.0f, nan, f);
+  std::cout << std::endl;
+
+  std::cout << "Accumulating permute, parallel and with streaming stores asked for" << std::endl;
+  thread_pool_t pool(4);
+  test_accumulate<float>({300,200},   {1,0},       0.5f, 2.0f, 1.0f, permute_t(64, pool, 256));
+  test_accumulate<float>({100,30},    {0,1},       0.5f, 2.0f, 1.0f, permute_t(64, pool, 256));
+  test_accumulate<float>({4,5,6,7,8}, {4,3,2,1,0}, 0.5f, 2.0f, 1.0f,
+    permute_t(64).with_stores(store_mode_t::streaming));
+  std::cout << std::endl;
+}
+
+// Groups of small tensors, each group with its own shape, permuted with a
+// single permute_t::batch
+template <typename T>
+void test_batch(vector<tuple<vector<int>, vector<int>, int>> shapes, permute_t f) {
+  vector<vector<vector<T>>> inns(shapes.size());
+  vector<vector<vector<T>>> outs(shapes.size());
+  vector<vector<T const*>> inn_ptrs(shapes.size());
+  vector<vector<T*>> out_ptrs(shapes.size());
+  vector<permute_group_t<T>> groups;
+  for(int g = 0; g != shapes.size(); ++g) {
+    auto const& [dims, perm, count] = shapes[g];
+    int64_t n = product(vector<int64_t>(dims.begin(), dims.end()));
+    for(int i = 0; i != count; ++i) {
+      inns[g].push_back(make_elems<T>(n));
+      std::rotate(inns[g][i].begin(), inns[g][i].begin() + (i % n), inns[g][i].end());
+      outs[g].emplace_back(n);
+      inn_ptrs[g].push_back(inns[g][i].data());
+      out_ptrs[g].push_back(outs[g][i].data());
+    }
+    groups.push_back({ dims, perm, inn_ptrs[g].data(), out_ptrs[g].data(), count });
+    std::cout << (g == 0 ? "Test " : ", ") << count << " x " << dims;
+  }
+  std::cout << ", element size " << sizeof(T) << std::endl;
+
+  if(groups.size() == 1) {
+    f.batch(groups[0].dims, groups[0].perm, groups[0].inns, groups[0].outs, groups[0].count);
+  } else {
+    f.batch(groups);
+  }
+
+  bool correct = true;
+  for(int g = 0; g != shapes.size(); ++g) {
+    auto const& [dims, perm, count] = shapes[g];
+    for(int i = 0; i != count; ++i) {
+      correct = correct && check_bytes(dims, perm, inns[g][i], outs[g][i]);
+    }
+  }
+  std::cout << "Was it correct? " << (correct ? "yes" : "no") << std::endl;
+}
+
+void exp17() {
+  std::cout << "Batches of small tensors" << std::endl;
+  thread_pool_t pool(4);
+  for(auto const& f: { permute_t(64), permute_t(64, pool, 1000) }) {
+    test_batch<float>({ { {64,128}, {1,0}, 50 } }, f);
+    test_batch<float>({ { {4,5,6}, {2,0,1}, 7 } }, f);
+    test_batch<float>({ { {16,8,32}, {1,0,2}, 20 } }, f);
+    test_batch<float>({ { {30,40}, {0,1}, 9 } }, f);
+    test_batch<uint16_t>({
+      { {64,128},    {1,0},     30 },
+      { {4,5,6,7},   {3,1,0,2}, 11 },
+      { {8,8,8},     {0,1,2},   5  },
+      { {1,1},       {1,0},     0  }
+    }, f);
+  }
+  std::cout << std::endl;
+}
+
+void exp18() {
+  std::cout << "Contiguous runs" << std::endl;
+  bool runs = true;
+  for(auto const& [dims, perm]: vector<tuple<vector<int>, vector<int>>>{
+    { {16,12,10,3},  {0,2,1,3} },
+    { {32,7,9,5},    {0,3,2,1} },
+    { {20,30,40},    {0,2,1}   }
+  }) {
+    permute_plan_t plan(dims, perm, 64*sizeof(float));
+    runs = runs && plan.get_kernel() == permute_plan_t::kernel_t::runs;
+  }
+  // (runs of 2 bytes are not worth it)
+  runs = runs && permute_plan_t({16,12,10}, {0,2,1}, 256, 1).get_kernel() ==
+    permute_plan_t::kernel_t::loops;
+  std::cout << "Does it use the runs kernel? " << (runs ? "yes" : "no") << std::endl;
+
+  thread_pool_t pool(4);
+  for(auto const& f: {
+    permute_t(64), permute_t(64, pool, 128), permute_t(64).with_stores(store_mode_t::streaming) })
+  {
+    test_permutation({16,12,10,3}, {0,2,1,3}, f);
+    test_permutation({32,7,9,5},   {0,3,2,1}, f);
+    test_permutation({1000,3,2},   {0,2,1},   f);  // runs longer than a block
+    test_permutation_elems<uint8_t>({128,5,6,7}, {0,3,1,2}, f);
+    test_permutation_elems<double> ({17,5,6},    {0,2,1},   f);
+  }
+  test_strided<float>({64,5,6}, {0,2,1}, {3,0,1}, {1,2,0}, permute_t(64));
+  test_strided<float>({64,5},   {0,1},   {2,0},   {0,0},   permute_t(64)); // nothing to tile
+  test_epilogue<float, uint16_t>({16,12,10,3}, {0,2,1,3}, scale_t(2.0f).then(to_bf16_t()), permute_t(64));
+  test_accumulate<float>({16,12,10,3}, {0,2,1,3}, 0.5f, 2.0f, 1.0f, permute_t(64));
+  test_in_place_elems<float>({16,12,10,3}, {0,2,1,3}, permute_t(64));
+  std::cout << std::endl;
+}
+
+void exp19() {
+  std::cout << "Loop orders" << std::endl;
+  using order_t = permute_plan_t::loop_order_t;
+  vector<order_t> orders {
+    order_t::read, order_t::write, order_t::hybrid, order_t::microtile };
+
+  bool forced = true;
+  for(order_t o: orders) {
+    forced = forced &&
+      permute_t(64).with_loop_order(o).plan({16,12,10}, {2,1,0})->get_loop_order() == o;
+  }
+  // (no register kernels for bytes, so no microtiles)
+  forced = forced &&
+    permute_t(64).with_loop_order(order_t::microtile).plan({16,12,10}, {2,1,0}, 1)
+      ->get_loop_order() != order_t::microtile;
+  std::cout << "Are forced orders used? " << (forced ? "yes" : "no") << std::endl;
+
+  // Empty tensors have nothing to move, whatever the order
+  {
+    vector<float> inn(1, 1.0f);
+    vector<float> out(1, 7.0f);
+    for(order_t o: { order_t::automatic, order_t::read, order_t::write }) {
+      permute_t f = permute_t(1024).with_loop_order(o);
+      f({0,2,3},   {2,1,0},   inn.data(), out.data());
+      f({4,0,5,6}, {3,1,2,0}, inn.data(), out.data());
+      f({5,6,0},   {1,0,2},   inn.data(), out.data());
+    }
+    std::cout << "Empty tensors, was it correct? "
+      << (out[0] == 7.0f ? "yes" : "no") << std::endl;
+  }
+
+  for(auto const& [dims, perm]: vector<tuple<vector<int>, vector<int>>>{
+    { {64,64,64},         {2,1,0}       },
+    { {16,16,16,16,16},   {4,3,2,1,0}   },
+    { {2,3,256,64,64},    {1,3,4,2,0}   }
+  }) {
+    for(int block: { 1024, 16384 }) {
+      std::cout << "Planned " << dims << " by " << perm << ", block " << block << ": "
+        << permute_plan_t::loop_order_name(permute_t(block).plan(dims, perm)->get_loop_order())
+        << std::endl;
+    }
+  }
+
+  thread_pool_t pool(4);
+  for(order_t o: orders) {
+    std::cout << "Order " << permute_plan_t::loop_order_name(o) << std::endl;
+    for(auto const& f: {
+      permute_t(64), permute_t(1024), permute_t(64, pool, 128),
+      permute_t(64).with_stores(store_mode_t::streaming) })
+    {
+      permute_t g = f.with_loop_order(o);
+      test_permutation({16,12,10},   {2,1,0},     g);
+      test_permutation({40,33,20},   {1,2,0},     g);
+      test_permutation({4,5,6,7,8},  {4,3,2,1,0}, g);
+      test_permutation({9,17,11,6},  {1,3,0,2},   g);
+      test_permutation_elems<double> ({9,17,11,6}, {3,1,2,0}, g);
+      test_permutation_elems<uint8_t>({9,17,11,6}, {3,1,2,0}, g);
+    }
+    permute_t g = permute_t(256).with_loop_order(o);
+    test_strided<float>({20,9,13}, {2,0,1}, {3,0,1}, {1,0,2}, g);
+    test_epilogue<float, uint16_t>({16,12,10,3}, {3,1,2,0}, scale_t(2.0f).then(to_bf16_t()), g);
+    test_accumulate<float>({16,12,10,3}, {3,1,2,0}, 0.5f, 2.0f, 1.0f, g);
+    test_in_place_elems<float>({16,12,10,3}, {3,1,2,0}, g);
+  }
+  std::cout << std::endl;
+}
+
+void exp20() {
+  std::cout << "Space filling curve traversals" << std::endl;
+  // Every point of the grid once, and along the Hilbert curve over a power
+  // of two cube each point is next to the one before it
+  bool correct = true;
+  for(auto const& counts: vector<vector<int>>{ {8,8}, {4,4,4}, {2,2,2,2,2}, {5,3,7}, {1,6} }) {
+    for(bool hilbert: { false, true }) {
+      int rank = counts.size();
+      vector<uint32_t> points = curve_order(counts, hilbert);
+      int64_t num = points.size() / rank;
+      vector<bool> seen(num, false);
+      bool cube = std::all_of(counts.begin(), counts.end(), [&](int c) {
+        return c == counts[0] && (c & (c-1)) == 0;
+      });
+      for(int64_t p = 0; p != num; ++p) {
+        int64_t at = 0;
+        int64_t m = 1;
+        int steps = 0;
+        for(int i = 0; i != rank; ++i) {
+          uint32_t x = points[p*rank + i];
+          correct = correct && x < uint32_t(counts[i]);
+          at += m*x;
+          m *= counts[i];
+          if(p > 0) {
+            steps += std::abs(int(x) - int(points[(p-1)*rank + i]));
+          }
+        }
+        correct = correct && at < num && !seen[at];
+        seen[at] = true;
+        if(hilbert && cube && p > 0) {
+          correct = correct && steps == 1;
+        }
+      }
+      correct = correct && num == product(vector<int64_t>(counts.begin(), counts.end()));
+    }
+  }
+  vector<uint32_t> z = curve_order({2,2}, false);
+  correct = correct && z == vector<uint32_t>{ 0,0, 0,1, 1,0, 1,1 };
+  std::cout << "Test curve orders" << std::endl;
+  std::cout << "Was it correct? " << (correct ? "yes" : "no") << std::endl;
+
+  using traversal_t = permute_plan_t::traversal_t;
+  thread_pool_t pool(4);
+  for(traversal_t t: { traversal_t::morton, traversal_t::hilbert }) {
+    std::cout << (t == traversal_t::morton ? "Morton" : "Hilbert") << std::endl;
+    for(auto const& f: {
+      permute_t(64), permute_t(64, pool, 128),
+      permute_t(64).with_stores(store_mode_t::streaming) })
+    {
+      permute_t g = f.with_traversal(t);
+      test_permutation({300,70},       {1,0},       g);  // the transpose kernel
+      test_permutation({40,33,20},     {1,2,0},     g);
+      test_permutation({4,5,6,7,8},    {4,3,2,1,0}, g);
+      test_permutation({9,17,11,6},    {1,3,0,2},   g);
+      test_permutation({64,7,9,5},     {0,3,2,1},   g);  // runs
+      test_permutation({4,5,6,7,3},    {2,1,0,3,4}, g);  // batched
+      test_permutation({2,3,2,3,2,3,2,3,2,3}, {9,8,7,6,5,4,3,2,1,0}, g);
+      test_permutation_elems<uint8_t>({9,17,11,6}, {3,1,2,0}, g);
+    }
+    permute_t g = permute_t(64).with_traversal(t);
+    test_strided<float>({20,9,13}, {2,0,1}, {3,0,1}, {1,0,2}, g);
+    test_epilogue<float, uint16_t>({16,12,10,3}, {3,1,2,0}, to_bf16_t(), g);
+    test_accumulate<float>({16,12,10,3}, {3,1,2,0}, 0.5f, 2.0f, 1.0f, g);
+
+    // Shapes with more L1 sized tiles than a plan keeps, so the tiles are
+    // cells of several (only the plans are built, the tensors would take
+    // gigabytes)
+    for(auto const& [dims, perm]: vector<tuple<vector<int>, vector<int>>>{
+      { {20000,30000},    {1,0}   },
+      { {1000,1000,1000}, {2,1,0} }
+    }) {
+      permute_plan_t plan(dims, perm, 1024, sizeof(float), 0,
+        store_mode_t::regular, false, permute_plan_t::loop_order_t::automatic, t);
+      std::cout << "Curve plan with " << plan.get_num_tiles() << " tiles, at most "
+        << permute_plan_t::max_tiles << "? "
+        << (plan.get_num_tiles() <= permute_plan_t::max_tiles ? "yes" : "no") << std::endl;
+    }
+  }
+  std::cout << std::endl;
+}
+
+void exp21() {
+  std::cout << "Buffers" << std::endl;
+  bool correct = true;
+  for(huge_pages_t huge: { huge_pages_t::none, huge_pages_t::advise, huge_pages_t::reserved }) {
+    for(int64_t bytes: { int64_t(100), int64_t(3) << 20 }) {
+      buffer_t small(bytes, 256, huge, true);
+      correct = correct && uintptr_t(small.data) % 256 == 0;
+      unsigned char* p = small.as<unsigned char>();
+      correct = correct && std::all_of(p, p + bytes, [](unsigned char c) { return c == 0; });
+      std::fill(p, p + bytes, 7);
+#if defined(__linux__)
+      bool big = huge != huge_pages_t::none && bytes >= huge_page_bytes;
+      correct = correct && small.is_mapped() == big;
+      correct = correct && (!big || uintptr_t(small.data) % huge_page_bytes == 0);
+#endif
+    }
+  }
+  buffer_t moved(1000);
+  void* was = moved.data;
+  buffer_t into = std::move(moved);
+  correct = correct && into.data == was && moved.data == nullptr;
+  // (more than any address space)
+  bool thrown = false;
+  try {
+    buffer_t too_big(int64_t(1) << 60);
+  } catch(std::bad_alloc const&) {
+    thrown = true;
+  }
+  correct = correct && thrown;
+  std::cout << "Test alignment, zeroing and huge pages" << std::endl;
+  std::cout << "Was it correct? " << (correct ? "yes" : "no") << std::endl;
+
+  correct = true;
+  {
+    buffer_pool_t pool(10000);
+    void* first;
+    {
+      auto a = pool.acquire(1000);
+      first = a.data();
+    }
+    {
+      auto b = pool.acquire(900);   // reused
+      auto c = pool.acquire(3000);  // too big for what is free
+      correct = correct && b.data() == first && c.data() != first;
+    }
+    auto stats = pool.stats();
+    correct = correct && stats.hits == 1 && stats.misses == 2 && stats.held_bytes == 4000;
+    {
+      auto d = pool.acquire(8000);
+    }
+    // (8000 more is past the capacity, so the biggest goes)
+    stats = pool.stats();
+    correct = correct && stats.evictions == 1 && stats.held_bytes == 4000;
+    {
+      auto e = pool.acquire(500);   // the 1000 one, but not the 3000 one
+      correct = correct && e.data() == first;
+    }
+  }
+  std::cout << "Test buffer pool" << std::endl;
+  std::cout << "Was it correct? " << (correct ? "yes" : "no") << std::endl;
+
+  // A byte struct on 64 byte aligned buffers moves 4 bytes at a time
+  std::cout << "Test dims = [300,200], element size 12, aligned to 64" << std::endl;
+  int64_t n = 300*200;
+  buffer_t inn(n*12);
+  buffer_t out(n*12);
+  vector<opaque_t<12>> elems = make_elems<opaque_t<12>>(n);
+  std::copy(elems.begin(), elems.end(), inn.as<opaque_t<12>>());
+  permute_t f = permute_t(64).with_alignment(64);
+  f({300,200}, {1,0}, inn.as<opaque_t<12>>(), out.as<opaque_t<12>>());
+  vector<opaque_t<12>> result(out.as<opaque_t<12>>(), out.as<opaque_t<12>>() + n);
+  correct = check_bytes({300,200}, {1,0}, elems, result) &&
+    f.plan({300,200}, {1,0}, 12, 1)->get_carrier_size() == 4 &&
+    permute_t(64).plan({300,200}, {1,0}, 12, 1)->get_carrier_size() == 1;
+  std::cout << "Was it correct? " << (correct ? "yes" : "no") << std::endl;
+  std::cout << std::endl;
+}
+
+// Write the input to a file, permute it into another with memory_budget
+// bytes and read that back. The I/O has to be each element read and written
+// once, in as many calls as boxes allow.
+template <typename T>
+void test_file_permutation(vector<int> dims, vector<int> perm, int64_t memory_budget) {
+  std::cout << "Test dims = " << dims << ", element size " << sizeof(T) <<
+    ", memory budget " << memory_budget << std::endl;
+  int64_t n = product(vector<int64_t>(dims.begin(), dims.end()));
+  vector<T> inn = make_elems<T>(n);
+  vector<T> out(n);
+
+  char path_inn[] = "/tmp/permute_inn_XXXXXX";
+  char path_out[] = "/tmp/permute_out_XXXXXX";
+  int fd_inn = mkstemp(path_inn);
+  int fd_out = mkstemp(path_out);
+  bool correct = fd_inn >= 0 && fd_out >= 0 &&
+    write(fd_inn, inn.data(), n*sizeof(T)) == ssize_t(n*sizeof(T));
+
+  file_io_stats_t stats;
+  file_permute_t f = file_permute_t(memory_budget, 64).with_stats(stats);
+  correct = correct && f(dims, perm, sizeof(T), path_inn, path_out);
+  correct = correct &&
+    pread(fd_out, out.data(), n*sizeof(T), 0) == ssize_t(n*sizeof(T)) &&
+    check_bytes(dims, perm, inn, out);
+
+  vector<int> box = f.box_shape(dims, perm, sizeof(T));
+  correct = correct &&
+    2*product(vector<int64_t>(box.begin(), box.end()))*int64_t(sizeof(T)) <= std::max(memory_budget, int64_t(2*sizeof(T))) &&
+    stats.bytes_read == n*sizeof(T) && stats.bytes_written == n*sizeof(T) &&
+    stats.reads >= stats.boxes && stats.writes >= stats.boxes;
+
+  // The same at offsets into already open files
+  std::fill(out.begin(), out.end(), T());
+  int64_t offset = 100*sizeof(T);
+  correct = correct &&
+    pwrite(fd_inn, inn.data(), n*sizeof(T), offset) == ssize_t(n*sizeof(T)) &&
+    file_permute_t(memory_budget, 64)(dims, perm, sizeof(T), fd_inn, offset, fd_out, offset) &&
+    pread(fd_out, out.data(), n*sizeof(T), offset) == ssize_t(n*sizeof(T)) &&
+    check_bytes(dims, perm, inn, out);
+
+  close(fd_inn);
+  close(fd_out);
+  unlink(path_inn);
+  unlink(path_out);
+  std::cout << "Was it correct? " << (correct ? "yes" : "no") << std::endl;
+}
+
+void exp22() {
+  std::cout << "Out of core permutes" << std::endl;
+  test_file_permutation<float>({300,70},          {1,0},       4096);
+  test_file_permutation<float>({300,70},          {0,1},       4096);
+  test_file_permutation<float>({40,33,20},        {1,2,0},     10000);
+  test_file_permutation<float>({4,5,6,7,8},       {4,3,2,1,0}, 1000);
+  test_file_permutation<float>({9,17,11,6},       {1,3,0,2},   2000);
+  test_file_permutation<float>({64,7,9,5},        {0,3,2,1},   3000);
+  test_file_permutation<double>({30,20,10},       {2,0,1},     5000);
+  test_file_permutation<uint8_t>({9,17,11,6},     {3,1,2,0},   700);
+  test_file_permutation<opaque_t<12>>({50,40},    {1,0},       2400);
+  test_file_permutation<float>({1000},            {0},         256);
+  test_file_permutation<float>({5,5},             {1,0},       1);
+  test_file_permutation<float>({4,0,3},           {2,0,1},     4096);
+
+  // With a budget big enough for runs of whole pages on both sides, every
+  // page of both files is touched once
+  file_io_stats_t stats;
+  std::cout << "Test dims = [2048,2048], memory budget 8MB, I/O volume" << std::endl;
+  vector<int> dims{2048,2048};
+  int64_t bytes = 2048*2048*sizeof(float);
+  vector<float> inn = make_elems<float>(2048*2048);
+  char path_inn[] = "/tmp/permute_inn_XXXXXX";
+  char path_out[] = "/tmp/permute_out_XXXXXX";
+  int fd_inn = mkstemp(path_inn);
+  int fd_out = mkstemp(path_out);
+  bool correct = fd_inn >= 0 && fd_out >= 0 && write(fd_inn, inn.data(), bytes) == bytes;
+  correct = correct &&
+    file_permute_t(8 << 20).with_stats(stats)(dims, {1,0}, sizeof(float), path_inn, path_out);
+  vector<float> out(2048*2048);
+  correct = correct && pread(fd_out, out.data(), bytes, 0) == bytes &&
+    check_bytes(dims, {1,0}, inn, out) &&
+    stats.pages_read == bytes / file_permute_t::page_bytes &&
+    stats.pages_written == bytes / file_permute_t::page_bytes;
+  close(fd_inn);
+  close(fd_out);
+  unlink(path_inn);
+  unlink(path_out);
+  std::cout << "Read " << stats.bytes_read << " and wrote " << stats.bytes_written <<
+    " bytes in " << stats.reads << " + " << stats.writes << " calls, " <<
+    stats.boxes << " boxes" << std::endl;
+  std::cout << "Was it correct? " << (correct ? "yes" : "no") << std::endl;
+  std::cout << std::endl;
+}
+
+// Put the chunks of a stream back together: they have to come in order, one
+// after the other, no bigger than asked for, and make up the permute.
+template <typename T>
+void test_stream(
+  vector<int> dims, vector<int> perm, int64_t chunk_bytes,
+  permute_t f, thread_pool_t* pool = nullptr)
+{
+  std::cout << "Test dims = " << dims << ", element size " << sizeof(T) <<
+    ", chunks of " << chunk_bytes << " bytes" << (pool ? ", working ahead" : "") << std::endl;
+  int64_t n = product(vector<int64_t>(dims.begin(), dims.end()));
+  vector<T> inn = make_elems<T>(n);
+  vector<T> out(n);
+
+  auto stream = pool == nullptr
+    ? std::make_unique<permute_stream_t>(f, dims, perm, sizeof(T), inn.data(), chunk_bytes)
+    : std::make_unique<permute_stream_t>(f, dims, perm, sizeof(T), inn.data(), chunk_bytes, *pool);
+  int64_t max_elems = std::max(int64_t(1), chunk_bytes / int64_t(sizeof(T)));
+  int64_t at = 0;
+  int64_t count = 0;
+  bool correct = stream->scratch_bytes() <= 2 * max_elems * int64_t(sizeof(T));
+  stream->for_each([&](permute_stream_t::chunk_t const& chunk) {
+    correct = correct && chunk.offset == at && chunk.elems > 0 && chunk.elems <= max_elems;
+    if(correct) {
+      std::copy(chunk.as<T>(), chunk.as<T>() + chunk.elems, out.data() + at);
+    }
+    at += chunk.elems;
+    count++;
+  });
+  permute_stream_t::chunk_t chunk;
+  correct = correct && !stream->next(chunk) && at == n &&
+    count == stream->get_num_chunks() && check_bytes(dims, perm, inn, out);
+  std::cout << "Was it correct? " << (correct ? "yes" : "no") << std::endl;
+}
+
+void exp23() {
+  std::cout << "Streaming permutes" << std::endl;
+  thread_pool_t pool(4);
+  for(thread_pool_t* ahead: { (thread_pool_t*)nullptr, &pool }) {
+    for(auto const& f: { permute_t(64), permute_t(64, pool, 128) }) {
+      test_stream<float>({300,70},       {1,0},       4096,  f, ahead);
+      test_stream<float>({300,70},       {0,1},       1000,  f, ahead);
+      test_stream<float>({40,33,20},     {1,2,0},     3000,  f, ahead);
+      test_stream<float>({4,5,6,7,8},    {4,3,2,1,0}, 100,   f, ahead);
+      test_stream<float>({9,17,11,6},    {1,3,0,2},   1 << 20, f, ahead);
+      test_stream<float>({64,7,9,5},     {0,3,2,1},   2000,  f, ahead);
+    }
+  }
+  permute_t f(64);
+  test_stream<uint8_t>({9,17,11,6},     {3,1,2,0},   77,    f);
+  test_stream<double>({30,20,10},       {2,0,1},     1,     f);
+  test_stream<opaque_t<12>>({50,40},    {1,0},       600,   f);
+  test_stream<float>({100000},          {0},         4096,  f);
+  test_stream<float>({0,5},             {1,0},       4096,  f);
+  test_stream<float>({5,0},             {1,0},       4096,  f);
+  test_stream<float>({3,0,4},           {2,0,1},     16,    f);
+  std::cout << std::endl;
+}
+
+void exp24() {
+  std::cout << "Asynchronous permutes" << std::endl;
+  {
+    thread_pool_t pool(4);
+    permute_executor_t executor(pool, permute_t(64), 256);
+
+    // Lots at once, of every kind of plan
+    vector<tuple<vector<int>, vector<int>>> cases {
+      { {300,70},    {1,0}       },
+      { {40,33,20},  {1,2,0}     },
+      { {4,5,6,7,8}, {4,3,2,1,0} },
+      { {9,17,11,6}, {1,3,0,2}   },
+      { {64,7,9,5},  {0,3,2,1}   },
+      { {4,5,6,7,3}, {2,1,0,3,4} },
+      { {50,40},     {0,1}       }
+    };
+    vector<vector<float>> inns;
+    vector<vector<float>> outs;
+    vector<permute_future_t> futures;
+    for(int round = 0; round != 3; ++round) {
+      for(auto const& [dims, perm]: cases) {
+        int64_t n = product(vector<int64_t>(dims.begin(), dims.end()));
+        inns.push_back(make_elems<float>(n));
+        outs.emplace_back(n);
+      }
+    }
+    for(int i = 0; i != inns.size(); ++i) {
+      auto const& [dims, perm] = cases[i % cases.size()];
+      futures.push_back(executor.submit(dims, perm, inns[i].data(), outs[i].data(), i % 3));
+    }
+    bool correct = true;
+    for(int i = 0; i != inns.size(); ++i) {
+      auto const& [dims, perm] = cases[i % cases.size()];
+      futures[i].wait();
+      correct = correct && futures[i].is_ready() && check_bytes(dims, perm, inns[i], outs[i]);
+    }
+    std::cout << "Test " << inns.size() << " permutes submitted at once" << std::endl;
+    std::cout << "Was it correct? " << (correct ? "yes" : "no") << std::endl;
+
+    // A chain: x -> y -> z -> w, where z has to be x again, and one more
+    // after a permute that has long finished
+    vector<int> dims{30,20,10};
+    int64_t n = 30*20*10;
+    vector<uint16_t> x = make_elems<uint16_t>(n);
+    vector<uint16_t> y(n), z(n), w(n), v(n);
+    auto fy = executor.submit(dims, {2,0,1}, x.data(), y.data());
+    auto fz = executor.submit({10,30,20}, {1,2,0}, y.data(), z.data(), 0, {fy});
+    auto fw = executor.submit(dims, {1,0,2}, z.data(), w.data(), 5, {fz, fy});
+    fw.wait();
+    auto fv = executor.submit(
+      dims, {1,0,2}, sizeof(uint16_t), x.data(), v.data(), 0, {fy, permute_future_t(), fw});
+    fv.wait();
+    correct = fy.is_ready() && fz.is_ready() && z == x &&
+      check_bytes(dims, {1,0,2}, x, w) && w == v && permute_future_t().is_ready();
+    std::cout << "Test dependencies" << std::endl;
+    std::cout << "Was it correct? " << (correct ? "yes" : "no") << std::endl;
+  }
+
+  // With the only worker held up, the caller of wait is the only thread
+  // running slices, one at a time, so the order they come in is fixed: a
+  // higher priority permute goes first, and ones of the same priority take
+  // turns.
+  {
+    thread_pool_t pool(1);
+    permute_executor_t executor(pool, permute_t(64), 1024);
+    std::atomic<bool> started(false);
+    std::atomic<bool> go(false);
+    thread_pool_t::task_group_t blocker;
+    pool.spawn(blocker, [&] {
+      started = true;
+      while(!go) {
+        std::this_thread::yield();
+      }
+    });
+    while(!started) {
+      std::this_thread::yield();
+    }
+
+    // (b is half of a, so it is done first if they take turns, and only
+    //  after all of a if not)
+    vector<int> dims_a{512,256};
+    vector<int> dims_b{256,256};
+    vector<float> inn = make_elems<float>(512*256);
+    vector<float> inn_b(inn.begin(), inn.begin() + 256*256);
+    vector<float> out_a(512*256), out_b(256*256), out_c(1024);
+    auto a = executor.submit(dims_a, {1,0}, inn.data(), out_a.data(), 0);
+    auto b = executor.submit(dims_b, {1,0}, inn.data(), out_b.data(), 0);
+    auto c = executor.submit({1024}, {0}, inn.data(), out_c.data(), 1);
+    c.wait();
+    bool correct = !a.is_ready() && !b.is_ready();
+    b.wait();
+    correct = correct && !a.is_ready();
+    go = true;
+    a.wait();
+    pool.wait(blocker);
+    correct = correct &&
+      check_bytes(dims_a, {1,0}, inn, out_a) && check_bytes(dims_b, {1,0}, inn_b, out_b) &&
+      std::equal(out_c.begin(), out_c.end(), inn.begin());
+    std::cout << "Test priorities and fairness" << std::endl;
+    std::cout << "Was it correct? " << (correct ? "yes" : "no") << std::endl;
+  }
+  std::cout << std::endl;
+}
+
+// Pack plain into layout one element at a time
+template <typename T>
+vector<T> pack_reference(layout_t const& layout, vector<T> const& plain) {
+  vector<int> split = layout.split_dims();
+  vector<int> blocked_dims = layout.blocked_dims();
+  vector<T> ret(layout.blocked_elems());
+  if(ret.empty()) {
+    return ret;
+  }
+  std::memset((void*)ret.data(), 0, ret.size()*sizeof(T));
+  indexer_t indexer(blocked_dims);
+  int64_t p = 0;
+  do {
+    // The index of each split axis, then of each axis of dims
+    vector<int> idx(split.size());
+    for(int k = 0; k != blocked_dims.size(); ++k) {
+      idx[layout.order[k]] = indexer.idx[k];
+    }
+    int64_t at = 0;
+    int64_t m = 1;
+    bool pad = false;
+    for(int i = 0, k = 0; i != layout.dims.size(); ++i) {
+      int b = layout.blocks[i];
+      int x = b > 0 ? idx[k] + b*idx[k+1] : idx[k];
+      k += b > 0 ? 2 : 1;
+      pad = pad || x >= layout.dims[i];
+      at += m*x;
+      m *= layout.dims[i];
+    }
+    if(!pad) {
+      ret[p] = plain[at];
+    }
+    p++;
+  } while(indexer.increment());
+  return ret;
+}
+
+template <typename T>
+void test_layout(layout_t const& layout, permute_t f) {
+  std::cout << "Test dims = " << layout.dims << ", blocks " << layout.blocks <<
+    ", order " << layout.order << ", element size " << sizeof(T) << std::endl;
+  int64_t n = product(vector<int64_t>(layout.dims.begin(), layout.dims.end()));
+  vector<T> plain = make_elems<T>(n);
+  // (so that the padding has to be written)
+  vector<T> blocked = make_elems<T>(layout.blocked_elems());
+  vector<T> back(n);
+
+  layout_convert_t convert(f);
+  convert.pack(layout, plain.data(), blocked.data());
+  vector<T> expected = pack_reference(layout, plain);
+  bool correct = std::memcmp(blocked.data(), expected.data(), blocked.size()*sizeof(T)) == 0;
+  convert.unpack(layout, sizeof(T), blocked.data(), back.data());
+  correct = correct && std::memcmp(back.data(), plain.data(), n*sizeof(T)) == 0;
+  std::cout << "Was it correct? " << (correct ? "yes" : "no") << std::endl;
+}
+
+void exp25() {
+  std::cout << "Layout conversions" << std::endl;
+  thread_pool_t pool(4);
+  for(auto const& f: { permute_t(64), permute_t(64, pool, 128) }) {
+    // NCHW to NCHWc (W fastest), with C a multiple of c and not
+    test_layout<float>(layout_t({7,5,32,2}).split(2, 8).reorder({2,0,1,3,4}), f);
+    test_layout<float>(layout_t({7,5,30,2}).split(2, 8).reorder({2,0,1,3,4}), f);
+    test_layout<float>(layout_t({9,6,20,3}).split(2, 16).reorder({2,0,1,3,4}), f);
+    // GEMM panels: M x K into MR x KC panels, and K x N into KC x NR ones
+    test_layout<float>(layout_t({50,70}).split(0, 6).split(1, 16).reorder({0,2,1,3}), f);
+    test_layout<float>(layout_t({70,45}).split(1, 8).split(0, 16).reorder({2,0,1,3}), f);
+    test_layout<double>(layout_t({33,40}).split(0, 4).reorder({0,2,1}), f);
+    // Splits without a permute, a permute without splits, a split that is
+    // bigger than the axis and three partial axes at once
+    test_layout<float>(layout_t({10,7}).split(0, 4), f);
+    test_layout<float>(layout_t({10,7,3}).reorder({2,0,1}), f);
+    test_layout<float>(layout_t({5,9}).split(0, 8).reorder({0,2,1}), f);
+    test_layout<float>(layout_t({9,10,11}).split(0, 4).split(1, 3).split(2, 5).reorder({4,1,2,5,0,3}), f);
+  }
+  permute_t f(64);
+  test_layout<uint8_t>(layout_t({13,6,20,2}).split(2, 16).reorder({2,0,1,3,4}), f);
+  test_layout<uint16_t>(layout_t({50,70}).split(0, 8).split(1, 4).reorder({2,0,1,3}), f);
+  test_layout<opaque_t<12>>(layout_t({17,9}).split(1, 4).reorder({1,0,2}), f);
+  // Empty tensors, split along the empty axis and along a partial one
+  test_layout<float>(layout_t({7,5,0,2}).split(2, 8).reorder({2,0,1,3,4}), f);
+  test_layout<float>(layout_t({7,0,30,2}).split(2, 8).reorder({2,0,1,3,4}), f);
+  test_layout<float>(layout_t({0,70}).split(0, 6).split(1, 16).reorder({0,2,1,3}), f);
+  std::cout << std::endl;
+}
+
+void exp26() {
+  std::cout << "Lazy permutes" << std::endl;
+  vector<int> dims{6,7,8,9};
+  tensor_t base(dims);
+  for(int64_t i = 0; i != base.size(); ++i) {
+    base.data[i] = i;
+  }
+  permute_t f(64);
+
+  // Chains, checked against permuting one step at a time
+  vector<vector<vector<int>>> chains {
+    { {1,0,2,3} },
+    { {2,0,1,3}, {1,2,0,3} },               // back to where it started
+    { {3,2,1,0}, {1,0,3,2}, {0,2,1,3} },
+    { {1,2,3,0}, {1,2,3,0}, {1,2,3,0}, {1,2,3,0} },
+    { {2,3,0,1}, {0,1,2,3}, {3,1,0,2} }
+  };
+  for(auto const& chain: chains) {
+    std::cout << "Test dims = " << dims << ", " << chain.size() << " permutes" << std::endl;
+    lazy_permute_stats_t stats;
+    permuted_view_t view = permuted_view_t(base).with_stats(stats);
+    tensor_t eager(dims);
+    std::copy(base.data, base.data + base.size(), eager.data);
+    for(auto const& perm: chain) {
+      view = view.permute(perm);
+      tensor_t next(permute(perm, eager.dims));
+      f(eager.dims, perm, eager.data, next.data);
+      eager = std::move(next);
+    }
+    bool correct = view.dims() == eager.dims;
+
+    // (reading elements doesn't materialize anything)
+    indexer_t indexer(eager.dims);
+    do {
+      correct = correct && view[indexer.idx] == eager.data[indexer()];
+    } while(indexer.increment());
+    correct = correct && stats.passes == 0 && stats.permutes == chain.size();
+
+    float const* data = view.data(f);
+    float const* again = view.data(f);
+    correct = correct && data == again &&
+      std::equal(eager.data, eager.data + eager.size(), data);
+    if(view.is_identity()) {
+      correct = correct && data == base.data &&
+        stats.passes == 0 && stats.avoided == chain.size();
+    } else {
+      correct = correct && data != base.data &&
+        stats.passes == 1 && stats.avoided == chain.size() - 1;
+    }
+
+    tensor_t out = view.materialize(f);
+    correct = correct && out.dims == eager.dims &&
+      std::equal(eager.data, eager.data + eager.size(), out.data);
+    std::cout << "Was it correct? " << (correct ? "yes" : "no") << std::endl;
+  }
+  std::cout << std::endl;
+}
+
+// Tune the shape classes that the benchmarks below use and
+// write them to permute_tuning_t::default_path()
+void tune() {
+  int nx = 8000;
+  int ny = 20000;
+
+  autotuner_t tuner;
+  vector<tuple<vector<int>, vector<int>, int>> shapes {
+    { {nx,ny},          {1,0},       sizeof(float)    },
+    { {nx,ny},          {1,0},       sizeof(uint16_t) },
+    { {1000,1000},      {1,0},       sizeof(float)    },
+    { {100,200,160,50}, {2,0,3,1},   sizeof(float)    },
+    { {32,32,32,32,32}, {4,3,2,1,0}, sizeof(float)    },
+    { {64,64,64,16},    {1,0,2,3},   sizeof(float)    }
+  };
+  for(auto const& [dims, perm, elem_size]: shapes) {
+    std::cout << "Tuning " << dims << ", " << perm << ", element size " << elem_size << ": ";
+    print_setting(tuner.tune(dims, perm, elem_size));
+  }
+
+  std::string path = permute_tuning_t::default_path();
+  bool saved = permute_tuning_t::global().save(path);
+  std::cout << (saved ? "Saved to " : "Could not save to ") << path << std::endl;
+}
+
+// The benchmark suite. Every tensor is cache line aligned (the streaming
+// stores only go to aligned rows) and permuted with each of the tests in turn.
+template <typename T>
+using bench_f = function<void(vector<int> const&, vector<int> const&, T*, T*)>;
+
+struct bench_suite_t {
+  bench_suite_t(benchmark_t& bench, benchmark_t::format_t format):
+    bench(bench), format(format)
+  {
+    if(format == benchmark_t::format_t::table) {
+      benchmark_t::print_table_header(std::cout);
+    }
+  }
+
+  template <typename T>
+  void run(
+    vector<int> dims,
+    vector<int> perm,
+    vector<tuple<string, bench_f<T>>> tests)
+  {
+    // (from the pool, so the shapes after the first mostly reuse buffers
+    // whose pages are already there; the output isn't filled in)
+    int64_t n = product(vector<int64_t>(dims.begin(), dims.end()));
+    int64_t bytes = n*sizeof(T);
+    auto inn_buffer = buffer_pool_t::global().acquire(bytes);
+    auto out_buffer = buffer_pool_t::global().acquire(bytes);
+    T* inn = inn_buffer.as<T>();
+    T* out = out_buffer.as<T>();
+    vector<T> elems = make_elems<T>(n);
+    std::copy(elems.begin(), elems.end(), inn);
+    elems = vector<T>();
+
+    std::ostringstream shape;
+    shape << dims << "->" << perm << " x" << sizeof(T);
+
+    for(auto const& [name, f]: tests) {
+      time(name, shape.str(), bytes, [&] {
+        f(dims, perm, inn, out);
+      });
+    }
+
+  }
+
+  void time(string const& name, string const& shape, int64_t bytes, function<void()> f) {
+    auto const& result = bench.run(name, shape, bytes, f);
+    if(format == benchmark_t::format_t::table) {
+      benchmark_t::print_table_row(std::cout, result);
+    }
+  }
+
+  benchmark_t& bench;
+  benchmark_t::format_t format;
+};
+
+template <typename T>
+bench_f<T> bench_transpose(recursive_t f) {
+  return [f](vector<int> const& dims, vector<int> const&, T* inn, T* out) {
+    f(dims[0], dims[1], inn, out);
+  };
+}
+
+template <typename T>
+bench_f<T> bench_plan(permute_plan_t const& plan) {
+  return [&plan](vector<int> const&, vector<int> const&, T* inn, T* out) {
+    plan.execute(inn, out);
+  };
+}
+
+// These permute inn in place and leave out alone
+template <typename T>
+bench_f<T> bench_in_place(permute_t f) {
+  return [f](vector<int> const& dims, vector<int> const& perm, T* inn, T*) {
+    f.in_place(dims, perm, inn);
+  };
+}
+
+template <typename T>
+bench_f<T> bench_in_place(transpose_in_place_t f) {
+  return [f](vector<int> const& dims, vector<int> const&, T* inn, T*) {
+    f(dims[0], dims[1], inn);
+  };
+}
+
+void benchmarks(benchmark_t& bench, benchmark_t::format_t format) {
+  thread_pool_t pool(std::thread::hardware_concurrency());
+  if(format == benchmark_t::format_t::table) {
+    std::cout << "Hardware counters "
+      << (perf_counters_t().available() ? "available" : "unavailable")
+      << "; they only see the calling thread of the parallel runs" << std::endl;
+  }
+  bench_suite_t suite(bench, format);
+
+  using tf = tuple<string, bench_f<float>>;
 
   int nx = 8000;
   int ny = 20000;
 
-  using tuple_tr_t = tuple<string, transpose_f>;
-  performance_transpose(1, nx, ny,
+  // The block size sweep, the transposes and the store modes
+  // on the big (output well past the last level cache) transpose
+  suite.run<float>({nx,ny}, {1,0},
+    {
+      tf("recursive 8",                   bench_transpose<float>(recursive_t(8))),
+      tf("recursive 32",                  bench_transpose<float>(recursive_t(32))),
+      tf("recursive 64",                  bench_transpose<float>(recursive_t(64))),
+      tf("recursive 32 parallel",         bench_transpose<float>(recursive_t(32, pool))),
+      tf("recursive 32 streaming",        bench_transpose<float>(recursive_t(32).with_stores(store_mode_t::streaming))),
+      tf("permute 64",                    permute_t(64)),
+      tf("permute 256",                   permute_t(256)),
+      tf("permute 1024",                  permute_t(1024)),
+      tf("permute 4096",                  permute_t(4096)),
+      tf("permute 8192",                  permute_t(8192)),
+      tf("permute big",                   permute_t(10000000)),
+      tf("permute 1024 parallel",         permute_t(1024, pool)),
+      tf("permute 1024 streaming",        permute_t(1024).with_stores(store_mode_t::streaming)),
+      tf("permute tuned",                 permute_t(0)),
+    });
+
+  // The 32 bit offsets that every tensor this size gets vs. the
+  // 64 bit ones that only tensors past 2^31 elements need
+  permute_plan_t plan_int32({nx,ny}, {1,0}, 4096);
+  permute_plan_t plan_int64({nx,ny}, {1,0}, 4096, sizeof(float), 0, store_mode_t::regular, true);
+  suite.run<float>({nx,ny}, {1,0},
+    {
+      tf("plan 1024 int32", bench_plan<float>(plan_int32)),
+      tf("plan 1024 int64", bench_plan<float>(plan_int64)),
+    });
+
+  // 2 byte (bf16) elements, which should take about half the time
+  suite.run<uint16_t>({nx,ny}, {1,0},
+    {
+      tuple<string, bench_f<uint16_t>>("permute 1024 bf16", permute_t(1024)),
+    });
+
+  // Square and skinny
+  for(auto const& dims: vector<vector<int>>{ {4096,4096}, {16,1<<21}, {1<<21,16} }) {
+    suite.run<float>(dims, {1,0},
+      {
+        tf("recursive 32",          bench_transpose<float>(recursive_t(32))),
+        tf("permute 1024",          permute_t(1024)),
+        tf("permute 1024 parallel", permute_t(1024, pool)),
+        tf("permute tuned",         permute_t(0)),
+      });
+  }
+
+  // Ranks 3 through 8 with roughly the same number of elements. A reversed
+  // permutation can't be fused, so these run at their full rank.
+  vector<tuple<vector<int>, vector<int>>> ranks {
+    { {256,256,256},            {2,0,1} },
+    { {100,200,160,50},         {2,0,3,1} },
+    { {32,32,32,32,32},         {4,3,2,1,0} },
+    { {18,18,18,18,18,18},      {5,4,3,2,1,0} },
+    { {12,12,12,12,12,12,12},   {6,5,4,3,2,1,0} },
+    { {9,9,9,9,9,9,9,9},        {7,6,5,4,3,2,1,0} }
+  };
+  for(auto const& [dims, perm]: ranks) {
+    suite.run<float>(dims, perm,
+      {
+        tf("permute 1024",           permute_t(1024)),
+        tf("permute 1024 streaming", permute_t(1024).with_stores(store_mode_t::streaming)),
+        tf("permute tuned",          permute_t(0)),
+      });
+  }
+
+  // Leading dimensions that stay where they are, moved as contiguous runs
+  for(auto const& [dims, perm]: vector<tuple<vector<int>, vector<int>>>{
+    { {56,56,64,32},   {0,2,1,3} },
+    { {256,32,32,32},  {0,3,2,1} }
+  }) {
+    suite.run<float>(dims, perm,
+      {
+        tf("permute 1024 runs",          permute_t(1024)),
+        tf("permute 1024 runs parallel", permute_t(1024, pool)),
+      });
+  }
+
+  // Buffers from allocator.h: huge pages vs. 4KB ones on a big transpose, and
+  // a byte struct moved in 4 byte carriers once its alignment is given
+  for(huge_pages_t huge: { huge_pages_t::none, huge_pages_t::advise }) {
+    int64_t bytes = int64_t(8192)*8192*sizeof(float);
+    buffer_t inn(bytes, 64, huge);
+    buffer_t out(bytes, 64, huge);
+    std::fill(inn.as<float>(), inn.as<float>() + 8192*8192, 1.0f);
+    suite.time(
+      huge == huge_pages_t::none ? "permute 1024 4KB pages" : "permute 1024 huge pages",
+      "[8192,8192]->[1,0] x4", bytes, [&] {
+        permute_t(1024)({8192,8192}, {1,0}, inn.as<float>(), out.as<float>());
+      });
+  }
+  suite.run<opaque_t<12>>({4000,3000}, {1,0},
     {
-      //tuple_tr_t("naive_hit_out", naive_hit_out),
-      //tuple_tr_t("naive_hit_inn", naive_hit_inn),
-      //tuple_tr_t("with blocks 8", with_blocks_t(8)),
-      //tuple_tr_t("with blocks 12", with_blocks_t(12)),
-      //tuple_tr_t("with blocks 16", with_blocks_t(16)),
-      //tuple_tr_t("with blocks 64", with_blocks_t(64)),
-      //tuple_tr_t("with blocks 128", with_blocks_t(128)),
-      //tuple_tr_t("with blocks 1024", with_blocks_t(1024)),
-      tuple_tr_t("recursive 8", recursive_t(8)),
-      tuple_tr_t("recursive 32", recursive_t(32)),
-      tuple_tr_t("recursive 64", recursive_t(64)),
+      { "permute 1024",            permute_t(1024) },
+      { "permute 1024 aligned 64", permute_t(1024).with_alignment(64) },
     });
 
-  using tuple_pm_t = tuple<string, permute_f>;
-  performance_permute(1, {nx,ny}, {1,0},
+  // The recursive traversal vs. the space filling curves, with the recursion
+  // at its usual block size and at the curves' tile size
+  using traversal_t = permute_plan_t::traversal_t;
+  int curve_block = permute_plan_t::curve_tile_bytes() / sizeof(float);
+  for(auto const& [dims, perm]: vector<tuple<vector<int>, vector<int>>>{
+    { {10000,6000},        {1,0}         },
+    { {512,512,256},       {1,2,0}       },
+    { {96,96,96,96},       {1,3,0,2}     },
+    { {40,40,40,40,40},    {4,3,2,1,0}   },
+    { {18,18,18,18,18,18}, {1,3,5,0,2,4} }
+  }) {
+    suite.run<float>(dims, perm,
+      {
+        tf("permute 1024",         permute_t(1024)),
+        tf("permute " + std::to_string(curve_block), permute_t(curve_block)),
+        tf("permute morton",       permute_t(1024).with_traversal(traversal_t::morton)),
+        tf("permute hilbert",      permute_t(1024).with_traversal(traversal_t::hilbert)),
+      });
+  }
+
+  // The leaf loop orders, forced and as planned
+  using order_t = permute_plan_t::loop_order_t;
+  for(auto const& [dims, perm]: vector<tuple<vector<int>, vector<int>>>{
+    { {512,4,512},       {2,1,0}       },
+    { {32,32,32,32},     {3,2,1,0}     },
+    { {16,16,16,16,16},  {2,4,0,3,1}   },
+    { {8,8,8,8,8,8},     {5,4,3,2,1,0} },
+    { {2,3,256,64,64},   {1,3,4,2,0}   }
+  }) {
+    vector<tf> tests;
+    for(int block: { 1024, 16384 }) {
+      string name = "permute " + std::to_string(block);
+      for(order_t o: { order_t::read, order_t::write, order_t::hybrid, order_t::microtile }) {
+        tests.push_back(tf(
+          name + " " + permute_plan_t::loop_order_name(o),
+          permute_t(block).with_loop_order(o)));
+      }
+      order_t planned = permute_t(block).plan(dims, perm)->get_loop_order();
+      tests.push_back(tf(
+        name + " planned (" + permute_plan_t::loop_order_name(planned) + ")",
+        permute_t(block)));
+    }
+    suite.run<float>(dims, perm, tests);
+  }
+
+  // Batched, and a rank 4 that fuses down to a transpose
+  suite.run<float>({64,64,64,64}, {1,0,2,3},
+    {
+      tf("permute 1024 batched",          permute_t(1024)),
+      tf("permute 1024 batched parallel", permute_t(1024, pool)),
+    });
+  suite.run<float>({64,64,64,64}, {2,3,0,1},
     {
-      tuple_pm_t("permute 32", permute_t(32)),
-      tuple_pm_t("permute 64", permute_t(64)),
-      tuple_pm_t("permute 128", permute_t(128)),
-      tuple_pm_t("permute 256", permute_t(256)),
-      tuple_pm_t("permute 1024", permute_t(1024)),
-      tuple_pm_t("permute 2048", permute_t(2048)),
-      tuple_pm_t("permute 4096", permute_t(4096)),
-      tuple_pm_t("permute 8192", permute_t(8192)),
-      tuple_pm_t("permute big", permute_t(10000000)),
+      tf("permute 1024 fused",            permute_t(1024)),
     });
 
+  // A slice of a bigger tensor permuted straight from where it is, vs. first
+  // copying it into a dense staging buffer
+  {
+    vector<int> big {8192,8192};
+    vector<int> dims {8000,8000};
+    vector<int64_t> str_inn {1, big[0]};
+    vector<int64_t> str_dense {1, dims[1]};
+    vector<float> inn = make_elems<float>(int64_t(big[0])*big[1]);
+    vector<float> staging(int64_t(dims[0])*dims[1]);
+    vector<float> out(int64_t(dims[0])*dims[1]);
+
+    std::ostringstream shape;
+    shape << dims << "->[1,0] x4 in " << big;
+    int64_t bytes = out.size()*sizeof(float);
+    permute_t f(1024);
+    suite.time("permute 1024 strided", shape.str(), bytes, [&] {
+      f(dims, {1,0}, str_inn, str_dense, inn.data(), out.data());
+    });
+    suite.time("permute 1024 staging copy", shape.str(), bytes, [&] {
+      for(int j = 0; j != dims[1]; ++j) {
+        std::copy(
+          inn.begin() + int64_t(big[0])*j,
+          inn.begin() + int64_t(big[0])*j + dims[0],
+          staging.begin() + int64_t(dims[0])*j);
+      }
+      f(dims, {1,0}, staging.data(), out.data());
+    });
+  }
+
+  // A permute followed by a scale and a cast to bf16, fused into the permute
+  // vs. as a second pass over the permuted floats
+  {
+    vector<int> dims {8000,8000};
+    vector<float> inn = make_elems<float>(int64_t(dims[0])*dims[1]);
+    vector<float> permuted(inn.size());
+    vector<uint16_t> out(inn.size());
+
+    std::ostringstream shape;
+    shape << dims << "->[1,0] x4 to x2";
+    int64_t bytes = inn.size()*sizeof(float);
+    permute_t f(1024);
+    auto e = scale_t(0.125f).then(to_bf16_t());
+    suite.time("permute 1024 scale bf16 fused", shape.str(), bytes, [&] {
+      f(dims, {1,0}, inn.data(), out.data(), e);
+    });
+    suite.time("permute 1024 then scale bf16", shape.str(), bytes, [&] {
+      f(dims, {1,0}, inn.data(), permuted.data());
+      for(int64_t i = 0; i != permuted.size(); ++i) {
+        out[i] = e(permuted[i]);
+      }
+    });
+  }
+
+  // out += alpha*permute(inn) in the leaves vs. a permute into a
+  // temporary and then an axpy
+  {
+    vector<int> dims {8000,8000};
+    vector<float> inn = make_elems<float>(int64_t(dims[0])*dims[1]);
+    vector<float> permuted(inn.size());
+    vector<float> out(inn.size(), 1.0f);
+
+    std::ostringstream shape;
+    shape << dims << "->[1,0] x4";
+    int64_t bytes = inn.size()*sizeof(float);
+    permute_t f(1024);
+    suite.time("permute 1024 accumulate", shape.str(), bytes, [&] {
+      f.accumulate(dims, {1,0}, 0.5f, inn.data(), 1.0f, out.data());
+    });
+    suite.time("permute 1024 then axpy", shape.str(), bytes, [&] {
+      f(dims, {1,0}, inn.data(), permuted.data());
+      for(int64_t i = 0; i != out.size(); ++i) {
+        out[i] += 0.5f*permuted[i];
+      }
+    });
+  }
+
+  // Thousands of small tensors (attention heads), one call each vs. one
+  // batched call
+  {
+    vector<int> dims {64,128};
+    int count = 4096;
+    int64_t n = int64_t(dims[0])*dims[1];
+    vector<float> inn = make_elems<float>(n*count);
+    vector<float> out(n*count);
+    vector<float const*> inns;
+    vector<float*> outs;
+    for(int i = 0; i != count; ++i) {
+      inns.push_back(inn.data() + n*i);
+      outs.push_back(out.data() + n*i);
+    }
+
+    std::ostringstream shape;
+    shape << count << " x " << dims << "->[1,0] x4";
+    int64_t bytes = inn.size()*sizeof(float);
+    permute_t f(1024);
+    permute_t f_parallel(1024, pool);
+    suite.time("permute 1024 one at a time", shape.str(), bytes, [&] {
+      for(int i = 0; i != count; ++i) {
+        f(dims, {1,0}, inns[i], outs[i]);
+      }
+    });
+    suite.time("permute 1024 batch", shape.str(), bytes, [&] {
+      f.batch(dims, {1,0}, inns.data(), outs.data(), count);
+    });
+    suite.time("permute 1024 batch parallel", shape.str(), bytes, [&] {
+      f_parallel.batch(dims, {1,0}, inns.data(), outs.data(), count);
+    });
+    permute_executor_t executor(pool, f);
+    vector<permute_future_t> futures(count);
+    suite.time("permute 1024 submitted", shape.str(), bytes, [&] {
+      for(int i = 0; i != count; ++i) {
+        futures[i] = executor.submit(dims, {1,0}, inns[i], outs[i]);
+      }
+      for(auto const& future: futures) {
+        future.wait();
+      }
+    });
+  }
+
+  // In place vs. out of place
+  for(auto const& dims: vector<vector<int>>{ {4096,4096}, {3000,5000} }) {
+    suite.run<float>(dims, {1,0},
+      {
+        tf("recursive 32",              bench_transpose<float>(recursive_t(32))),
+        tf("in place transpose 32",     bench_in_place<float>(transpose_in_place_t(32))),
+        tf("permute 1024",              permute_t(1024)),
+        tf("permute 1024 in place",     bench_in_place<float>(permute_t(1024))),
+      });
+  }
+  vector<tuple<vector<int>, vector<int>>> in_place_cases {
+    { {256,256,256}, {2,0,1} },
+    { {64,64,64,64}, {1,0,2,3} }
+  };
+  for(auto const& [dims, perm]: in_place_cases) {
+    suite.run<float>(dims, perm,
+      {
+        tf("permute 1024",              permute_t(1024)),
+        tf("permute 1024 in place",     bench_in_place<float>(permute_t(1024))),
+      });
+  }
+
+  // Permuting and then reading the output (a stand-in for serializing or
+  // compressing it) vs. reading it a chunk at a time as it is streamed out
+  {
+    vector<int> dims{4096,4096};
+    int64_t n = 4096*4096;
+    int64_t bytes = n*sizeof(float);
+    vector<float> inn = make_elems<float>(n);
+    vector<float> out(n);
+    volatile float sink;
+    auto consume = [&](float const* p, int64_t count) {
+      float s = 0;
+      for(int64_t i = 0; i != count; ++i) {
+        s += p[i]*p[i];
+      }
+      sink = s;
+    };
+    string shape = "[4096,4096]->[1,0] x4 consumed";
+    suite.time("permute 1024 then consume", shape, bytes, [&] {
+      permute_t(1024)(dims, {1,0}, inn.data(), out.data());
+      consume(out.data(), n);
+    });
+    for(int kb: { 64, 256, 1024 }) {
+      suite.time("stream " + std::to_string(kb) + "KB chunks", shape, bytes, [&] {
+        permute_stream_t(permute_t(1024), dims, {1,0}, sizeof(float), inn.data(), kb << 10)
+          .for_each([&](permute_stream_t::chunk_t const& chunk) {
+            consume(chunk.as<float>(), chunk.elems);
+          });
+      });
+      suite.time("stream " + std::to_string(kb) + "KB chunks ahead", shape, bytes, [&] {
+        permute_stream_t(permute_t(1024), dims, {1,0}, sizeof(float), inn.data(), kb << 10, pool)
+          .for_each([&](permute_stream_t::chunk_t const& chunk) {
+            consume(chunk.as<float>(), chunk.elems);
+          });
+      });
+    }
+  }
+
+  // Layout conversions: NCHW to NCHWc with c = 8 (W fastest), with C a
+  // multiple of c and not, vs. the loop nest that writes NCHWc in order; and
+  // packing a matrix into 6 x 256 GEMM panels
+  for(int C: { 256, 250 }) {
+    int W = 56, H = 56, N = 8, c = 8;
+    int CO = (C + c - 1) / c;
+    layout_t layout = layout_t({W,H,C,N}).split(2, c).reorder({2,0,1,3,4});
+    vector<float> plain = make_elems<float>(int64_t(W)*H*C*N);
+    vector<float> blocked(layout.blocked_elems());
+    std::ostringstream shape;
+    shape << layout.dims << "->NCHWc x4";
+    int64_t bytes = plain.size()*sizeof(float);
+    layout_convert_t convert;
+    suite.time("layout pack", shape.str(), bytes, [&] {
+      convert.pack(layout, plain.data(), blocked.data());
+    });
+    suite.time("layout unpack", shape.str(), bytes, [&] {
+      convert.unpack(layout, blocked.data(), plain.data());
+    });
+    suite.time("loops", shape.str(), bytes, [&] {
+      for(int64_t n = 0; n != N; ++n) {
+      for(int co = 0; co != CO; ++co) {
+      for(int h = 0; h != H; ++h) {
+      for(int w = 0; w != W; ++w) {
+      for(int ci = 0; ci != c; ++ci) {
+        int ch = co*c + ci;
+        blocked[ci + c*(w + W*(h + H*(co + CO*n)))] =
+          ch < C ? plain[w + W*(h + H*(ch + C*n))] : 0.0f;
+      }}}}}
+    });
+  }
+  {
+    int M = 2000, K = 2000, MR = 6, KC = 256;
+    int MO = (M + MR - 1) / MR;
+    int KO = (K + KC - 1) / KC;
+    layout_t layout = layout_t({M,K}).split(0, MR).split(1, KC).reorder({0,2,1,3});
+    vector<float> a = make_elems<float>(int64_t(M)*K);
+    vector<float> panels(layout.blocked_elems());
+    string shape = "[2000,2000]->6x256 panels x4";
+    int64_t bytes = a.size()*sizeof(float);
+    layout_convert_t convert;
+    suite.time("layout pack", shape, bytes, [&] {
+      convert.pack(layout, a.data(), panels.data());
+    });
+    suite.time("loops", shape, bytes, [&] {
+      for(int64_t ko = 0; ko != KO; ++ko) {
+      for(int mo = 0; mo != MO; ++mo) {
+      for(int kc = 0; kc != KC; ++kc) {
+      for(int mr = 0; mr != MR; ++mr) {
+        int64_t m = mo*MR + mr;
+        int64_t k = ko*KC + kc;
+        panels[mr + MR*(kc + KC*(mo + MO*ko))] = m < M && k < K ? a[m + M*k] : 0.0f;
+      }}}}
+    });
+  }
+
+  // Permuting two or three times in a row, one pass each vs. a lazy view
+  // that composes them into one pass (or none)
+  {
+    vector<int> dims{256,256,256};
+    tensor_t base(dims);
+    vector<float> elems = make_elems<float>(base.size());
+    std::copy(elems.begin(), elems.end(), base.data);
+    tensor_t tmp(dims);
+    tensor_t out(dims);
+    int64_t bytes = base.size()*sizeof(float);
+    permute_t f(1024);
+    for(auto const& chain: vector<vector<vector<int>>>{
+      { {2,0,1}, {1,2,0} },
+      { {2,0,1}, {0,2,1}, {1,0,2} }
+    }) {
+      std::ostringstream shape;
+      shape << dims;
+      for(auto const& perm: chain) {
+        shape << "->" << perm;
+      }
+      shape << " x4";
+      suite.time("permute 1024 each", shape.str(), bytes, [&] {
+        vector<int> at = dims;
+        float* inn = base.data;
+        for(int i = 0; i != chain.size(); ++i) {
+          float* to = i % 2 == 0 ? tmp.data : out.data;
+          f(at, chain[i], inn, to);
+          at = permute(chain[i], at);
+          inn = to;
+        }
+      });
+      suite.time("permute 1024 lazy", shape.str(), bytes, [&] {
+        permuted_view_t view(base);
+        for(auto const& perm: chain) {
+          view = view.permute(perm);
+        }
+        if(!view.is_identity()) {
+          view.materialize(out.data, f);
+        }
+      });
+    }
+  }
+
+  // File to file (out_of_core.h) with a few memory budgets, vs. reading the
+  // whole input, permuting it in memory and writing it out. The files are in
+  // the page cache, so this is the cost of the boxes and the calls, not disk.
+  {
+    vector<int> dims{4096,4096};
+    int64_t n = 4096*4096;
+    int64_t bytes = n*sizeof(float);
+    vector<float> inn = make_elems<float>(n);
+    vector<float> out(n);
+    char path_inn[] = "/tmp/permute_inn_XXXXXX";
+    char path_out[] = "/tmp/permute_out_XXXXXX";
+    int fd_inn = mkstemp(path_inn);
+    int fd_out = mkstemp(path_out);
+    if(fd_inn >= 0 && fd_out >= 0 && write(fd_inn, inn.data(), bytes) == bytes) {
+      string shape = "[4096,4096]->[1,0] x4 file";
+      suite.time("read, permute 1024, write", shape, bytes, [&] {
+        pread(fd_inn, inn.data(), bytes, 0);
+        permute_t(1024)(dims, {1,0}, inn.data(), out.data());
+        pwrite(fd_out, out.data(), bytes, 0);
+      });
+      for(int mb: { 4, 16, 128 }) {
+        suite.time("file permute " + std::to_string(mb) + "MB budget", shape, bytes, [&] {
+          file_permute_t(int64_t(mb) << 20)(dims, {1,0}, sizeof(float), fd_inn, 0, fd_out, 0);
+        });
+      }
+    }
+    close(fd_inn);
+    close(fd_out);
+    unlink(path_inn);
+    unlink(path_out);
+  }
+}
+
+// ./exp                   the tests, then the benchmarks as a table
+// ./exp tune              see tune
+// ./exp bench [table|json|csv] [repeat]
+//                         just the benchmarks
+int main(int argc, char** argv) {
+  if(argc > 1 && std::string(argv[1]) == "tune") {
+    tune();
+    return 0;
+  }
+
+  auto format = benchmark_t::format_t::table;
+  int repeat = 5;
+  if(argc > 1 && std::string(argv[1]) == "bench") {
+    if(argc > 2 && std::string(argv[2]) == "json") {
+      format = benchmark_t::format_t::json;
+    } else if(argc > 2 && std::string(argv[2]) == "csv") {
+      format = benchmark_t::format_t::csv;
+    }
+    if(argc > 3) {
+      repeat = std::atoi(argv[3]);
+    }
+  } else {
+    exp03();
+    exp04();
+    exp05();
+    exp06();
+    exp07();
+    exp08();
+    exp09();
+    exp10();
+    exp11();
+    exp12();
+    exp13();
+    exp14();
+    exp15();
+    exp16();
+    exp17();
+    exp18();
+    exp19();
+    exp20();
+    exp21();
+    exp22();
+    exp23();
+    exp24();
+    exp25();
+    exp26();
+  }
+
+  benchmark_t bench(1, repeat);
+  benchmarks(bench, format);
+  if(format != benchmark_t::format_t::table) {
+    bench.print(std::cout, format);
+  }
 }
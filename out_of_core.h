@@ -0,0 +1,297 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cstdint>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#include "permute.h"
+#include "allocator.h"
+
+using std::vector;
+
+// Permutes between files, for tensors bigger than memory. Going through mmap
+// and a plain pointer leaves the paging to the kernel, and the recursion's
+// tiles are much smaller than what is worth a trip to disk, so every page
+// gets faulted in (and written back) over and over. Instead the index space
+// is cut into boxes. Each one is read with pread, permuted in memory with
+// permute_t and written with pwrite, using two staging buffers of one box
+// each, which is what the memory budget bounds.
+//
+// Every element is read once and written once. A box is grown alternately
+// along the input's and the output's dimension order (doubling whichever
+// dimension is next on that side, as for a blocked transpose), so on both
+// sides it is made of long contiguous runs. Only where a run ends in the
+// middle of a page does that page get touched twice. The boxes are visited in
+// output order so the output file is written front to back.
+//
+// The files hold dense column major tensors, starting at the given offsets.
+// POSIX only.
+
+struct file_io_stats_t {
+  uint64_t bytes_read    = 0;
+  uint64_t bytes_written = 0;
+  uint64_t reads         = 0; // calls to pread
+  uint64_t writes        = 0; // calls to pwrite
+  uint64_t pages_read    = 0; // pages touched by the reads
+  uint64_t pages_written = 0; // pages touched by the writes
+  uint64_t boxes         = 0;
+};
+
+struct file_permute_t {
+  static constexpr int64_t page_bytes = 4096;
+
+  // memory_budget is in bytes; the leaves of the in-memory permute stop at
+  // min_block_size floats, as for permute_t
+  file_permute_t(int64_t memory_budget, int min_block_size = 1024):
+    memory_budget(memory_budget), f(min_block_size), stats(nullptr)
+  {}
+
+  // The same permute, but every call adds the I/O it did to stats, which
+  // has to outlive it
+  file_permute_t with_stats(file_io_stats_t& stats) const {
+    file_permute_t ret = *this;
+    ret.stats = &stats;
+    return ret;
+  }
+
+  // Permute the tensor in the file at path_inn into the file at path_out,
+  // which is created (or truncated) to size. Returns false if a file can't be
+  // opened or read or written.
+  bool operator()(
+    vector<int> const& dims,
+    vector<int> const& perm,
+    int elem_size,
+    std::string const& path_inn,
+    std::string const& path_out) const
+  {
+    int fd_inn = open(path_inn.c_str(), O_RDONLY);
+    if(fd_inn < 0) {
+      return false;
+    }
+    int fd_out = open(path_out.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(fd_out < 0) {
+      close(fd_inn);
+      return false;
+    }
+
+    bool ret = ftruncate(fd_out, num_elems(dims) * elem_size) == 0 &&
+      (*this)(dims, perm, elem_size, fd_inn, 0, fd_out, 0);
+
+    close(fd_inn);
+    ret = close(fd_out) == 0 && ret;
+    return ret;
+  }
+
+  // The same with open file descriptors and where the tensors start in them
+  bool operator()(
+    vector<int> const& dims,
+    vector<int> const& perm,
+    int elem_size,
+    int fd_inn, int64_t offset_inn,
+    int fd_out, int64_t offset_out) const
+  {
+    // (nothing to read or write, and no box to cut it into)
+    if(num_elems(dims) == 0) {
+      return true;
+    }
+
+    int rank = dims.size();
+    vector<int> box = box_shape(dims, perm, elem_size);
+    int64_t box_bytes = num_elems(box) * elem_size;
+    // (allocated here and freed on the way out, so that the budget holds
+    //  during the call and nothing is kept after it; a pool could hand out
+    //  twice the size and would hold on to them)
+    buffer_t inn(box_bytes);
+    buffer_t out(box_bytes);
+
+    auto [str_inn, str_out] = permute_plan_t::build_strides(dims, perm);
+    vector<int> dims_out = permute_dims(perm, dims);
+    vector<int> box_out = permute_dims(perm, box);
+    vector<int64_t> str_out_by_out(rank);
+    for(int k = 0; k != rank; ++k) {
+      str_out_by_out[k] = str_out[perm[k]];
+    }
+
+    // The boxes, in output order
+    vector<int> counts(rank);
+    for(int k = 0; k != rank; ++k) {
+      counts[k] = (dims_out[k] + box_out[k] - 1) / box_out[k];
+    }
+    vector<int> which(rank, 0);
+    vector<int> origin(rank);
+    vector<int> extent(rank);
+    vector<int> origin_out(rank);
+    vector<int> extent_out(rank);
+    do {
+      for(int k = 0; k != rank; ++k) {
+        int i = perm[k];
+        origin[i] = which[k] * box_out[k];
+        extent[i] = std::min(box_out[k], dims_out[k] - origin[i]);
+      }
+      for(int k = 0; k != rank; ++k) {
+        origin_out[k] = origin[perm[k]];
+        extent_out[k] = extent[perm[k]];
+      }
+
+      if(!transfer(false, fd_inn, offset_inn, elem_size, origin, extent, str_inn, inn.data)) {
+        return false;
+      }
+      f(extent, perm, elem_size, inn.data, out.data);
+      if(!transfer(true, fd_out, offset_out, elem_size, origin_out, extent_out, str_out_by_out, out.data)) {
+        return false;
+      }
+      if(stats != nullptr) {
+        stats->boxes++;
+      }
+    } while(increment(which, counts));
+
+    return true;
+  }
+
+  // The box the index space is cut into, by input dimension
+  vector<int> box_shape(vector<int> const& dims, vector<int> const& perm, int elem_size) const {
+    int rank = dims.size();
+    int64_t max_elems = std::max(int64_t(1), memory_budget / 2 / elem_size);
+    vector<int> box(rank, 1);
+    int64_t size = 1;
+
+    // The next dimension that isn't whole yet, on each side
+    int next_inn = 0;
+    int next_out = 0;
+    bool grew = true;
+    while(grew) {
+      grew = false;
+      for(bool side_out: { false, true }) {
+        int& next = side_out ? next_out : next_inn;
+        auto dim = [&](int k) { return side_out ? perm[k] : k; };
+        while(next != rank && box[dim(next)] == dims[dim(next)]) {
+          next++;
+        }
+        if(next == rank) {
+          continue;
+        }
+        int i = dim(next);
+        int64_t rest = size / box[i];
+        int64_t want = std::min(int64_t(dims[i]), int64_t(box[i]) * 2);
+        want = std::min(want, max_elems / rest);
+        if(want > box[i]) {
+          box[i] = want;
+          size = rest * want;
+          grew = true;
+        }
+      }
+    }
+    return box;
+  }
+
+private:
+  // Read (or write) the box at origin with the given extent, dimensions in
+  // the file's order, between the file and buf, where the box is dense. The
+  // box is a set of runs that are contiguous in both; runs that happen to be
+  // next to each other in the file too go in one call.
+  bool transfer(
+    bool write, int fd, int64_t offset, int elem_size,
+    vector<int> const& origin, vector<int> const& extent,
+    vector<int64_t> const& strides, void* buf) const
+  {
+    int rank = extent.size();
+
+    // The run: the dimensions that are whole in the box, and the next one
+    int run_dims = 0;
+    int64_t run = 1;
+    while(run_dims != rank) {
+      int i = run_dims++;
+      run *= extent[i];
+      bool whole = i + 1 == rank ||
+        (origin[i] == 0 && extent[i] * strides[i] == strides[i + 1]);
+      if(!whole) {
+        break;
+      }
+    }
+    int64_t run_bytes = run * elem_size;
+
+    vector<int> idx(rank - run_dims, 0);
+    vector<int> counts(extent.begin() + run_dims, extent.end());
+    char* at = (char*)buf;
+    int64_t pending_file = -1;
+    int64_t pending_bytes = 0;
+    char* pending_buf = at;
+    do {
+      int64_t pos = 0;
+      for(int i = 0; i != rank; ++i) {
+        int local = i < run_dims ? 0 : idx[i - run_dims];
+        pos += (origin[i] + int64_t(local)) * strides[i];
+      }
+      int64_t file_pos = offset + pos * elem_size;
+      if(pending_file >= 0 && pending_file + pending_bytes == file_pos) {
+        pending_bytes += run_bytes;
+      } else {
+        if(pending_file >= 0 && !io(write, fd, pending_file, pending_bytes, pending_buf)) {
+          return false;
+        }
+        pending_file = file_pos;
+        pending_bytes = run_bytes;
+        pending_buf = at;
+      }
+      at += run_bytes;
+    } while(increment(idx, counts));
+
+    return io(write, fd, pending_file, pending_bytes, pending_buf);
+  }
+
+  bool io(bool write, int fd, int64_t pos, int64_t bytes, char* buf) const {
+    if(stats != nullptr) {
+      int64_t pages = (pos + bytes + page_bytes - 1) / page_bytes - pos / page_bytes;
+      (write ? stats->bytes_written : stats->bytes_read) += bytes;
+      (write ? stats->writes        : stats->reads)      += 1;
+      (write ? stats->pages_written : stats->pages_read) += pages;
+    }
+    // (either can move less than asked for)
+    while(bytes > 0) {
+      ssize_t n = write ? pwrite(fd, buf, bytes, pos) : pread(fd, buf, bytes, pos);
+      if(n <= 0) {
+        return false;
+      }
+      buf += n;
+      pos += n;
+      bytes -= n;
+    }
+    return true;
+  }
+
+  // Column major increment of idx within counts; false once it wraps around
+  static bool increment(vector<int>& idx, vector<int> const& counts) {
+    for(int i = 0; i != int(idx.size()); ++i) {
+      if(++idx[i] != counts[i]) {
+        return true;
+      }
+      idx[i] = 0;
+    }
+    return false;
+  }
+
+  static int64_t num_elems(vector<int> const& dims) {
+    int64_t ret = 1;
+    for(int const& d: dims) {
+      ret *= d;
+    }
+    return ret;
+  }
+
+  static vector<int> permute_dims(vector<int> const& perm, vector<int> const& dims) {
+    vector<int> ret;
+    for(int const& p: perm) {
+      ret.push_back(dims[p]);
+    }
+    return ret;
+  }
+
+  int64_t memory_budget;
+  permute_t f;
+  file_io_stats_t* stats;
+};
@@ -0,0 +1,206 @@
+#pragma once
+
+#include <cstdint>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <cstring>
+#endif
+
+// Hardware performance counters, through perf_event_open on Linux.
+//
+// The counters only count the thread that opened them (and only in user
+// space), so with a thread pool they see the calling thread's share of the
+// work. Any counter that can't be opened (not Linux, no PMU in a VM,
+// perf_event_paranoid too high) reads as 0, and when none can be opened
+// everything here is a no-op and available is false.
+
+struct perf_stats_t {
+  uint64_t calls        = 0;
+  uint64_t cycles       = 0;
+  uint64_t instructions = 0;
+  uint64_t l1d_misses   = 0;
+  uint64_t llc_misses   = 0;
+  uint64_t dtlb_misses  = 0;
+  uint64_t bytes        = 0; // read plus written
+  bool available = false;
+
+  perf_stats_t& operator+=(perf_stats_t const& other) {
+    calls        += other.calls;
+    cycles       += other.cycles;
+    instructions += other.instructions;
+    l1d_misses   += other.l1d_misses;
+    llc_misses   += other.llc_misses;
+    dtlb_misses  += other.dtlb_misses;
+    bytes        += other.bytes;
+    available = available || other.available;
+    return *this;
+  }
+};
+
+struct perf_counters_t {
+  perf_counters_t() {
+    for(int i = 0; i != num_events; ++i) {
+      fds[i] = open_event(i);
+    }
+  }
+
+  ~perf_counters_t() {
+#if defined(__linux__)
+    for(int const& fd: fds) {
+      if(fd >= 0) {
+        close(fd);
+      }
+    }
+#endif
+  }
+
+  perf_counters_t(perf_counters_t const&) = delete;
+  perf_counters_t& operator=(perf_counters_t const&) = delete;
+
+  // One set per thread, opened the first time the thread asks
+  static perf_counters_t& for_this_thread() {
+    static thread_local perf_counters_t ret;
+    return ret;
+  }
+
+  bool available() const {
+    for(int const& fd: fds) {
+      if(fd >= 0) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void start() {
+#if defined(__linux__)
+    for(int const& fd: fds) {
+      if(fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+      }
+    }
+#endif
+  }
+
+  // What was counted since start, as one call that moved bytes bytes
+  perf_stats_t stop(uint64_t bytes) {
+    perf_stats_t ret;
+    ret.calls = 1;
+    ret.bytes = bytes;
+    ret.available = available();
+#if defined(__linux__)
+    for(int const& fd: fds) {
+      if(fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+      }
+    }
+    ret.cycles       = read_event(cycles_event);
+    ret.instructions = read_event(instructions_event);
+    ret.l1d_misses   = read_event(l1d_event);
+    ret.llc_misses   = read_event(llc_event);
+    ret.dtlb_misses  = read_event(dtlb_event);
+#endif
+    return ret;
+  }
+
+private:
+  enum {
+    cycles_event,
+    instructions_event,
+    l1d_event,
+    llc_event,
+    dtlb_event,
+    num_events
+  };
+
+  static int open_event(int which) {
+#if defined(__linux__)
+    perf_event_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    auto cache_miss = [](uint64_t cache) {
+      return cache
+        | (uint64_t(PERF_COUNT_HW_CACHE_OP_READ)     << 8)
+        | (uint64_t(PERF_COUNT_HW_CACHE_RESULT_MISS) << 16);
+    };
+
+    switch(which) {
+      case cycles_event:
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_CPU_CYCLES;
+        break;
+      case instructions_event:
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+        break;
+      case l1d_event:
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.config = cache_miss(PERF_COUNT_HW_CACHE_L1D);
+        break;
+      case llc_event:
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_CACHE_MISSES;
+        break;
+      default:
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.config = cache_miss(PERF_COUNT_HW_CACHE_DTLB);
+        break;
+    }
+
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+    return -1;
+#endif
+  }
+
+#if defined(__linux__)
+  // When there are more events than hardware counters the kernel takes
+  // turns, so scale up by how much of the time this one was counting
+  uint64_t read_event(int which) const {
+    if(fds[which] < 0) {
+      return 0;
+    }
+
+    uint64_t values[3]; // value, time enabled, time running
+    if(read(fds[which], values, sizeof(values)) != sizeof(values) || values[2] == 0) {
+      return 0;
+    }
+    if(values[2] < values[1]) {
+      return uint64_t(double(values[0]) * values[1] / values[2]);
+    }
+    return values[0];
+  }
+#endif
+
+  int fds[num_events];
+};
+
+// Counts from construction to destruction into *stats, unless stats is null
+struct perf_scope_t {
+  perf_scope_t(perf_stats_t* stats, uint64_t bytes):
+    stats(stats), bytes(bytes)
+  {
+    if(stats != nullptr) {
+      perf_counters_t::for_this_thread().start();
+    }
+  }
+
+  ~perf_scope_t() {
+    if(stats != nullptr) {
+      *stats += perf_counters_t::for_this_thread().stop(bytes);
+    }
+  }
+
+  perf_stats_t* stats;
+  uint64_t bytes;
+};
@@ -2,6 +2,31 @@
 
 #include <vector>
 #include <tuple>
+#include <array>
+#include <utility>
+#include <algorithm>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <type_traits>
+#include <limits>
+#include <cassert>
+
+#include "thread_pool.h"
+#include "simd_transpose.h"
+#include "epilogue.h"
+#include "index_type.h"
+#include "perf_counters.h"
+#include "in_place.h"
+#include "tile_curve.h"
 
 using std::vector;
 using std::tuple;
@@ -17,209 +42,530 @@ using std::tuple;
 #define __FST(x) std::get<0>(x)
 #define __SND(x) std::get<1>(x)
 
-struct permute_t {
-  permute_t(int min_block_size): min_block_size(min_block_size) {}
-
-  void operator()(
-    vector<int> dims,
-    vector<int> perm,
-    float* inn,
-    float* out) const
+// The base case loop nest for a rank N block:
+//
+//   for(iN-1 ...) { ... for(i1 ...) { for(i0 ...) {
+//     out[i0*str_out[0] + ... ] = e(inn[i0*str_inn[0] + ...]);
+//   }}}
+//
+// Each level is its own instantiation, so after inlining this is the same
+// fixed-depth for loop nest that would have been written out by hand.
+// Offsets are computed in I (see index_type.h), input elements are of type T
+// and output elements of type TO, and e is the epilogue (see epilogue.h).
+// With Stream set the stores are non-temporal (see simd_transpose.h).
+template <
+  int N, typename I, typename T, bool Stream = false,
+  typename TO = T, typename E = identity_epilogue_t>
+struct permute_leaf_t {
+  static void apply(
+    tuple<int,int> const* rngs,
+    int64_t const* str_inn,
+    int64_t const* str_out,
+    T const* __restrict__ inn,
+    TO* __restrict__ out,
+    E const& e)
   {
-    // Some extra tensor-permute optimizations:
-    // 1. fuse adjacent dimensions...
-    //      so if perm is [2,0,1], fuse [0,1] yielding [1,0]
-    // 2. remove dimensions of size 1
-    //
-    // (There should be at most a handful of fuse and singletons,
-    //  so don't worrry about efficiency here)
-    DCB01("BEFORE dims, perm " << dims << ", " << perm);
+    I const s_inn = str_inn[N-1];
+    I const s_out = str_out[N-1];
+    if constexpr (N == 1 && Stream && std::is_same<E, identity_epilogue_t>::value) {
+      auto const& [beg, end] = rngs[0];
+      if(s_inn == 1 && s_out == 1) {
+        stream_copy(out + beg, inn + beg, int64_t(end - beg) * sizeof(T));
+        return;
+      }
+    }
+    for(I i = __FST(rngs[N-1]); i != __SND(rngs[N-1]); ++i) {
+      if constexpr (N == 1) {
+        write_elem<Stream>(out + i*s_out, inn[i*s_inn], e);
+      } else {
+        permute_leaf_t<N-1, I, T, Stream, TO, E>::apply(
+          rngs, str_inn, str_out, inn + i*s_inn, out + i*s_out, e);
+      }
+    }
+  }
+};
 
-    while(
-      dims.size() > 1 &&
-      (has_fuse(dims, perm) || has_singleton(dims, perm)))
-    {}
+// Ranks 1 through permute_leaf_max_rank get their own loop nest
+int constexpr permute_leaf_max_rank = 8;
 
-    DCB01("AFTER dims, perm " << dims << ", " << perm);
+template <typename T, typename TO, typename E>
+using permute_leaf_f = void(*)(
+  tuple<int,int> const*, int64_t const*, int64_t const*, T const*, TO*, E const&);
 
-    // This is a "batched" permutation if
-    // the last indices are unpermuted... That is,
-    //   perm = {1,0,2}   has a batch size of dims[2],
-    //   perm = {1,0,2,3] has a batch size of dims[2]*dims[3].
-    int num_batch_dims = 0;
-    int batch_size     = 1;
-    for(int i = perm.size() - 1; i >= 0; --i) {
-      if(perm[i] == i) {
-        num_batch_dims++;
-        batch_size *= dims[i];
-      } else {
-        break;
-      }
+template <typename I, typename T, bool Stream, typename TO, typename E, int... Ns>
+constexpr std::array<permute_leaf_f<T, TO, E>, sizeof...(Ns)>
+  make_permute_leaves(std::integer_sequence<int, Ns...>)
+{
+  return { &permute_leaf_t<Ns+1, I, T, Stream, TO, E>::apply... };
+}
+
+// A leaf of rank at most permute_leaf_max_rank, straight from the table
+template <
+  typename I, typename T, bool Stream = false,
+  typename TO = T, typename E = identity_epilogue_t>
+inline void permute_leaf_fixed(
+  int rank,
+  tuple<int,int> const* rngs,
+  int64_t const* str_inn,
+  int64_t const* str_out,
+  T const* inn,
+  TO* out,
+  E const& e = E())
+{
+  static constexpr auto leaves = make_permute_leaves<I, T, Stream, TO, E>(
+    std::make_integer_sequence<int, permute_leaf_max_rank>());
+  leaves[rank-1](rngs, str_inn, str_out, inn, out, e);
+}
+
+template <
+  typename I, typename T, bool Stream = false,
+  typename TO = T, typename E = identity_epilogue_t>
+inline void permute_leaf(
+  int rank,
+  tuple<int,int> const* rngs,
+  int64_t const* str_inn,
+  int64_t const* str_out,
+  T const* inn,
+  TO* out,
+  E const& e = E())
+{
+  // Past the largest instantiated rank, peel off the outermost
+  // dimensions one at a time. That costs a loop of calls per leaf, but the
+  // inner loops are still the fixed rank ones.
+  if(rank > permute_leaf_max_rank) {
+    I const s_inn = str_inn[rank-1];
+    I const s_out = str_out[rank-1];
+    for(I i = __FST(rngs[rank-1]); i != __SND(rngs[rank-1]); ++i) {
+      permute_leaf<I, T, Stream, TO, E>(
+        rank-1, rngs, str_inn, str_out, inn + i*s_inn, out + i*s_out, e);
     }
+    return;
+  }
 
-    // In this case, there is no permutation
-    // and so it is just a copy.
-    // For example,
-    //   perm might equal {0,1,2,3,4,5}
-    if(num_batch_dims == perm.size()) {
-      DCB01("JUST A COPY");
-      std::copy(inn, inn + batch_size, out);
-      return;
+  permute_leaf_fixed<I, T, Stream, TO, E>(rank, rngs, str_inn, str_out, inn, out, e);
+}
+
+// Write len contiguous elements, out[k] = e(inn[k]); with the identity
+// epilogue that is a memcpy (or a streaming one)
+template <bool Stream, typename T, typename TO, typename E>
+inline void copy_run(TO* out, T const* inn, int64_t len, E const& e) {
+  if constexpr (std::is_same<E, identity_epilogue_t>::value) {
+    if(Stream) {
+      stream_copy(out, inn, len * sizeof(T));
+    } else {
+      std::memcpy(out, inn, len * sizeof(T));
     }
+  } else {
+    for(int64_t k = 0; k != len; ++k) {
+      write_elem<Stream>(out + k, inn[k], e);
+    }
+  }
+}
 
-    // In this case, there are no batch dimensions.
-    // (This would be correct even if there were
-    //  batch dimensions.)
-    if(num_batch_dims == 0) {
-      auto const [str_inn, str_out] = build_strides(dims, perm);
+// The leaf of the runs kernel: the same loop nest as permute_leaf over the
+// rank outer dimensions, except that each point is a run of len elements
+// that are contiguous in both the input and the output.
+template <typename I, bool Stream, typename T, typename TO, typename E>
+inline void run_leaf(
+  int rank,
+  tuple<int,int> const* rngs,
+  int64_t const* str_inn,
+  int64_t const* str_out,
+  int64_t len,
+  T const* inn,
+  TO* out,
+  E const& e)
+{
+  if(rank == 0) {
+    copy_run<Stream>(out, inn, len, e);
+    return;
+  }
 
-      vector<tuple<int,int>> rngs;
-      rngs.reserve(dims.size());
-      for(auto const& n: dims) {
-        rngs.emplace_back(0, n);
-      }
-      DCB01("NO BATCH");
-      recurse(rngs, str_inn, str_out, inn, out);
-      return;
+  I const s_inn = str_inn[rank-1];
+  I const s_out = str_out[rank-1];
+  for(I i = __FST(rngs[rank-1]); i != __SND(rngs[rank-1]); ++i) {
+    if(rank == 1) {
+      copy_run<Stream>(out + i*s_out, inn + i*s_inn, len, e);
+    } else {
+      run_leaf<I, Stream>(rank-1, rngs, str_inn, str_out, len, inn + i*s_inn, out + i*s_out, e);
     }
+  }
+}
+
+// The leaf of the microtile loop order: dimension 0 is contiguous in the
+// input and dimension 1 in the output, so the innermost two levels are a 2d
+// transpose done with the register tile kernels (see simd_transpose.h), and
+// the rank-2 dimensions outside of it are plain loops.
+template <typename I, bool Stream, typename T, typename TO, typename E>
+inline void microtile_leaf(
+  int rank,
+  tuple<int,int> const* rngs,
+  int64_t const* str_inn,
+  int64_t const* str_out,
+  T const* inn,
+  TO* out,
+  E const& e)
+{
+  if(rank == 2) {
+    auto const& [b0, e0] = rngs[0];
+    auto const& [b1, e1] = rngs[1];
+    I const ldi = str_inn[1];
+    I const ldo = str_out[0];
+    transpose_tile<Stream>(
+      e0 - b0, e1 - b1,
+      inn + b0 + I(b1)*ldi, ldi,
+      out + I(b0)*ldo + b1, ldo, e);
+    return;
+  }
+
+  I const s_inn = str_inn[rank-1];
+  I const s_out = str_out[rank-1];
+  for(I i = __FST(rngs[rank-1]); i != __SND(rngs[rank-1]); ++i) {
+    microtile_leaf<I, Stream>(rank-1, rngs, str_inn, str_out, inn + i*s_inn, out + i*s_out, e);
+  }
+}
+
+// A 16 byte element that is only ever copied around whole
+struct bytes16_t {
+  unsigned char data[16];
+};
+
+// All of the shape analysis for one (dims, perm) pair, done up front:
+// fusing and singleton removal, the batch split, the strides, which kernel
+// the leaves use and the list of tiles that the recursion would visit (its
+// leaves, or for big tensors the nodes a few levels up along with the
+// leaves under each kind of node, see max_tiles). execute then walks the
+// tile list without allocating or recursing, so a plan can be built once
+// and run as many times as needed.
+//
+// Elements can be any trivially copyable type of elem_size bytes. The data is
+// moved in "carriers" of 1, 2, 4, 8 or 16 bytes (uint8_t, uint16_t, float,
+// double, bytes16_t); an element several carriers wide gets one more,
+// unpermuted, innermost dimension. So int8, bf16, float, double and
+// arbitrary structs all go through the same leaves.
+struct permute_plan_t {
+  enum class kernel_t {
+    copy,      // nothing is permuted
+    transpose, // rank 2, done with the register tile kernels
+    loops,     // permute_leaf_t loop nests
+    runs       // dimension 0 is unpermuted and contiguous on both sides, so
+               // the loops move whole runs of it with memcpy (run_leaf)
+  };
+
+  // The order of the loops in the leaves of the loops kernel, innermost
+  // first. The planner picks one with a small cost model (see loop_cost);
+  // the others can be forced, for benchmarking.
+  enum class loop_order_t {
+    automatic,
+    read,     // input order, so dimension 0 (contiguous in the input) is
+              // innermost and the stores are strided
+    write,    // output order, so the loads are strided instead
+    hybrid,   // the output contiguous dimension, then dimension 0, then the
+              // rest in input order
+    microtile // dimension 0 and the output contiguous dimension together,
+              // as small register transposes (microtile_leaf)
+  };
+
+  // How the tiles are cut and the order they are visited in
+  enum class traversal_t {
+    recursive, // bisect the largest dimension until a block is under
+               // min_block_bytes, depth first (collect)
+    morton,    // tiles of one shape, sized from the L1 cache, in the order
+               // of the Morton curve over the grid of tiles (collect_curve)
+    hilbert    // the same tiles in Hilbert curve order
+  };
 
-    // This is a batched permutation; do each batch separately.
-    // The idea being that doint this in batches will increase cache hits the most.
+  // The runs kernel is used once a run is at least this long
+  static constexpr int min_run_bytes = 64;
 
-    vector<int> batch_dims(dims.size() - num_batch_dims);
-    std::copy(dims.begin(), dims.begin() + batch_dims.size(), batch_dims.begin());
+  // The leaves of the loops kernel are not cut shorter than this along the
+  // dimensions their loop nests run innermost. Past rank 5 a 1024 byte
+  // block split evenly leaves 2 or 3 elements per dimension, and the loop
+  // overhead is what made ranks 6 through 8 slower than rank 5.
+  static constexpr int min_loop_extent = 8;
 
-    vector<int> batch_perm(batch_dims.size());
-    std::copy(perm.begin(), perm.begin() + batch_dims.size(), batch_perm.begin());
+  // At most this many tiles are kept. The leaves of a big tensor cut at a
+  // small block number in the millions, so past this the tiles are the
+  // nodes of the recursion a few levels above the leaves instead. Those
+  // nodes come in a handful of shapes, and the leaves under each shape are
+  // kept once, relative to the node.
+  static constexpr int64_t max_tiles = 1 << 16;
 
-    vector<tuple<int,int>> batch_rngs;
-    int offset = 1;
-    batch_rngs.reserve(batch_dims.size());
-    for(auto const& n: batch_dims) {
-      batch_rngs.emplace_back(0, n);
-      offset *= n;
+  // The size of the tiles of the curve traversals: the input and the output
+  // of a tile together take about half of L1
+  static int64_t curve_tile_bytes() {
+    return l1_cache_bytes() / 4;
+  }
+
+  // The recursion stops once a block is under min_block_bytes, so leaves are
+  // cut at the same size in bytes whatever the element type.
+  //
+  // elem_align is the alignment inn and out are guaranteed to have; 0 means
+  // it is the largest power of two dividing elem_size (as for all the usual
+  // number types).
+  //
+  // stores says whether the output is written with regular or non-temporal
+  // stores (see simd_transpose.h). automatic is decided here, from the size
+  // of the output.
+  //
+  // force_int64 makes the leaves do 64 bit offset arithmetic even when
+  // 32 bit would do; that is only useful for benchmarking the two.
+  //
+  // order forces the loop order of the loops kernel (see loop_order_t). An
+  // order this plan can't use (microtile without a register kernel for the
+  // carrier or without the contiguous pair) is left to the planner.
+  //
+  // traversal picks the tiles (see traversal_t); the curve traversals don't
+  // use min_block_bytes.
+  permute_plan_t(
+    vector<int> dims,
+    vector<int> perm,
+    int min_block_bytes,
+    int elem_size = sizeof(float),
+    int elem_align = 0,
+    store_mode_t stores = store_mode_t::regular,
+    bool force_int64 = false,
+    loop_order_t order = loop_order_t::automatic,
+    traversal_t traversal = traversal_t::recursive):
+      elem_size(elem_size),
+      carrier(carrier_size(elem_size, elem_align)),
+      dense(true)
+  {
+    auto [si, so] = build_strides(dims, perm);
+    init(dims, perm, si, so, min_block_bytes, stores, force_int64, order, traversal);
+  }
+
+  // Strided views: inn and out are parts of bigger tensors. strides_inn[i] is
+  // the stride of input dimension i and strides_out[k] is the stride of output
+  // dimension k (which is input dimension perm[k]), both counted in elements.
+  // Dimensions are still fused wherever both sets of strides allow it.
+  permute_plan_t(
+    vector<int> dims,
+    vector<int> perm,
+    vector<int64_t> const& strides_inn,
+    vector<int64_t> const& strides_out,
+    int min_block_bytes,
+    int elem_size = sizeof(float),
+    int elem_align = 0,
+    store_mode_t stores = store_mode_t::regular,
+    bool force_int64 = false,
+    loop_order_t order = loop_order_t::automatic,
+    traversal_t traversal = traversal_t::recursive):
+      elem_size(elem_size),
+      carrier(carrier_size(elem_size, elem_align))
+  {
+    // the output strides, by input dimension
+    vector<int64_t> si = strides_inn;
+    vector<int64_t> so(perm.size());
+    for(int k = 0; k != perm.size(); ++k) {
+      so[perm[k]] = strides_out[k];
     }
 
-    auto const [str_inn, str_out] = build_strides(batch_dims, batch_perm);
+    dense = std::make_tuple(si, so) == build_strides(dims, perm);
+    init(dims, perm, si, so, min_block_bytes, stores, force_int64, order, traversal);
+  }
+
+  void execute(void const* inn, void* out) const {
+    with_carrier([&](auto elem) {
+      using T = decltype(elem);
+      execute_all((T const*)inn, (T*)out, identity_epilogue_t());
+    });
+  }
+
+  // out = e(permute(inn)), with the epilogue e applied in the leaves (see
+  // epilogue.h). The output type TO may differ from TI; both are counted in
+  // elements by the strides, so TI has to be the element type the plan was
+  // built for and be a single carrier wide (float, double, 8 and 16 bit
+  // integers, ...).
+  template <typename TI, typename TO, typename E>
+  void execute(TI const* inn, TO* out, E const& e) const {
+    assert(elem_size == int(sizeof(TI)) && carrier == int(sizeof(TI)));
+    execute_all(inn, out, e);
+  }
+
+  // Parallel execute. The tiles are in the order the recursion visits them,
+  // so bisecting the tile list is bisecting the recursion tree. The halves
+  // are spawned on pool until a piece has at most grain_size elements.
+  // Every element is still written exactly once by the same leaf loops,
+  // so the output is identical to the serial one.
+  void execute(
+    void const* inn, void* out,
+    thread_pool_t& pool, int grain_size) const
+  {
+    with_carrier([&](auto elem) {
+      using T = decltype(elem);
+      execute_all((T const*)inn, (T*)out, identity_epilogue_t(), pool, grain_size);
+    });
+  }
+
+  template <typename TI, typename TO, typename E>
+  void execute(
+    TI const* inn, TO* out, E const& e,
+    thread_pool_t& pool, int grain_size) const
+  {
+    assert(elem_size == int(sizeof(TI)) && carrier == int(sizeof(TI)));
+    execute_all(inn, out, e, pool, grain_size);
+  }
+
+  // The work that the parallel execute splits up: num_work_items() items,
+  // each a tile of one batch (or, for a copy, one carrier), in the order the
+  // recursion visits them. Running execute_range on every range of a
+  // partition of [0, num_work_items()), in any order and on any threads,
+  // is the same as execute.
+  int64_t num_work_items() const {
+    return kernel == kernel_t::copy ? batch_size : batch_size * num_tiles;
+  }
+
+  int64_t work_item_elems() const {
+    return kernel == kernel_t::copy ? 1 : batch_offset / num_tiles;
+  }
+
+  void execute_range(int64_t beg, int64_t end, void const* inn, void* out) const {
+    with_carrier([&](auto elem) {
+      using T = decltype(elem);
+      run_range(beg, end, (T const*)inn, (T*)out, identity_epilogue_t());
+    });
+  }
 
-    DCB01("ALL THE BATCHES " << batch_size << " ... " << offset);
-    for(int which_batch = 0; which_batch != batch_size; ++which_batch) {
-      recurse(batch_rngs, str_inn, str_out, inn, out);
-      inn += offset;
-      out += offset;
+  // The same permute on count tensors, inns[i] to outs[i], one after another
+  void execute_batch(void const* const* inns, void* const* outs, int64_t count) const {
+    for(int64_t i = 0; i != count; ++i) {
+      execute(inns[i], outs[i]);
     }
   }
 
-private:
-  inline void recurse(
-    vector<tuple<int,int>>& rngs,
-    vector<int> const& str_inn,
-    vector<int> const& str_out,
-    float* inn, float* out) const
+  // Parallel over the tensors instead of within each one: ranges of whole
+  // tensors, of about grain_size elements altogether, are spawned on pool.
+  void execute_batch(
+    void const* const* inns, void* const* outs, int64_t count,
+    thread_pool_t& pool, int grain_size) const
   {
-    // Traverse over rngs to determine two things:
-    //
-    // 1. What is the block size being written to?
-    //     > use this to see if this is the base case
-    //
-    // 2. Which rank has the largest remaining dimension?
-    //     > if not the base case, recurse on this rank
+    thread_pool_t::task_group_t group;
+    spawn_batch(inns, outs, count, grain_size, pool, group);
+    pool.wait(group);
+  }
 
-    int block_size = 1;
-    int which_recurse = 0;
-    int largest_remaining = 0;
-    for(int i = 0; i != rngs.size(); ++i) {
-      auto const& [beg, end] = rngs[i];
-      int remaining = end - beg;
-      block_size *= remaining;
+  // Spawn execute_batch's tasks into group without waiting, so that several
+  // plans can share one wait. inns and outs have to stay alive until then.
+  void spawn_batch(
+    void const* const* inns, void* const* outs, int64_t count, int grain_size,
+    thread_pool_t& pool, thread_pool_t::task_group_t& group) const
+  {
+    int64_t elems = batch_size * batch_offset;
+    int64_t grain_tensors = std::max(int64_t(1), grain_size / std::max(int64_t(1), elems));
+    run_batch_parallel(0, count, grain_tensors, inns, outs, pool, group);
+  }
 
-      if(remaining > largest_remaining) {
-        largest_remaining = remaining;
-        which_recurse = i;
-      }
+  // Permute data in place, batch by batch. A square transpose swaps pairs of
+  // tiles about the diagonal; everything else follows the cycles of the
+  // permutation, with a bitmap of one bit per element (see in_place.h).
+  // Unlike execute, this allocates (the bitmap) and always runs serially.
+  // Only dense plans can do this.
+  void execute_in_place(void* data) const {
+    assert(dense);
+    if(kernel == kernel_t::copy) {
+      return;
     }
 
-    if(block_size < min_block_size) {
-
-      // Here, directly dispatch the four loops based off of how many
-      // dimensions there are.
-      //
-      // Doing for loops is way faster than using indexer.
-      //
-      if(rngs.size() == 2) {
-        for(int i1 = __FST(rngs[1]); i1 != __SND(rngs[1]); ++i1) {
-        for(int i0 = __FST(rngs[0]); i0 != __SND(rngs[0]); ++i0) {
-          out[i0*str_out[0] + i1*str_out[1]] =
-          inn[i0*str_inn[0] + i1*str_inn[1]] ;
-        }}
-      } else
-      if(rngs.size() == 3) {
-        for(int i2 = __FST(rngs[2]); i2 != __SND(rngs[2]); ++i2) {
-        for(int i1 = __FST(rngs[1]); i1 != __SND(rngs[1]); ++i1) {
-        for(int i0 = __FST(rngs[0]); i0 != __SND(rngs[0]); ++i0) {
-          out[i0*str_out[0] + i1*str_out[1] + i2*str_out[2]] =
-          inn[i0*str_inn[0] + i1*str_inn[1] + i2*str_inn[2]] ;
-        }}}
-      } else
-      if(rngs.size() == 4) {
-        for(int i3 = __FST(rngs[3]); i3 != __SND(rngs[3]); ++i3) {
-        for(int i2 = __FST(rngs[2]); i2 != __SND(rngs[2]); ++i2) {
-        for(int i1 = __FST(rngs[1]); i1 != __SND(rngs[1]); ++i1) {
-        for(int i0 = __FST(rngs[0]); i0 != __SND(rngs[0]); ++i0) {
-          out[i0*str_out[0] + i1*str_out[1] + i2*str_out[2] + i3*str_out[3]] =
-          inn[i0*str_inn[0] + i1*str_inn[1] + i2*str_inn[2] + i3*str_inn[3]] ;
-        }}}}
-      } else
-      if(rngs.size() == 5) {
-        for(int i4 = __FST(rngs[4]); i4 != __SND(rngs[4]); ++i4) {
-        for(int i3 = __FST(rngs[3]); i3 != __SND(rngs[3]); ++i3) {
-        for(int i2 = __FST(rngs[2]); i2 != __SND(rngs[2]); ++i2) {
-        for(int i1 = __FST(rngs[1]); i1 != __SND(rngs[1]); ++i1) {
-        for(int i0 = __FST(rngs[0]); i0 != __SND(rngs[0]); ++i0) {
-          out[i0*str_out[0] + i1*str_out[1] + i2*str_out[2] + i3*str_out[3] + i4*str_out[4]] =
-          inn[i0*str_inn[0] + i1*str_inn[1] + i2*str_inn[2] + i3*str_inn[3] + i4*str_inn[4]] ;
-        }}}}}
+    with_carrier([&](auto elem) {
+      using T = decltype(elem);
+      // (the cycles loop up to batch_offset itself, which int
+      //  can't hold when there are exactly 2^31 elements)
+      if(use_int64 || batch_offset > std::numeric_limits<int>::max()) {
+        in_place<int64_t>((T*)data);
       } else {
-        // This works for all dimension sizes, but is slower
-        indexer_t indexer(rngs, str_inn, str_out);
-        do {
-          out[indexer.offset_out()] = inn[indexer.offset_inn()];
-        } while(indexer.increment());
+        in_place<int>((T*)data);
       }
+    });
+  }
 
-      return;
+  kernel_t get_kernel() const { return kernel; }
+
+  // The rank of each batch after fusing and removing singletons
+  int get_rank() const { return rank; }
+
+  int64_t get_batch_size() const { return batch_size; }
+
+  bool uses_int64() const { return use_int64; }
+
+  int get_elem_size() const { return elem_size; }
+
+  int get_carrier_size() const { return carrier; }
+
+  bool is_streaming() const { return streaming; }
+
+  traversal_t get_traversal() const { return traversal; }
+
+  // The loop order the leaves of the loops kernel use (read for the other
+  // kernels)
+  loop_order_t get_loop_order() const { return loop_order; }
+
+  static char const* loop_order_name(loop_order_t order) {
+    switch(order) {
+      case loop_order_t::automatic: return "automatic";
+      case loop_order_t::read:      return "read";
+      case loop_order_t::write:     return "write";
+      case loop_order_t::hybrid:    return "hybrid";
+      case loop_order_t::microtile: return "microtile";
     }
+    return "";
+  }
 
-    auto [beg, end] = rngs[which_recurse];
-    int half = beg + ((end-beg) / 2);
+  // The widest carrier that divides elem_size and whose
+  // alignment is guaranteed by elem_align
+  static int carrier_size(int elem_size, int elem_align) {
+    int ret = 1;
+    while(ret < 16 && elem_size % (2*ret) == 0) {
+      ret *= 2;
+    }
 
-    rngs[which_recurse] = {beg, half};
-    recurse(rngs, str_inn, str_out, inn, out);
+    // bytes16_t doesn't need any alignment
+    if(ret == 16) {
+      return ret;
+    }
+
+    if(elem_align > 0) {
+      while(elem_align % ret != 0) {
+        ret /= 2;
+      }
+    }
+    return ret;
+  }
 
-    rngs[which_recurse] = {half,end};
-    recurse(rngs, str_inn, str_out, inn, out);
+  int get_num_tiles() const { return num_tiles; }
 
-    // Note: rngs is passed by reference, so on the recursion out,
-    //       we have set rngs back to the way it was
-    // (Bassing by copy is less to think about, but not as efficient)
-    rngs[which_recurse] = {beg, end};
+  // About how much memory the plan holds on to, in bytes
+  int64_t get_bytes() const {
+    auto held = [](auto const& v) {
+      return int64_t(v.capacity() * sizeof(v[0]));
+    };
+    return sizeof(*this) +
+      held(tiles) + held(str_inn) + held(str_out) + held(sizes) +
+      held(str_out_all) + held(loop_dims) + held(str_inn_lo) + held(str_out_lo) +
+      held(tile_pattern) + held(pattern_start) + held(pattern_leaves);
   }
 
+  int64_t get_run_length() const { return run_len; }
+
+  // Whether this plan was built for dense tensors
+  bool is_dense() const { return dense; }
+
+  // The dense strides of the input and the output, by input dimension
   static
   tuple<
-    vector<int>,
-    vector<int>>
+    vector<int64_t>,
+    vector<int64_t>>
       build_strides(
         vector<int> const& dims,
         vector<int> const& perm)
   {
-    using vec = vector<int>;
+    using vec = vector<int64_t>;
     tuple<vec,vec> ret(vec(dims.size()), vec(dims.size()));
     auto& [str_inn, str_out] = ret;
 
     // set the strides
-    int m_inn = 1;
-    int m_out = 1;
+    int64_t m_inn = 1;
+    int64_t m_out = 1;
     for(int i = 0; i != dims.size(); ++i) {
       str_inn[     i ] = m_inn;
       str_out[perm[i]] = m_out;
@@ -231,133 +577,1654 @@ private:
     return ret;
   }
 
-private:
-  bool has_fuse(vector<int>& dims, vector<int>& perm) const {
-    for(int i = 0; i < perm.size()-1; ++i) {
-      if(perm[i] + 1 == perm[i+1]) {
-        int which = perm[i];
-        dims[which] = dims[which] * dims[which+1];
-        remove(which+1, dims, perm);
-        return true;
+  // An element that is n carriers wide becomes one more, unpermuted,
+  // innermost dimension. si and so are the input and output strides by
+  // input dimension; they go from counting elements to counting carriers.
+  static void split_elems(
+    vector<int>& dims, vector<int>& perm,
+    vector<int64_t>& si, vector<int64_t>& so,
+    int n)
+  {
+    if(n > 1) {
+      dims.insert(dims.begin(), n);
+      for(auto& p: perm) {
+        p++;
+      }
+      perm.insert(perm.begin(), 0);
+      for(auto& s: si) {
+        s *= n;
+      }
+      for(auto& s: so) {
+        s *= n;
       }
+      si.insert(si.begin(), 1);
+      so.insert(so.begin(), 1);
     }
-    return false;
   }
 
-  bool has_singleton(vector<int>& dims, vector<int>& perm) const {
-    for(int i = 0; i < dims.size()-1; ++i) {
-      if(dims[i] == 1) {
-        remove(i, dims, perm);
-        return true;
-      }
+  // Some extra tensor-permute optimizations:
+  // 1. fuse adjacent dimensions...
+  //      so if perm is [2,0,1], fuse [0,1] yielding [1,0]
+  //    (as long as the strides of both line up, which they always do
+  //     for dense tensors)
+  // 2. remove dimensions of size 1
+  //
+  // (There should be at most a handful of fuse and singletons,
+  //  so don't worrry about efficiency here)
+  static void normalize(
+    vector<int>& dims, vector<int>& perm,
+    vector<int64_t>& si, vector<int64_t>& so)
+  {
+    DCB01("BEFORE dims, perm " << dims << ", " << perm);
+
+    while(
+      dims.size() > 1 &&
+      (has_fuse(dims, perm, si, so) || has_singleton(dims, perm, si, so)))
+    {}
+
+    DCB01("AFTER dims, perm " << dims << ", " << perm);
+  }
+
+  // This is a "batched" permutation if
+  // the last indices are unpermuted... That is,
+  //   perm = {1,0,2}   has a batch size of dims[2],
+  //   perm = {1,0,2,3] has a batch size of dims[2]*dims[3].
+  static int count_batch_dims(vector<int> const& perm) {
+    int ret = 0;
+    for(int i = perm.size() - 1; i >= 0 && perm[i] == i; --i) {
+      ret++;
     }
-    return false;
+    return ret;
   }
 
-  void remove(int i, vector<int>& dims, vector<int>& perm) const {
-    // i = 1
-    // [d0,d1,d2,d3,d4]
-    // [d0,d2,d3,d4]     <- copy over
-    // [d0,d2,d3]        <- resize
-    for(int x = i; x < dims.size()-1; ++x) {
-      dims[x] = dims[x+1];
+private:
+  // si and so are the input and output strides by input dimension
+  void init(
+    vector<int>& dims,
+    vector<int>& perm,
+    vector<int64_t>& si,
+    vector<int64_t>& so,
+    int min_block_bytes,
+    store_mode_t stores,
+    bool force_int64,
+    loop_order_t order,
+    traversal_t traversal)
+  {
+    this->traversal = traversal;
+
+    int64_t num_elems = 1;
+    for(int const& d: dims) {
+      num_elems *= d;
     }
-    dims.resize(dims.size()-1);
+    streaming = use_streaming(stores, num_elems * elem_size);
 
-    // [3,1,2,4,0]
-    // [3,2,4,0,0] <- removed
-    // [3,2,4,0]   <- resized
-    // [2,1,3,0]   <- decremented
+    split_elems(dims, perm, si, so, elem_size / carrier);
+    normalize(dims, perm, si, so);
 
-    // find where x lives
-    int x = 0;
-    for(; x != perm.size(); ++x) {
-      if(perm[x] == i) {
-        break;
+    // In this case, there is no permutation and what is left is
+    // contiguous on both sides, so it is just a copy.
+    // For example,
+    //   perm might equal {0,1,2,3,4,5}
+    if(dims.size() == 1 && (dims[0] == 1 || (si[0] == 1 && so[0] == 1))) {
+      DCB01("JUST A COPY");
+      kernel = kernel_t::copy;
+      rank = 0;
+      batch_size = dims[0];
+      batch_offset = 1;
+      batch_str_inn = 0;
+      batch_str_out = 0;
+      num_tiles = 0;
+      use_int64 = false;
+      loop_order = loop_order_t::read;
+      in_place_block = 1;
+      run_len = 1;
+      return;
+    }
+
+    // Otherwise, if the outermost dimension is unpermuted (and after fusing
+    // there is at most one of those), each batch along it is permuted
+    // separately. (With no batch dimension, there is one batch.) The idea
+    // being that doing this in batches will increase cache hits the most.
+    batch_size = 1;
+    batch_str_inn = 0;
+    batch_str_out = 0;
+    if(dims.size() > 1 && count_batch_dims(perm) > 0) {
+      batch_size = dims.back();
+      batch_str_inn = si.back();
+      batch_str_out = so.back();
+      dims.pop_back();
+      perm.pop_back();
+      si.pop_back();
+      so.pop_back();
+    }
+
+    rank = dims.size();
+    sizes = dims;
+    str_out_all = so;
+    str_inn = si;
+    str_out = so;
+
+    vector<tuple<int,int>> rngs;
+    rngs.reserve(rank);
+    batch_offset = 1;
+    int64_t last_inn = 0;
+    int64_t last_out = 0;
+    for(int i = 0; i != rank; ++i) {
+      rngs.emplace_back(0, dims[i]);
+      batch_offset *= int64_t(dims[i]);
+      last_inn += int64_t(dims[i] - 1) * str_inn[i];
+      last_out += int64_t(dims[i] - 1) * str_out[i];
+    }
+
+    // Offsets never leave a batch, so that is what has to fit in an int
+    with_index_type(std::max(last_inn, last_out) + 1, [&](auto idx) {
+      use_int64 = force_int64 || sizeof(idx) == sizeof(int64_t);
+    });
+
+    // A leading unpermuted dimension that is contiguous on both sides (as
+    // in [0,2,1,3]) is moved a whole run at a time, and only the dimensions
+    // after it are tiled. Each point of a tile then stands for run_len
+    // elements, so the tiles get that many times fewer points.
+    run_len = 1;
+    int min_block_size = std::max(1, min_block_bytes / carrier);
+    if(rank == 2 && str_inn[0] == 1 && str_out[1] == 1) {
+      kernel = kernel_t::transpose;
+    } else if(str_inn[0] == 1 && str_out[0] == 1 && int64_t(dims[0])*carrier >= min_run_bytes) {
+      kernel = kernel_t::runs;
+      run_len = dims[0];
+      min_block_size = std::max(int64_t(1), min_block_size / run_len);
+      rank--;
+      rngs.erase(rngs.begin());
+      str_inn.erase(str_inn.begin());
+      str_out.erase(str_out.begin());
+    } else {
+      kernel = kernel_t::loops;
+    }
+
+    DCB01("BATCHES " << batch_size << " ... " << batch_offset);
+    if(traversal == traversal_t::recursive) {
+      collect(rngs, min_block_size);
+    } else {
+      int64_t tile_size = std::max(int64_t(1), curve_tile_bytes() / carrier / run_len);
+      collect_curve(rngs, tile_size, traversal == traversal_t::hilbert);
+    }
+    // (a runs kernel with nothing left to tile has one empty tile)
+    num_tiles = rank == 0 ? 1 : tiles.size() / rank;
+
+    choose_loop_order(order);
+
+    in_place_block = std::max(1, int(std::sqrt(double(min_block_bytes / carrier))));
+  }
+
+  // Set the loop order of the leaves: the one asked for if this plan can
+  // use it, otherwise the cheapest according to loop_cost. Streamed stores
+  // only combine into whole lines when they go along the output, so when
+  // streaming only the orders with the output contiguous dimension innermost
+  // are considered.
+  void choose_loop_order(loop_order_t order) {
+    loop_order = loop_order_t::read;
+    loop_dims = loop_dims_for(loop_order);
+    if(kernel == kernel_t::loops && rank <= permute_leaf_max_rank) {
+      if(order != loop_order_t::automatic && !loop_dims_for(order).empty()) {
+        loop_order = order;
+      } else {
+        double best = -1.0;
+        for(loop_order_t o: {
+          loop_order_t::read, loop_order_t::write,
+          loop_order_t::hybrid, loop_order_t::microtile})
+        {
+          vector<int> ds = loop_dims_for(o);
+          bool inner_ok = !streaming || str_out[ds.empty() ? 0 : ds[0]] == 1 ||
+                                        o == loop_order_t::microtile;
+          if(ds.empty() || !inner_ok) {
+            continue;
+          }
+          double cost = loop_cost(ds, o == loop_order_t::microtile);
+          DCB01("LOOP ORDER " << loop_order_name(o) << " COST " << cost);
+          if(best < 0.0 || cost < best) {
+            best = cost;
+            loop_order = o;
+          }
+        }
       }
+      loop_dims = loop_dims_for(loop_order);
     }
 
-    // shift to the left and resize
-    for(; x < perm.size()-1; ++x) {
-      perm[x] = perm[x+1];
+    str_inn_lo.resize(rank);
+    str_out_lo.resize(rank);
+    for(int k = 0; k != rank; ++k) {
+      str_inn_lo[k] = str_inn[loop_dims[k]];
+      str_out_lo[k] = str_out[loop_dims[k]];
     }
-    perm.resize(perm.size()-1);
+  }
 
-    // decrement things greater than i
-    for(auto& p: perm) {
-      if(p > i) {
-        p--;
+  // The dimensions in the given loop order, innermost first; empty if this
+  // plan can't use it
+  vector<int> loop_dims_for(loop_order_t order) const {
+    vector<int> ret(rank);
+    for(int i = 0; i != rank; ++i) {
+      ret[i] = i;
+    }
+
+    int out_inner = -1;
+    for(int i = 0; i != rank; ++i) {
+      if(str_out[i] == 1) {
+        out_inner = i;
+        break;
+      }
+    }
+
+    if(order == loop_order_t::write) {
+      std::stable_sort(ret.begin(), ret.end(), [this](int a, int b) {
+        return std::abs(str_out[a]) < std::abs(str_out[b]);
+      });
+    } else if(order == loop_order_t::hybrid && out_inner > 0) {
+      ret.erase(ret.begin() + out_inner);
+      ret.insert(ret.begin(), out_inner);
+    } else if(order == loop_order_t::microtile) {
+      if(out_inner <= 0 || str_inn[0] != 1 || !has_microtile_kernel()) {
+        return {};
       }
+      ret.erase(ret.begin() + out_inner);
+      ret.insert(ret.begin() + 1, out_inner);
     }
+    return ret;
+  }
+
+  // Whether transpose_tile has a register kernel for the carrier
+  bool has_microtile_kernel() const {
+    if(carrier == sizeof(float)) {
+      return transpose_kernel_t<float, 4>::exists;
+    }
+    if(carrier == sizeof(double)) {
+      return transpose_kernel_t<double, 4>::exists;
+    }
+    return false;
   }
 
+  // The cost model for the loop orders, in about the time of one scalar
+  // load and store. Every element costs that, plus more when the innermost
+  // loop goes across the lines of a side (strided stores hurt far more than
+  // strided loads: each one holds up the store buffer until its line is in);
+  // the 2d blocks of a microtile cost less per element but have a fixed cost
+  // per call. Each run of the innermost loop costs loop_entry_cost, and each
+  // cache line brought in costs a miss weight. A side's lines are those of
+  // the largest inner loop levels whose footprint fits in its half of L1
+  // (where the lines get reused), once per sweep of the rest.
+  //
+  // (Fitted to the single core timings of the loop order benchmark.)
+  static constexpr double strided_load_cost  = 0.25;
+  static constexpr double strided_store_cost = 1.5;
+  static constexpr double microtile_elem_cost = 0.5;
+  static constexpr double microtile_call_cost = 150.0;
+  static constexpr double loop_entry_cost = 2.0;
+  static constexpr double load_miss_cost  = 4.0;
+  static constexpr double store_miss_cost = 8.0;
 
-  struct indexer_t {
-    indexer_t(
-      vector<tuple<int,int>> const& rngs,
-      vector<int>            const& str_inn,
-      vector<int>            const& str_out):
-        rngs(rngs), str_inn(str_inn), str_out(str_out),
-        off_inn(0), off_out(0)
-    {
-      idx.reserve(rngs.size());
-      for(int i = 0; i != rngs.size(); ++i) {
-        auto const& [beg, _] = rngs[i];
-        idx.push_back(beg);
-        off_inn += beg * str_inn[i];
-        off_out += beg * str_out[i];
-      }
-    }
-
-    // 0 0 0 -> increment i0, which = 0
-    // 1 0 0 -> increment i0, which = 1
-    // 2 0 0 -> reset i0, increment i1, which = 0
-    // 0 1 0 -> increment i0, which = 0
-    // 1 1 0 -> increment i0, which = 1
-    // 2 1 0 -> reset i0, increment i1, which = 0
-    // 0 2 0 -> increment i0, which = 0
-    // 1 2 0 -> increment i0, which = 2
-    // 2 2 0 -> reset i0, reset i1, increment i2, which = 0
-    // 0 0 1 -> increment i0, which = 0
-    // 1 0 1 -> ....
-
-    inline bool increment() {
-      for(int i = 0; i < idx.size(); ++i) {
-        if(idx[i] + 1 == std::get<1>(rngs[i])) {
-          // Let rngs[i] = (3,9)
-          // Then idx[i] = 8
-          //      diff = 5
-          //      idx[i] -= 5 => idx[i] = 3
-          // Moreover, the offsets had to have been incremented 5 times as well,
-          // so subtract that from the offsets
-          int diff = std::get<1>(rngs[i]) - std::get<0>(rngs[i]) - 1;
-          idx[i]  -=            diff;
-          off_inn -= str_inn[i]*diff;
-          off_out -= str_out[i]*diff;
+  double loop_cost(vector<int> const& ds, bool micro) const {
+    int64_t line = std::max(1, cache_line_bytes / carrier);
+    int64_t capacity = std::max(int64_t(1), l1_cache_bytes() / cache_line_bytes / 2);
+
+    auto misses = [&](tuple<int,int> const* rngs, vector<int64_t> const& strs) {
+      int64_t elems = 1;
+      int64_t lines = 1;
+      int64_t fit_elems = 1;
+      int64_t fit_lines = 1;
+      bool fits = true;
+      for(int d: ds) {
+        int64_t n = __SND(rngs[d]) - __FST(rngs[d]);
+        int64_t s = std::abs(strs[d]);
+        elems *= n;
+        lines *= s >= line ? n : std::max(int64_t(1), (n*s + line - 1) / line);
+        if(fits && lines <= capacity) {
+          fit_elems = elems;
+          fit_lines = lines;
         } else {
-          idx[i] += 1;
-          off_inn += str_inn[i];
-          off_out += str_out[i];
-          return true;
+          fits = false;
         }
       }
-      return false;
+      return double(fit_lines) * double(elems / fit_elems);
+    };
+
+    auto volume = [&](tuple<int,int> const* rngs) {
+      double ret = 1.0;
+      for(int i = 0; i != rank; ++i) {
+        ret *= __SND(rngs[i]) - __FST(rngs[i]);
+      }
+      return ret;
+    };
+
+    auto leaf_cost = [&](tuple<int,int> const* rngs) {
+      double elems = volume(rngs);
+      // (an empty tensor has one empty tile, which costs nothing)
+      if(elems == 0.0) {
+        return 0.0;
+      }
+      int64_t n0 = __SND(rngs[ds[0]]) - __FST(rngs[ds[0]]);
+
+      double work;
+      if(micro) {
+        int64_t n1 = __SND(rngs[ds[1]]) - __FST(rngs[ds[1]]);
+        double calls = elems / double(n0 * n1);
+        double full = n0 < 8 || n1 < 8 ? 0.0 : double((n0 - n0 % 4) * (n1 - n1 % 4));
+        work = calls * (
+          microtile_elem_cost * full + (n0 * n1 - full) + microtile_call_cost);
+      } else {
+        double per_elem = 1.0;
+        if(std::abs(str_inn[ds[0]]) != 1) {
+          per_elem += strided_load_cost;
+        }
+        if(std::abs(str_out[ds[0]]) != 1) {
+          per_elem += strided_store_cost;
+        }
+        work = per_elem * elems + loop_entry_cost * elems / std::max(int64_t(1), n0);
+      }
+
+      return work
+           + load_miss_cost  * misses(rngs, str_inn)
+           + store_miss_cost * misses(rngs, str_out);
+    };
+
+    // (a tile above the leaves costs what the leaves of its pattern cost,
+    //  which is worked out once per pattern)
+    vector<double> pattern_cost;
+    for(int p = 0; p + 1 < int(pattern_start.size()); ++p) {
+      double cost = 0.0;
+      for(int64_t l = pattern_start[p]; l != pattern_start[p+1]; ++l) {
+        cost += leaf_cost(pattern_leaves.data() + l*rank);
+      }
+      pattern_cost.push_back(cost);
+    }
+
+    double ret = 0.0;
+    for(int t = 0; t != num_tiles; ++t) {
+      if(tile_pattern.empty()) {
+        ret += leaf_cost(tiles.data() + int64_t(t)*rank);
+      } else {
+        ret += pattern_cost[tile_pattern[t]];
+      }
     }
+    return ret;
+  }
 
-    inline int const& offset_inn() const { return off_inn; }
-    inline int const& offset_out() const { return off_out; }
+  // Record the tiles: the leaves of the recursion, in the order it has
+  // always visited them, or when there are too many of those the nodes
+  // where it would stop with the smallest block (a power of two times
+  // min_block_size) that leaves at most max_tiles of them, along with the
+  // leaves under each (see collect_patterns).
+  void collect(vector<tuple<int,int>>& rngs, int min_block_size) {
+    int64_t tile_block = min_block_size;
+    int64_t limit = max_tiles * std::max(1, rank);
+    auto keep = [&](tuple<int,int> const* tile) {
+      tiles.insert(tiles.end(), tile, tile + rank);
+      return int64_t(tiles.size()) <= limit;
+    };
+    // (each try stops as soon as it has too many)
+    while(!recurse(rngs.data(), tile_block, keep)) {
+      tiles.clear();
+      tile_block *= 2;
+    }
+    tiles.shrink_to_fit();
+    if(tile_block != min_block_size) {
+      collect_patterns(min_block_size);
+    }
+  }
 
-    vector<tuple<int,int>> const& rngs;
+  // Whether the loop nests of the leaves could run dimension i innermost:
+  // input dimension 0 or the output contiguous one, of the loops kernel
+  bool inner_loop(int i) const {
+    return kernel == kernel_t::loops && (str_inn[i] == 1 || str_out[i] == 1);
+  }
 
-    vector<int> idx;
+  // Record the leaves under every tile, once per kind of tile. Where the
+  // recursion cuts a node depends only on the node's extents and, along
+  // the output contiguous dimension, on where the node starts within a
+  // cache line; tiles that agree on those have the same leaves, relative
+  // to where they start. A big tensor has a handful of kinds.
+  void collect_patterns(int64_t leaf_block) {
+    int line = std::max(1, cache_line_bytes / carrier);
+    int64_t count = tiles.size() / rank;
 
-    vector<int> str_inn;
-    vector<int> str_out;
+    std::map<vector<int>, int> kinds;
+    vector<int> key(2*rank);
+    vector<tuple<int,int>> rngs(rank);
+    tile_pattern.resize(count);
+    pattern_start.assign(1, 0);
+    for(int64_t t = 0; t != count; ++t) {
+      tuple<int,int> const* tile = tiles.data() + t*rank;
+      for(int i = 0; i != rank; ++i) {
+        auto const& [beg, end] = tile[i];
+        key[2*i]   = end - beg;
+        key[2*i+1] = str_out[i] == 1 ? beg % line : 0;
+      }
 
-    int off_inn;
-    int off_out;
-  };
+      auto [iter, fresh] = kinds.emplace(key, int(kinds.size()));
+      if(fresh) {
+        std::copy(tile, tile + rank, rngs.begin());
+        auto keep = [&](tuple<int,int> const* leaf) {
+          for(int i = 0; i != rank; ++i) {
+            pattern_leaves.emplace_back(
+              __FST(leaf[i]) - __FST(tile[i]),
+              __SND(leaf[i]) - __FST(tile[i]));
+          }
+          return true;
+        };
+        recurse(rngs.data(), leaf_block, keep);
+        pattern_start.push_back(pattern_leaves.size() / rank);
+      }
+      tile_pattern[t] = iter->second;
+    }
+    pattern_leaves.shrink_to_fit();
+  }
 
-private:
-  int min_block_size;
+  // The recursion: visit the blocks under rngs (rank of them) that are
+  // under min_block_size, stopping early once visit returns false
+  template <typename F>
+  bool recurse(tuple<int,int>* rngs, int64_t min_block_size, F& visit) const {
+    // Traverse over rngs to determine two things:
+    //
+    // 1. What is the block size being written to?
+    //     > use this to see if this is the base case
+    //
+    // 2. Which rank has the largest remaining dimension?
+    //     > if not the base case, recurse on this rank
+
+    int line = std::max(1, cache_line_bytes / carrier);
+
+    int64_t block_size = 1;
+    int which_recurse = 0;
+    int largest_remaining = 0;
+    for(int i = 0; i != rank; ++i) {
+      auto const& [beg, end] = rngs[i];
+      int remaining = end - beg;
+      block_size *= remaining;
+
+      // When streaming, don't cut the rows of the output shorter than a
+      // couple of cache lines; the streamed stores want whole lines.
+      // (Regular stores are faster with the plain bisection.)
+      if(streaming && str_out[i] == 1 && remaining < 2*line) {
+        continue;
+      }
+      // Don't cut the dimensions the loop nests run innermost short either
+      // (see min_loop_extent)
+      if(inner_loop(i) && remaining < 2*min_loop_extent) {
+        continue;
+      }
+
+      if(remaining > largest_remaining) {
+        largest_remaining = remaining;
+        which_recurse = i;
+      }
+    }
+
+    if(block_size < min_block_size || largest_remaining < 2) {
+      return visit((tuple<int,int> const*)rngs);
+    }
+
+    auto [beg, end] = rngs[which_recurse];
+    int half = beg + ((end-beg) / 2);
+
+    // Along the output contiguous dimension, split on a cache line boundary
+    // (relative to the start of the row) when that leaves both sides
+    // non-empty, so neighbouring leaves don't write parts of the same line.
+    if(str_out[which_recurse] == 1) {
+      int aligned = half - (half % line);
+      if(aligned > beg) {
+        half = aligned;
+      }
+    }
+
+    rngs[which_recurse] = {beg, half};
+    bool ret = recurse(rngs, min_block_size, visit);
+
+    if(ret) {
+      rngs[which_recurse] = {half,end};
+      ret = recurse(rngs, min_block_size, visit);
+    }
+
+    // Note: rngs is modified in place, so on the recursion out
+    //       (stopped early or not), we have set rngs back to the way it was
+    // (Passing by copy is less to think about, but not as efficient)
+    rngs[which_recurse] = {beg, end};
+    return ret;
+  }
+
+  // The tiles of the curve traversals: all of one shape (but for the ones
+  // at the far edges), cut the way collect would cut them until they have
+  // at most tile_size points, and listed along the curve over the grid of
+  // tiles. Unlike the recursion, the tile shape doesn't depend on where the
+  // tile is and there is nothing to do per node. When that grid has more
+  // than max_tiles points, the tiles are cells of a few grid points each
+  // instead, listed along the curve over the grid of cells, with the
+  // recursion cutting each cell into leaves of at most tile_size points
+  // (see collect_patterns).
+  void collect_curve(vector<tuple<int,int>> const& rngs, int64_t tile_size, bool hilbert) {
+    int line = std::max(1, cache_line_bytes / carrier);
+
+    vector<int> ext(rank);
+    for(int i = 0; i != rank; ++i) {
+      ext[i] = __SND(rngs[i]);
+    }
+    while(true) {
+      int64_t size = 1;
+      int which = 0;
+      for(int i = 0; i != rank; ++i) {
+        size *= ext[i];
+        // (the same rules as collect)
+        bool keep = (streaming && str_out[i] == 1 && ext[i] < 2*line) ||
+                    (inner_loop(i) && ext[i] < 2*min_loop_extent);
+        if(!keep && ext[i] > ext[which]) {
+          which = i;
+        }
+      }
+      if(rank == 0 || size <= tile_size || ext[which] < 2) {
+        break;
+      }
+
+      // Keep output rows cut on cache line boundaries
+      int half = (ext[which] + 1) / 2;
+      if(str_out[which] == 1 && half > line) {
+        int aligned = ((half + line - 1) / line) * line;
+        if(aligned < ext[which]) {
+          half = aligned;
+        }
+      }
+      ext[which] = half;
+    }
+
+    vector<int> counts(rank);
+    auto grid = [&] {
+      int64_t num = 1;
+      for(int i = 0; i != rank; ++i) {
+        counts[i] = (__SND(rngs[i]) + ext[i] - 1) / ext[i];
+        num *= counts[i];
+      }
+      return num;
+    };
+    // (double the cells along the dimension with the most of them)
+    bool cells = false;
+    while(grid() > max_tiles) {
+      int which = std::max_element(counts.begin(), counts.end()) - counts.begin();
+      ext[which] = std::min(int64_t(ext[which]) * 2, int64_t(__SND(rngs[which])));
+      cells = true;
+    }
+
+    vector<uint32_t> points = curve_order(counts, hilbert);
+    tiles.reserve(points.size());
+    for(int64_t p = 0; p != int64_t(points.size()); ++p) {
+      int i = p % rank;
+      int beg = points[p] * ext[i];
+      tiles.emplace_back(beg, std::min(beg + ext[i], __SND(rngs[i])));
+    }
+    if(cells) {
+      // (the recursion stops under its block size, so this stops at
+      //  tile_size)
+      collect_patterns(tile_size + 1);
+    }
+  }
+
+  template <typename T, typename TO, typename E>
+  void execute_all(T const* inn, TO* out, E const& e) const {
+    if(kernel == kernel_t::copy) {
+      copy(0, batch_size, inn, out, e);
+      if(streaming) {
+        stream_fence();
+      }
+      return;
+    }
+
+    run(0, batch_size * num_tiles, inn, out, e);
+  }
+
+  template <typename T, typename TO, typename E>
+  void execute_all(
+    T const* inn, TO* out, E const& e,
+    thread_pool_t& pool, int grain_size) const
+  {
+    int64_t grain_tiles = std::max(
+      int64_t(1), grain_size / std::max(int64_t(1), work_item_elems()));
+
+    thread_pool_t::task_group_t group;
+    run_parallel(0, num_work_items(), grain_tiles, inn, out, e, pool, group);
+    pool.wait(group);
+  }
+
+  // Work items [beg,end) with the fence they need
+  template <typename T, typename TO, typename E>
+  void run_range(int64_t beg, int64_t end, T const* inn, TO* out, E const& e) const {
+    if(kernel == kernel_t::copy) {
+      copy(beg, end, inn, out, e);
+      if(streaming) {
+        stream_fence();
+      }
+    } else {
+      run(beg, end, inn, out, e);
+    }
+  }
+
+  // Elements [beg,end) of the copy kernel; the caller fences
+  template <typename T, typename TO, typename E>
+  void copy(int64_t beg, int64_t end, T const* inn, TO* out, E const& e) const {
+    if(streaming) {
+      copy_run<true>(out + beg, inn + beg, end - beg, e);
+    } else {
+      copy_run<false>(out + beg, inn + beg, end - beg, e);
+    }
+  }
+
+  template <typename T, typename TO, typename E>
+  void run(int64_t beg, int64_t end, T const* inn, TO* out, E const& e) const {
+    if(use_int64) {
+      with_stream<int64_t>(beg, end, inn, out, e);
+    } else {
+      with_stream<int>(beg, end, inn, out, e);
+    }
+  }
+
+  template <typename I, typename T, typename TO, typename E>
+  void with_stream(int64_t beg, int64_t end, T const* inn, TO* out, E const& e) const {
+    if(streaming && !is_accumulating<E>::value) {
+      run<I, true>(beg, end, inn, out, e);
+      stream_fence();
+    } else {
+      run<I, false>(beg, end, inn, out, e);
+    }
+  }
+
+  // Run work items [beg,end), where work item w is
+  // tile w % num_tiles of batch w / num_tiles
+  template <typename I, bool Stream, typename T, typename TO, typename E>
+  void run(int64_t beg, int64_t end, T const* inn, TO* out, E const& e) const {
+    int64_t which_batch = beg / num_tiles;
+    int which_tile  = beg % num_tiles;
+    inn += which_batch * batch_str_inn;
+    out += which_batch * batch_str_out;
+    for(int64_t w = beg; w != end; ++w) {
+      tuple<int,int> const* tile = tiles.data() + int64_t(which_tile) * rank;
+      if(tile_pattern.empty()) {
+        leaf<I, Stream>(tile, inn, out, e);
+      } else {
+        // The leaves of the pattern are relative to the tile, and the leaves
+        // address memory linearly in their ranges, so moving the pointers
+        // to the start of the tile is all it takes
+        int64_t at_inn = 0;
+        int64_t at_out = 0;
+        for(int i = 0; i != rank; ++i) {
+          at_inn += __FST(tile[i]) * str_inn[i];
+          at_out += __FST(tile[i]) * str_out[i];
+        }
+        int p = tile_pattern[which_tile];
+        for(int64_t l = pattern_start[p]; l != pattern_start[p+1]; ++l) {
+          leaf<I, Stream>(pattern_leaves.data() + l*rank, inn + at_inn, out + at_out, e);
+        }
+      }
+
+      if(++which_tile == num_tiles) {
+        which_tile = 0;
+        inn += batch_str_inn;
+        out += batch_str_out;
+      }
+    }
+  }
+
+  template <typename I, typename T>
+  void in_place(T* data) const {
+    // Where the element at input offset p goes: split p up into
+    // an index with sizes, then apply the output strides
+    auto dest = [this](I p) {
+      I ret = 0;
+      for(int i = 0; i != sizes.size(); ++i) {
+        ret += (p % sizes[i]) * I(str_out_all[i]);
+        p /= sizes[i];
+      }
+      return ret;
+    };
+
+    bool square = kernel == kernel_t::transpose && sizes[0] == sizes[1];
+    vector<uint64_t> visited;
+    for(int64_t b = 0; b != batch_size; ++b, data += batch_offset) {
+      if(square) {
+        transpose_square_in_place<I>(I(sizes[0]), data, in_place_block);
+      } else {
+        permute_cycles_in_place<I>(I(batch_offset), data, dest, visited);
+      }
+    }
+  }
+
+  void run_batch_parallel(
+    int64_t beg, int64_t end, int64_t grain_tensors,
+    void const* const* inns, void* const* outs,
+    thread_pool_t& pool, thread_pool_t::task_group_t& group) const
+  {
+    if(end - beg <= grain_tensors) {
+      execute_batch(inns + beg, outs + beg, end - beg);
+      return;
+    }
+
+    int64_t half = beg + ((end-beg) / 2);
+    pool.spawn(group, [=, &pool, &group] {
+      run_batch_parallel(beg, half, grain_tensors, inns, outs, pool, group);
+    });
+    run_batch_parallel(half, end, grain_tensors, inns, outs, pool, group);
+  }
+
+  template <typename T, typename TO, typename E>
+  void run_parallel(
+    int64_t beg, int64_t end, int64_t grain_tiles,
+    T const* inn, TO* out, E const& e,
+    thread_pool_t& pool, thread_pool_t::task_group_t& group) const
+  {
+    if(end - beg <= grain_tiles) {
+      run_range(beg, end, inn, out, e);
+      return;
+    }
+
+    int64_t half = beg + ((end-beg) / 2);
+    pool.spawn(group, [=, &pool, &group] {
+      run_parallel(beg, half, grain_tiles, inn, out, e, pool, group);
+    });
+    run_parallel(half, end, grain_tiles, inn, out, e, pool, group);
+  }
+
+  template <typename I, bool Stream, typename T, typename TO, typename E>
+  inline void leaf(
+    tuple<int,int> const* rngs,
+    T const* inn, TO* out, E const& e) const
+  {
+    if(kernel == kernel_t::transpose) {
+      auto const& [b0, e0] = rngs[0];
+      auto const& [b1, e1] = rngs[1];
+      I const ldi = str_inn[1];
+      I const ldo = str_out[0];
+      transpose_tile<Stream>(
+        e0 - b0, e1 - b1,
+        inn + b0 + I(b1)*ldi, ldi,
+        out + I(b0)*ldo + b1, ldo, e);
+    } else if(kernel == kernel_t::runs) {
+      run_leaf<I, Stream>(
+        rank, rngs, str_inn.data(), str_out.data(), run_len, inn, out, e);
+    } else if(loop_order != loop_order_t::read) {
+      // (only ever the case up to permute_leaf_max_rank)
+      tuple<int,int> ordered[permute_leaf_max_rank];
+      for(int k = 0; k != rank; ++k) {
+        ordered[k] = rngs[loop_dims[k]];
+      }
+      if(loop_order == loop_order_t::microtile) {
+        microtile_leaf<I, Stream>(
+          rank, ordered, str_inn_lo.data(), str_out_lo.data(), inn, out, e);
+      } else {
+        permute_leaf_fixed<I, T, Stream, TO, E>(
+          rank, ordered, str_inn_lo.data(), str_out_lo.data(), inn, out, e);
+      }
+    } else {
+      permute_leaf<I, T, Stream, TO, E>(
+        rank, rngs, str_inn.data(), str_out.data(), inn, out, e);
+    }
+  }
+
+  // Call f with a value of the carrier type
+  template <typename F>
+  void with_carrier(F f) const {
+    switch(carrier) {
+      case 1:  f(uint8_t());   break;
+      case 2:  f(uint16_t());  break;
+      case 4:  f(float());     break;
+      case 8:  f(double());    break;
+      default: f(bytes16_t()); break;
+    }
+  }
+
+private:
+  static bool has_fuse(
+    vector<int>& dims, vector<int>& perm,
+    vector<int64_t>& si, vector<int64_t>& so)
+  {
+    for(int i = 0; i < perm.size()-1; ++i) {
+      int which = perm[i];
+      if(which + 1 == perm[i+1] &&
+         si[which+1] == si[which] * dims[which] &&
+         so[which+1] == so[which] * dims[which])
+      {
+        dims[which] = dims[which] * dims[which+1];
+        remove(which+1, dims, perm, si, so);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  static bool has_singleton(
+    vector<int>& dims, vector<int>& perm,
+    vector<int64_t>& si, vector<int64_t>& so)
+  {
+    for(int i = 0; i < dims.size()-1; ++i) {
+      if(dims[i] == 1) {
+        remove(i, dims, perm, si, so);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  static void remove(
+    int i,
+    vector<int>& dims, vector<int>& perm,
+    vector<int64_t>& si, vector<int64_t>& so)
+  {
+    // i = 1
+    // [d0,d1,d2,d3,d4]
+    // [d0,d2,d3,d4]     <- copy over
+    // [d0,d2,d3]        <- resize
+    for(int x = i; x < dims.size()-1; ++x) {
+      dims[x] = dims[x+1];
+    }
+    dims.resize(dims.size()-1);
+
+    // (and the same for the strides)
+    si.erase(si.begin() + i);
+    so.erase(so.begin() + i);
+
+    // [3,1,2,4,0]
+    // [3,2,4,0,0] <- removed
+    // [3,2,4,0]   <- resized
+    // [2,1,3,0]   <- decremented
+
+    // find where x lives
+    int x = 0;
+    for(; x != perm.size(); ++x) {
+      if(perm[x] == i) {
+        break;
+      }
+    }
+
+    // shift to the left and resize
+    for(; x < perm.size()-1; ++x) {
+      perm[x] = perm[x+1];
+    }
+    perm.resize(perm.size()-1);
+
+    // decrement things greater than i
+    for(auto& p: perm) {
+      if(p > i) {
+        p--;
+      }
+    }
+  }
+
+private:
+  int elem_size;
+  int carrier;    // the size of the carrier type, in bytes
+
+  kernel_t kernel;
+  int rank;       // (counting in carriers)
+
+  int64_t batch_size;   // the number of batches
+  int64_t batch_offset; // the number of elements in each batch
+
+  // The distance between batches in the input and in the output
+  int64_t batch_str_inn;
+  int64_t batch_str_out;
+
+  // Whether the strides were the dense ones
+  bool dense;
+
+  // Whether the leaves do their offset arithmetic with int64_t or int
+  bool use_int64;
+
+  // Whether the leaves write with non-temporal stores
+  bool streaming;
+
+  vector<int64_t> str_inn;
+  vector<int64_t> str_out;
+
+  // The dimensions of each batch and their output strides (including the
+  // run dimension), and the side of the tiles that square in-place transposes
+  // swap
+  vector<int> sizes;
+  vector<int64_t> str_out_all;
+  int in_place_block;
+
+  // The length of the runs, for the runs kernel (1 otherwise)
+  int64_t run_len;
+
+  traversal_t traversal;
+
+  // The loop order of the leaves, the dimensions in that order (innermost
+  // first) and the strides in that order
+  loop_order_t loop_order;
+  vector<int> loop_dims;
+  vector<int64_t> str_inn_lo;
+  vector<int64_t> str_out_lo;
+
+  // The ranges of every tile, rank entries per tile. The tiles are the
+  // leaves when there are no patterns, otherwise nodes of the recursion
+  // and tile_pattern says which pattern each one has. The leaves of
+  // pattern p are pattern_start[p] up to pattern_start[p+1] in
+  // pattern_leaves, rank entries per leaf, relative to the tile's start.
+  vector<tuple<int,int>> tiles;
+  int num_tiles;
+  vector<int> tile_pattern;
+  vector<int64_t> pattern_start;
+  vector<tuple<int,int>> pattern_leaves;
+};
+
+// A bounded, thread-safe, least-recently-used cache of plans keyed on
+// (dims, perm, strides, min_block_bytes, elem_size, carrier size, store
+// mode, loop order, traversal). permute_t goes through the process wide one,
+// so call sites that keep seeing the same shapes skip the normalization,
+// stride building and tile collection without having to hold on to plans.
+//
+// Plans are handed out as shared_ptrs, so a plan that gets evicted while
+// another thread is still executing it stays alive until that thread is done.
+//
+// Besides the number of plans, what the plans hold (see get_bytes) is capped
+// at max_bytes. A plan bigger than that on its own is handed out but not
+// kept.
+struct permute_plan_cache_t {
+  struct stats_t {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    int size;
+    int64_t bytes;
+  };
+
+  static constexpr int64_t default_max_bytes = int64_t(64) << 20;
+
+  explicit permute_plan_cache_t(int capacity, int64_t max_bytes = default_max_bytes):
+    capacity(capacity), max_bytes(max_bytes), bytes(0),
+    hits(0), misses(0), evictions(0)
+  {}
+
+  static permute_plan_cache_t& global() {
+    static permute_plan_cache_t ret(64);
+    return ret;
+  }
+
+  std::shared_ptr<permute_plan_t const> get(
+    vector<int> const& dims,
+    vector<int> const& perm,
+    int min_block_bytes,
+    int elem_size = sizeof(float),
+    int elem_align = 0,
+    store_mode_t stores = store_mode_t::regular,
+    permute_plan_t::loop_order_t order = permute_plan_t::loop_order_t::automatic,
+    permute_plan_t::traversal_t traversal = permute_plan_t::traversal_t::recursive)
+  {
+    return get(
+      dims, perm, {}, {}, min_block_bytes, elem_size, elem_align, stores, order, traversal);
+  }
+
+  // Plans for strided views (see permute_plan_t); empty strides mean dense
+  std::shared_ptr<permute_plan_t const> get(
+    vector<int> const& dims,
+    vector<int> const& perm,
+    vector<int64_t> const& strides_inn,
+    vector<int64_t> const& strides_out,
+    int min_block_bytes,
+    int elem_size = sizeof(float),
+    int elem_align = 0,
+    store_mode_t stores = store_mode_t::regular,
+    permute_plan_t::loop_order_t order = permute_plan_t::loop_order_t::automatic,
+    permute_plan_t::traversal_t traversal = permute_plan_t::traversal_t::recursive)
+  {
+    key_t key = make_key(
+      dims, perm, strides_inn, strides_out, min_block_bytes,
+      elem_size, permute_plan_t::carrier_size(elem_size, elem_align),
+      stores, order, traversal);
+
+    {
+      std::unique_lock<std::mutex> lk(mutex);
+      auto iter = lookup.find(key);
+      if(iter != lookup.end()) {
+        hits++;
+        // move it to the front of the line
+        entries.splice(entries.begin(), entries, iter->second);
+        return iter->second->second;
+      }
+      misses++;
+    }
+
+    // Build the plan without holding the lock
+    auto plan = strides_inn.empty()
+      ? std::make_shared<permute_plan_t const>(
+          dims, perm, min_block_bytes, elem_size, elem_align,
+          stores, false, order, traversal)
+      : std::make_shared<permute_plan_t const>(
+          dims, perm, strides_inn, strides_out,
+          min_block_bytes, elem_size, elem_align, stores, false, order, traversal);
+
+    std::unique_lock<std::mutex> lk(mutex);
+
+    // Somebody else may have built the same plan in the mean time
+    auto iter = lookup.find(key);
+    if(iter != lookup.end()) {
+      entries.splice(entries.begin(), entries, iter->second);
+      return iter->second->second;
+    }
+
+    if(plan->get_bytes() > max_bytes) {
+      return plan;
+    }
+
+    entries.emplace_front(key, plan);
+    lookup.emplace(std::move(key), entries.begin());
+    bytes += plan->get_bytes();
+    shrink();
+
+    return plan;
+  }
+
+  stats_t stats() const {
+    std::unique_lock<std::mutex> lk(mutex);
+    return stats_t { hits, misses, evictions, int(entries.size()), bytes };
+  }
+
+  void set_capacity(int new_capacity) {
+    std::unique_lock<std::mutex> lk(mutex);
+    capacity = new_capacity;
+    shrink();
+  }
+
+  void set_max_bytes(int64_t new_max_bytes) {
+    std::unique_lock<std::mutex> lk(mutex);
+    max_bytes = new_max_bytes;
+    shrink();
+  }
+
+  // Drop every plan and zero the counters
+  void clear() {
+    std::unique_lock<std::mutex> lk(mutex);
+    entries.clear();
+    lookup.clear();
+    bytes = 0;
+    hits = 0;
+    misses = 0;
+    evictions = 0;
+  }
+
+private:
+  using key_t = vector<int64_t>;
+  using entry_t = std::pair<key_t, std::shared_ptr<permute_plan_t const>>;
+
+  static key_t make_key(
+    vector<int> const& dims,
+    vector<int> const& perm,
+    vector<int64_t> const& strides_inn,
+    vector<int64_t> const& strides_out,
+    int min_block_bytes,
+    int elem_size,
+    int carrier,
+    store_mode_t stores,
+    permute_plan_t::loop_order_t order,
+    permute_plan_t::traversal_t traversal)
+  {
+    // [min_block_bytes, elem_size, carrier, stores, order, traversal, strided,
+    //  dims..., perm..., strides_inn..., strides_out...];
+    // dims and perm have the same length, and so do the strides when
+    // there are any
+    key_t ret;
+    ret.reserve(7 + dims.size() + perm.size() + strides_inn.size() + strides_out.size());
+    ret.push_back(min_block_bytes);
+    ret.push_back(elem_size);
+    ret.push_back(carrier);
+    ret.push_back(int(stores));
+    ret.push_back(int(order));
+    ret.push_back(int(traversal));
+    ret.push_back(strides_inn.empty() ? 0 : 1);
+    ret.insert(ret.end(), dims.begin(), dims.end());
+    ret.insert(ret.end(), perm.begin(), perm.end());
+    ret.insert(ret.end(), strides_inn.begin(), strides_inn.end());
+    ret.insert(ret.end(), strides_out.begin(), strides_out.end());
+    return ret;
+  }
+
+  // (Must hold the lock)
+  void shrink() {
+    while(!entries.empty() && (int(entries.size()) > capacity || bytes > max_bytes)) {
+      bytes -= entries.back().second->get_bytes();
+      lookup.erase(entries.back().first);
+      entries.pop_back();
+      evictions++;
+    }
+  }
+
+  mutable std::mutex mutex;
+  int capacity;
+  int64_t max_bytes;
+  int64_t bytes; // held by the plans in entries
+
+  // Most recently used at the front
+  std::list<entry_t> entries;
+  std::map<key_t, std::list<entry_t>::iterator> lookup;
+
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+};
+
+// Machine specific settings for permute_t, per shape class. A shape class is
+// what the plan sees after fusing and singleton removal: the rank of each
+// batch, the carrier size, whether there are batch dimensions and the size of
+// the tensor in bytes, rounded down to a power of two. The settings are found
+// by autotuner_t (see autotune.h) and kept in a text file with one line per
+// class,
+//   rank carrier batched log2_bytes min_block_size stores
+// which global() reads the first time it is used.
+//
+// A lookup takes the class with the same rank, carrier and batching that is
+// closest in size, or the fallback when there is none.
+struct permute_tuning_t {
+  struct setting_t {
+    int min_block_size;  // in floats, as with permute_t
+    store_mode_t stores;
+  };
+
+  // [rank, carrier, batched, log2_bytes]
+  using class_t = std::array<int, 4>;
+
+  static constexpr int fallback_block_size = 1024;
+
+  permute_tuning_t() {}
+
+  // Starts out with whatever is in the file at path, if anything
+  explicit permute_tuning_t(std::string const& path) {
+    load(path);
+  }
+
+  // The file named by the PERMUTE_TUNING_FILE environment variable, otherwise
+  // permute_tuning.txt in the working directory
+  static std::string default_path() {
+    char const* env = std::getenv("PERMUTE_TUNING_FILE");
+    return env == nullptr ? "permute_tuning.txt" : env;
+  }
+
+  static permute_tuning_t& global() {
+    static permute_tuning_t ret(default_path());
+    return ret;
+  }
+
+  static class_t shape_class(
+    vector<int> dims,
+    vector<int> perm,
+    int elem_size = sizeof(float),
+    int elem_align = 0)
+  {
+    int64_t bytes = elem_size;
+    for(int const& d: dims) {
+      bytes *= d;
+    }
+    int log2_bytes = 0;
+    while((int64_t(2) << log2_bytes) <= bytes) {
+      log2_bytes++;
+    }
+
+    int carrier = permute_plan_t::carrier_size(elem_size, elem_align);
+    auto [si, so] = permute_plan_t::build_strides(dims, perm);
+    permute_plan_t::split_elems(dims, perm, si, so, elem_size / carrier);
+    permute_plan_t::normalize(dims, perm, si, so);
+    int num_batch_dims = permute_plan_t::count_batch_dims(perm);
+
+    return {
+      int(dims.size()) - num_batch_dims,
+      carrier,
+      num_batch_dims > 0 ? 1 : 0,
+      log2_bytes
+    };
+  }
+
+  setting_t lookup(class_t const& c, setting_t fallback) const {
+    std::unique_lock<std::mutex> lk(mutex);
+    int best_distance = -1;
+    for(auto const& [other, setting]: settings) {
+      if(other[0] != c[0] || other[1] != c[1] || other[2] != c[2]) {
+        continue;
+      }
+      int distance = std::abs(other[3] - c[3]);
+      if(best_distance < 0 || distance < best_distance) {
+        best_distance = distance;
+        fallback = setting;
+      }
+    }
+    return fallback;
+  }
+
+  void set(class_t const& c, setting_t setting) {
+    std::unique_lock<std::mutex> lk(mutex);
+    settings[c] = setting;
+  }
+
+  std::map<class_t, setting_t> get_settings() const {
+    std::unique_lock<std::mutex> lk(mutex);
+    return settings;
+  }
+
+  void clear() {
+    std::unique_lock<std::mutex> lk(mutex);
+    settings.clear();
+  }
+
+  // Adds the settings in the file to this one, returning false if the file
+  // can't be opened. Lines that don't parse are skipped, as are # comments.
+  bool load(std::string const& path) {
+    std::ifstream file(path);
+    if(!file) {
+      return false;
+    }
+
+    std::string line;
+    while(std::getline(file, line)) {
+      if(line.empty() || line[0] == '#') {
+        continue;
+      }
+      std::istringstream ss(line);
+      class_t c;
+      int block, stores;
+      if(ss >> c[0] >> c[1] >> c[2] >> c[3] >> block >> stores &&
+         block > 0 && stores >= 0 && stores <= int(store_mode_t::automatic))
+      {
+        set(c, setting_t { block, store_mode_t(stores) });
+      }
+    }
+    return true;
+  }
+
+  bool save(std::string const& path) const {
+    std::ofstream file(path);
+    if(!file) {
+      return false;
+    }
+
+    file << "# rank carrier batched log2_bytes min_block_size stores\n";
+    for(auto const& [c, setting]: get_settings()) {
+      file << c[0] << " " << c[1] << " " << c[2] << " " << c[3] << " "
+           << setting.min_block_size << " " << int(setting.stores) << "\n";
+    }
+    return bool(file);
+  }
+
+private:
+  mutable std::mutex mutex;
+  std::map<class_t, setting_t> settings;
+};
+
+// count tensors of the same shape, to be permuted with the same perm:
+// inns[i] goes to outs[i]. (See permute_t::batch.)
+template <typename T>
+struct permute_group_t {
+  vector<int> dims;
+  vector<int> perm;
+  T const* const* inns;
+  T* const* outs;
+  int64_t count;
+};
+
+// min_block_size counts 4 byte elements (floats); leaves are cut at
+// 4*min_block_size bytes for every element type. A min_block_size of 0 means
+// the block size and store mode come from permute_tuning_t::global(), for
+// whatever shape is being permuted.
+struct permute_t {
+  permute_t(int min_block_size):
+    min_block_bytes(min_block_size * sizeof(float)), pool(nullptr), grain_size(0),
+    stores(store_mode_t::regular),
+    loop_order(permute_plan_t::loop_order_t::automatic),
+    traversal(permute_plan_t::traversal_t::recursive),
+    data_align(0), counters(nullptr)
+  {}
+
+  // Parallel mode: the top levels of the bisection are spawned as tasks
+  // on pool, so idle threads steal the biggest remaining pieces. Once a piece
+  // has at most grain_size elements it runs serially.
+  permute_t(int min_block_size, thread_pool_t& pool, int grain_size = 1 << 16):
+    min_block_bytes(min_block_size * sizeof(float)), pool(&pool), grain_size(grain_size),
+    stores(store_mode_t::regular),
+    loop_order(permute_plan_t::loop_order_t::automatic),
+    traversal(permute_plan_t::traversal_t::recursive),
+    data_align(0), counters(nullptr)
+  {}
+
+  // The same permute, but writing the output with the given kind of stores
+  permute_t with_stores(store_mode_t mode) const {
+    permute_t ret = *this;
+    ret.stores = mode;
+    return ret;
+  }
+
+  // The same permute, but with the leaf loop order forced (see
+  // permute_plan_t::loop_order_t); for benchmarking the orders
+  permute_t with_loop_order(permute_plan_t::loop_order_t order) const {
+    permute_t ret = *this;
+    ret.loop_order = order;
+    return ret;
+  }
+
+  // The same permute, for inn and out that are known to be aligned to bytes
+  // (as buffer_t's are, see allocator.h). Elements whose alignof is less
+  // than their size, like structs of bytes, are then still moved in the
+  // widest carrier that divides their size.
+  permute_t with_alignment(int bytes) const {
+    permute_t ret = *this;
+    ret.data_align = bytes;
+    return ret;
+  }
+
+  // The same permute, but with the tiles cut and ordered by the given
+  // traversal (see permute_plan_t::traversal_t)
+  permute_t with_traversal(permute_plan_t::traversal_t t) const {
+    permute_t ret = *this;
+    ret.traversal = t;
+    return ret;
+  }
+
+  // The same permute, but every call adds what the hardware counters saw
+  // to stats (see perf_counters.h). stats has to outlive the permute_t and
+  // shouldn't be shared by threads calling at the same time.
+  permute_t with_counters(perf_stats_t& stats) const {
+    permute_t ret = *this;
+    ret.counters = &stats;
+    return ret;
+  }
+
+  template <typename T>
+  void operator()(
+    vector<int> const& dims,
+    vector<int> const& perm,
+    T const* inn,
+    T* out) const
+  {
+    static_assert(std::is_trivially_copyable<T>::value,
+      "permute_t only moves trivially copyable elements");
+    run(dims, perm, {}, {}, sizeof(T), alignof(T), inn, out);
+  }
+
+  // Strided views, see permute_plan_t. strides_inn is by input dimension and
+  // strides_out by output dimension, in elements.
+  template <typename T>
+  void operator()(
+    vector<int> const& dims,
+    vector<int> const& perm,
+    vector<int64_t> const& strides_inn,
+    vector<int64_t> const& strides_out,
+    T const* inn,
+    T* out) const
+  {
+    static_assert(std::is_trivially_copyable<T>::value,
+      "permute_t only moves trivially copyable elements");
+    run(dims, perm, strides_inn, strides_out, sizeof(T), alignof(T), inn, out);
+  }
+
+  // For when the element type is only known at runtime; inn and out must be
+  // aligned to the largest power of two that divides elem_size.
+  void operator()(
+    vector<int> const& dims,
+    vector<int> const& perm,
+    int elem_size,
+    void const* inn,
+    void* out) const
+  {
+    run(dims, perm, {}, {}, elem_size, 0, inn, out);
+  }
+
+  void operator()(
+    vector<int> const& dims,
+    vector<int> const& perm,
+    vector<int64_t> const& strides_inn,
+    vector<int64_t> const& strides_out,
+    int elem_size,
+    void const* inn,
+    void* out) const
+  {
+    run(dims, perm, strides_inn, strides_out, elem_size, 0, inn, out);
+  }
+
+  // out = e(permute(inn)) in one pass, with the epilogue applied in the leaf
+  // kernels (see epilogue.h). TO can differ from TI, for instance
+  //   permute_t(1024)(dims, perm, inn, out_bf16, scale_t(0.5f).then(to_bf16_t()))
+  // TI has to be a plain number type (one carrier wide, see permute_plan_t).
+  template <typename TI, typename TO, typename E>
+  void operator()(
+    vector<int> const& dims,
+    vector<int> const& perm,
+    TI const* inn,
+    TO* out,
+    E const& e) const
+  {
+    run(dims, perm, {}, {}, inn, out, e);
+  }
+
+  template <typename TI, typename TO, typename E>
+  void operator()(
+    vector<int> const& dims,
+    vector<int> const& perm,
+    vector<int64_t> const& strides_inn,
+    vector<int64_t> const& strides_out,
+    TI const* inn,
+    TO* out,
+    E const& e) const
+  {
+    run(dims, perm, strides_inn, strides_out, inn, out, e);
+  }
+
+  // out = beta*out + alpha*permute(inn), accumulated in the leaf tiles as
+  // they are visited (see accumulate_t), so no temporary is needed and the
+  // read-modify-write of out follows the same cache-oblivious order as a
+  // permute. That read-modify-write is never streamed. With beta = 0, out
+  // is not read at all and is written with the configured store mode, as
+  // for any permute.
+  template <typename T>
+  void accumulate(
+    vector<int> const& dims,
+    vector<int> const& perm,
+    double alpha,
+    T const* inn,
+    double beta,
+    T* out) const
+  {
+    accumulate(dims, perm, {}, {}, alpha, inn, beta, out);
+  }
+
+  template <typename T>
+  void accumulate(
+    vector<int> const& dims,
+    vector<int> const& perm,
+    vector<int64_t> const& strides_inn,
+    vector<int64_t> const& strides_out,
+    double alpha,
+    T const* inn,
+    double beta,
+    T* out) const
+  {
+    if(beta != 0.0) {
+      run(dims, perm, strides_inn, strides_out, inn, out, accumulate_t(alpha, beta));
+    } else if(alpha != 1.0) {
+      run(dims, perm, strides_inn, strides_out, inn, out, scale_t(alpha));
+    } else {
+      run(dims, perm, strides_inn, strides_out, inn, out, identity_epilogue_t());
+    }
+  }
+
+  // Many small tensors in one call: inns[i] is permuted into outs[i] for all
+  // count of them. The shape is analyzed (and the plan looked up) once for the
+  // lot, and with a pool the threads split up the tensors, grain_size
+  // elements' worth at a time, rather than each tensor being split up.
+  template <typename T>
+  void batch(
+    vector<int> const& dims,
+    vector<int> const& perm,
+    T const* const* inns,
+    T* const* outs,
+    int64_t count) const
+  {
+    batch(vector<permute_group_t<T>>{ { dims, perm, inns, outs, count } });
+  }
+
+  // The same for a few groups of tensors with different shapes; there is one
+  // plan per group, and with a pool all the groups run at once.
+  template <typename T>
+  void batch(vector<permute_group_t<T>> const& groups) const {
+    static_assert(std::is_trivially_copyable<T>::value,
+      "permute_t only moves trivially copyable elements");
+
+    uint64_t bytes = 0;
+    for(auto const& g: groups) {
+      bytes += g.count * bytes_moved(g.dims, sizeof(T));
+    }
+    perf_scope_t scope(counters, bytes);
+
+    vector<std::shared_ptr<permute_plan_t const>> plans;
+    plans.reserve(groups.size());
+    for(auto const& g: groups) {
+      plans.push_back(get_plan(g.dims, g.perm, {}, {}, sizeof(T), alignof(T)));
+    }
+
+    if(pool == nullptr) {
+      for(int i = 0; i != groups.size(); ++i) {
+        plans[i]->execute_batch(
+          (void const* const*)groups[i].inns, (void* const*)groups[i].outs, groups[i].count);
+      }
+      return;
+    }
+
+    thread_pool_t::task_group_t group;
+    for(int i = 0; i != groups.size(); ++i) {
+      plans[i]->spawn_batch(
+        (void const* const*)groups[i].inns, (void* const*)groups[i].outs, groups[i].count,
+        grain_size, *pool, group);
+    }
+    pool->wait(group);
+  }
+
+  // Permute data in place, see permute_plan_t::execute_in_place. This
+  // always runs serially and ignores the store mode.
+  template <typename T>
+  void in_place(
+    vector<int> const& dims,
+    vector<int> const& perm,
+    T* data) const
+  {
+    static_assert(std::is_trivially_copyable<T>::value,
+      "permute_t only moves trivially copyable elements");
+    perf_scope_t scope(counters, bytes_moved(dims, sizeof(T)));
+    get_plan(dims, perm, {}, {}, sizeof(T), alignof(T))->execute_in_place(data);
+  }
+
+  void in_place(
+    vector<int> const& dims,
+    vector<int> const& perm,
+    int elem_size,
+    void* data) const
+  {
+    perf_scope_t scope(counters, bytes_moved(dims, elem_size));
+    get_plan(dims, perm, {}, {}, elem_size, 0)->execute_in_place(data);
+  }
+
+  // The plan that a call with these arguments uses, to see what was chosen
+  // for it (the kernel, the loop order, the number of tiles, ...)
+  std::shared_ptr<permute_plan_t const> plan(
+    vector<int> const& dims,
+    vector<int> const& perm,
+    int elem_size = sizeof(float),
+    int elem_align = 0) const
+  {
+    return get_plan(dims, perm, {}, {}, elem_size, elem_align);
+  }
+
+private:
+  void run(
+    vector<int> const& dims,
+    vector<int> const& perm,
+    vector<int64_t> const& strides_inn,
+    vector<int64_t> const& strides_out,
+    int elem_size,
+    int elem_align,
+    void const* inn,
+    void* out) const
+  {
+    perf_scope_t scope(counters, bytes_moved(dims, elem_size));
+
+    auto plan = get_plan(dims, perm, strides_inn, strides_out, elem_size, elem_align);
+    if(pool == nullptr) {
+      plan->execute(inn, out);
+    } else {
+      plan->execute(inn, out, *pool, grain_size);
+    }
+  }
+
+  template <typename TI, typename TO, typename E>
+  void run(
+    vector<int> const& dims,
+    vector<int> const& perm,
+    vector<int64_t> const& strides_inn,
+    vector<int64_t> const& strides_out,
+    TI const* inn,
+    TO* out,
+    E const& e) const
+  {
+    static_assert(
+      std::is_trivially_copyable<TI>::value && std::is_trivially_copyable<TO>::value,
+      "permute_t only moves trivially copyable elements");
+    // (accumulating reads the output too)
+    int out_size = is_accumulating<E>::value ? 2*sizeof(TO) : sizeof(TO);
+    perf_scope_t scope(counters, bytes_moved(dims, sizeof(TI), out_size));
+
+    auto plan = get_plan(dims, perm, strides_inn, strides_out, sizeof(TI), alignof(TI));
+    if(pool == nullptr) {
+      plan->execute(inn, out, e);
+    } else {
+      plan->execute(inn, out, e, *pool, grain_size);
+    }
+  }
+
+  // Only worked out when somebody is counting
+  uint64_t bytes_moved(vector<int> const& dims, int elem_size) const {
+    return bytes_moved(dims, elem_size, elem_size);
+  }
+
+  uint64_t bytes_moved(vector<int> const& dims, int inn_size, int out_size) const {
+    uint64_t ret = 0;
+    if(counters != nullptr) {
+      ret = uint64_t(inn_size) + uint64_t(out_size);
+      for(int const& d: dims) {
+        ret *= d;
+      }
+    }
+    return ret;
+  }
+
+  std::shared_ptr<permute_plan_t const> get_plan(
+    vector<int> const& dims,
+    vector<int> const& perm,
+    vector<int64_t> const& strides_inn,
+    vector<int64_t> const& strides_out,
+    int elem_size,
+    int elem_align) const
+  {
+    // (0 already means as aligned as the size allows)
+    if(elem_align > 0 && data_align > elem_align) {
+      elem_align = data_align;
+    }
+
+    int block_bytes = min_block_bytes;
+    store_mode_t mode = stores;
+    if(min_block_bytes == 0) {
+      auto setting = permute_tuning_t::global().lookup(
+        permute_tuning_t::shape_class(dims, perm, elem_size, elem_align),
+        { permute_tuning_t::fallback_block_size, stores });
+      block_bytes = setting.min_block_size * sizeof(float);
+      mode = setting.stores;
+    }
+
+    return permute_plan_cache_t::global().get(
+      dims, perm, strides_inn, strides_out,
+      block_bytes, elem_size, elem_align, mode, loop_order, traversal);
+  }
+
+  int min_block_bytes;
+  thread_pool_t* pool;
+  int grain_size;
+  store_mode_t stores;
+  permute_plan_t::loop_order_t loop_order;
+  permute_plan_t::traversal_t traversal;
+  int data_align;
+  perf_stats_t* counters;
 };
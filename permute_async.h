@@ -0,0 +1,244 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <algorithm>
+#include <cstdint>
+
+#include "thread_pool.h"
+#include "permute.h"
+
+using std::vector;
+
+// Permutes submitted to run in the background on a thread pool, for when the
+// caller has other work to get on with. submit returns right away with a
+// permute_future_t to wait on later.
+//
+// Every permute is cut into slices of about grain_size elements, ranges of
+// the plan's work items (see permute_plan_t::execute_range). The pool isn't
+// given slices of particular permutes, though: each task it runs takes the
+// next slice of whichever permute is first in line. That is the highest
+// priority one, and among permutes of the same priority they take turns a
+// slice at a time, so a small permute submitted behind a big one doesn't
+// wait for all of it, and no thread is ever started per permute.
+//
+// A permute can be submitted after others (say, one that reads what they
+// write); its slices are queued once they have all finished.
+struct permute_executor_t;
+
+struct permute_future_t {
+  permute_future_t() {}
+
+  // Whether the permute has finished (and its output is all written)
+  bool is_ready() const;
+
+  // Wait for the permute to finish, running tasks of the pool meanwhile
+  void wait() const;
+
+private:
+  friend struct permute_executor_t;
+
+  struct state_t {
+    permute_executor_t* executor;
+    std::shared_ptr<permute_plan_t const> plan;
+    void const* inn;
+    void* out;
+    int priority;
+
+    int64_t num_items;
+    int64_t grain_items;
+    int64_t next_item; // the first not yet handed out, under the executor's lock
+    std::atomic<int64_t> done_items{0};
+
+    // The permutes it is waiting for that haven't finished yet, plus one
+    // while it is being submitted
+    std::atomic<int> waiting{1};
+
+    std::mutex mutex;
+    std::atomic<bool> done{false};
+    vector<std::shared_ptr<state_t>> dependents;
+  };
+
+  explicit permute_future_t(std::shared_ptr<state_t> state): state(state) {}
+
+  std::shared_ptr<state_t> state;
+};
+
+struct permute_executor_t {
+  // The permutes are planned with f (its block size, store mode and so on;
+  // not its pool, if it has one) and run on pool
+  explicit permute_executor_t(
+    thread_pool_t& pool,
+    permute_t f = permute_t(1024),
+    int grain_size = 1 << 16):
+      pool(pool), f(f), grain_size(grain_size)
+  {}
+
+  permute_executor_t(permute_executor_t const&) = delete;
+  permute_executor_t& operator=(permute_executor_t const&) = delete;
+
+  // Waits for everything submitted
+  ~permute_executor_t() {
+    pool.wait(group);
+  }
+
+  // Permute inn into out once every permute in after has finished, ahead
+  // of the ones with a lower priority. inn and out have to stay alive
+  // until the returned future is ready.
+  template <typename T>
+  permute_future_t submit(
+    vector<int> const& dims,
+    vector<int> const& perm,
+    T const* inn,
+    T* out,
+    int priority = 0,
+    vector<permute_future_t> const& after = {})
+  {
+    static_assert(std::is_trivially_copyable<T>::value,
+      "permute_t only moves trivially copyable elements");
+    return submit(
+      f.plan(dims, perm, sizeof(T), alignof(T)), inn, out, priority, after);
+  }
+
+  // For when the element type is only known at runtime, see permute_t
+  permute_future_t submit(
+    vector<int> const& dims,
+    vector<int> const& perm,
+    int elem_size,
+    void const* inn,
+    void* out,
+    int priority = 0,
+    vector<permute_future_t> const& after = {})
+  {
+    return submit(f.plan(dims, perm, elem_size, 0), inn, out, priority, after);
+  }
+
+  thread_pool_t& get_pool() const { return pool; }
+
+private:
+  using state_t = permute_future_t::state_t;
+
+  permute_future_t submit(
+    std::shared_ptr<permute_plan_t const> plan,
+    void const* inn, void* out,
+    int priority,
+    vector<permute_future_t> const& after)
+  {
+    auto state = std::make_shared<state_t>();
+    state->executor = this;
+    state->plan = plan;
+    state->inn = inn;
+    state->out = out;
+    state->priority = priority;
+    state->num_items = plan->num_work_items();
+    state->grain_items = std::max(
+      int64_t(1), grain_size / std::max(int64_t(1), plan->work_item_elems()));
+    state->next_item = 0;
+
+    for(auto const& dep: after) {
+      // (a default constructed future is ready)
+      if(dep.state == nullptr) {
+        continue;
+      }
+      std::unique_lock<std::mutex> lk(dep.state->mutex);
+      if(!dep.state->done) {
+        state->waiting++;
+        dep.state->dependents.push_back(state);
+      }
+    }
+    release(state);
+
+    return permute_future_t(state);
+  }
+
+  // One less thing for state to wait for; queue it if that was the last
+  void release(std::shared_ptr<state_t> const& state) {
+    if(--state->waiting > 0) {
+      return;
+    }
+
+    if(state->num_items == 0) {
+      finish(state);
+      return;
+    }
+
+    int64_t num_slices = (state->num_items + state->grain_items - 1) / state->grain_items;
+    {
+      std::unique_lock<std::mutex> lk(mutex);
+      queues[state->priority].push_back(state);
+    }
+    for(int64_t i = 0; i != num_slices; ++i) {
+      pool.spawn(group, [this] { run_next(); });
+    }
+  }
+
+  // Run the next slice of whichever permute is first in line
+  void run_next() {
+    std::shared_ptr<state_t> state;
+    int64_t beg, end;
+    {
+      std::unique_lock<std::mutex> lk(mutex);
+      auto iter = queues.begin();
+      auto& queue = iter->second;
+      state = queue.front();
+      queue.pop_front();
+
+      beg = state->next_item;
+      end = std::min(state->num_items, beg + state->grain_items);
+      state->next_item = end;
+
+      // (to the back of the line, if there is more of it)
+      if(end != state->num_items) {
+        queue.push_back(state);
+      }
+      if(queue.empty()) {
+        queues.erase(iter);
+      }
+    }
+
+    state->plan->execute_range(beg, end, state->inn, state->out);
+
+    if((state->done_items += end - beg) == state->num_items) {
+      finish(state);
+    }
+  }
+
+  void finish(std::shared_ptr<state_t> const& state) {
+    vector<std::shared_ptr<state_t>> dependents;
+    {
+      std::unique_lock<std::mutex> lk(state->mutex);
+      state->done = true;
+      std::swap(dependents, state->dependents);
+    }
+    // (a dependent may be another executor's)
+    for(auto const& dep: dependents) {
+      dep->executor->release(dep);
+    }
+  }
+
+  thread_pool_t& pool;
+  permute_t f;
+  int grain_size;
+
+  // Every task spawned, to wait for on the way out
+  thread_pool_t::task_group_t group;
+
+  // The permutes with slices left to hand out, highest priority first
+  std::mutex mutex;
+  std::map<int, std::deque<std::shared_ptr<state_t>>, std::greater<int>> queues;
+};
+
+inline bool permute_future_t::is_ready() const {
+  return state == nullptr || state->done.load();
+}
+
+inline void permute_future_t::wait() const {
+  if(state != nullptr) {
+    state->executor->get_pool().wait_until([this] { return is_ready(); });
+  }
+}
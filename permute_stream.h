@@ -0,0 +1,246 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+
+#include "thread_pool.h"
+#include "permute.h"
+#include "allocator.h"
+
+using std::vector;
+
+// A permute that hands out its output a chunk at a time, in order, so that
+// whoever consumes it (a serializer, a compressor, a socket) can get going
+// on the front of the output before the back is done, and without the whole
+// output ever being in memory.
+//
+// A chunk is a slab of the output: the innermost output dimensions whole, a
+// range along the next one and a single index along the rest, which is a
+// contiguous piece of the column major output. Each slab is a smaller
+// (strided on the input side) permute, run with the given permute_t into one
+// of two chunk sized scratch buffers. Every slab of full size has the same
+// shape and strides, so they all share one cached plan, and within a slab
+// the tiles come from the plan's recursion as usual.
+//
+// With a thread pool the next chunk is permuted on the pool while the
+// consumer has the current one.
+struct permute_stream_t {
+  struct chunk_t {
+    void const* data = nullptr;
+    int64_t offset   = 0; // where the chunk goes in the output, in elements
+    int64_t elems    = 0;
+
+    template <typename T>
+    T const* as() const { return static_cast<T const*>(data); }
+  };
+
+  // Chunks of at most chunk_bytes (but at least one element). inn has to
+  // stay alive and unchanged while the stream is.
+  permute_stream_t(
+    permute_t f,
+    vector<int> const& dims,
+    vector<int> const& perm,
+    int elem_size,
+    void const* inn,
+    int64_t chunk_bytes):
+      f(f), pool(nullptr), dims(dims), perm(perm), elem_size(elem_size),
+      inn((char const*)inn), next_chunk(0), ahead(false)
+  {
+    init(chunk_bytes);
+  }
+
+  // The same, with the next chunk being permuted on pool in the meantime
+  permute_stream_t(
+    permute_t f,
+    vector<int> const& dims,
+    vector<int> const& perm,
+    int elem_size,
+    void const* inn,
+    int64_t chunk_bytes,
+    thread_pool_t& pool):
+      permute_stream_t(f, dims, perm, elem_size, inn, chunk_bytes)
+  {
+    this->pool = &pool;
+  }
+
+  // (the pool may be writing into the scratch)
+  permute_stream_t(permute_stream_t const&) = delete;
+  permute_stream_t& operator=(permute_stream_t const&) = delete;
+
+  ~permute_stream_t() {
+    if(pool != nullptr) {
+      pool->wait(group);
+    }
+  }
+
+  // The next chunk, which stays valid until the following call. false once
+  // the whole output has been handed out.
+  bool next(chunk_t& chunk) {
+    if(next_chunk == num_chunks) {
+      return false;
+    }
+
+    int64_t q = next_chunk++;
+    char* buf = scratch[q % 2].as<char>();
+    if(ahead) {
+      pool->wait(group);
+    } else {
+      produce(q, buf);
+    }
+
+    ahead = pool != nullptr && next_chunk != num_chunks;
+    if(ahead) {
+      int64_t r = next_chunk;
+      char* other = scratch[r % 2].as<char>();
+      pool->spawn(group, [this, r, other] { produce(r, other); });
+    }
+
+    chunk.data   = buf;
+    chunk.offset = chunk_offset(q);
+    chunk.elems  = chunk_elems(q);
+    return true;
+  }
+
+  // Call consume(chunk) on every chunk, in order
+  template <typename F>
+  void for_each(F consume) {
+    chunk_t chunk;
+    while(next(chunk)) {
+      consume(chunk);
+    }
+  }
+
+  int64_t get_num_chunks() const { return num_chunks; }
+
+  // The memory the stream holds on to, which is two chunks
+  int64_t scratch_bytes() const { return scratch[0].bytes + scratch[1].bytes; }
+
+private:
+  void init(int64_t chunk_bytes) {
+    int rank = dims.size();
+    int64_t max_elems = std::max(int64_t(1), chunk_bytes / elem_size);
+
+    auto [si, so] = permute_plan_t::build_strides(dims, perm);
+    str_inn = si;
+
+    // (nothing to hand out, and no chunk to size)
+    if(total() == 0) {
+      slab_dim = 0;
+      inner = 0;
+      step = 1;
+      per_slab_dim = 1;
+      num_chunks = 0;
+      return;
+    }
+
+    // The slab dimension: the outermost output dimension that the ones
+    // inside it fit in a chunk with
+    slab_dim = 0;
+    inner = 1;
+    while(slab_dim + 1 < rank && inner * dims[perm[slab_dim]] <= max_elems) {
+      inner *= dims[perm[slab_dim]];
+      slab_dim++;
+    }
+    int extent = dims[perm[slab_dim]];
+    step = std::max(int64_t(1), std::min(int64_t(extent), max_elems / inner));
+    per_slab_dim = (extent + step - 1) / step;
+
+    num_chunks = per_slab_dim;
+    for(int k = slab_dim + 1; k < rank; ++k) {
+      num_chunks *= dims[perm[k]];
+    }
+
+    // The input dimensions inside a slab, in input order
+    for(int k = 0; k <= slab_dim; ++k) {
+      slab_inn.push_back(perm[k]);
+    }
+    std::sort(slab_inn.begin(), slab_inn.end());
+    for(int k = 0; k <= slab_dim; ++k) {
+      int at = std::find(slab_inn.begin(), slab_inn.end(), perm[k]) - slab_inn.begin();
+      slab_perm.push_back(at);
+    }
+    for(int const& i: slab_inn) {
+      slab_str_inn.push_back(str_inn[i]);
+    }
+
+    int64_t buf_bytes = std::min(inner * step, total()) * elem_size;
+    scratch[0] = buffer_t(buf_bytes);
+    scratch[1] = buffer_t(buf_bytes);
+  }
+
+  int64_t total() const {
+    int64_t ret = 1;
+    for(int const& d: dims) {
+      ret *= d;
+    }
+    return ret;
+  }
+
+  // Where along the slab dimension chunk q starts
+  int64_t slab_start(int64_t q) const { return (q % per_slab_dim) * step; }
+
+  int64_t chunk_elems(int64_t q) const {
+    int extent = dims[perm[slab_dim]];
+    return inner * std::min(step, extent - slab_start(q));
+  }
+
+  int64_t chunk_offset(int64_t q) const {
+    int extent = dims[perm[slab_dim]];
+    return inner * (slab_start(q) + (q / per_slab_dim) * extent);
+  }
+
+  // Permute chunk q into buf
+  void produce(int64_t q, char* buf) const {
+    int rank = dims.size();
+    int64_t start = slab_start(q);
+    int64_t pos = start * str_inn[perm[slab_dim]];
+    int64_t rest = q / per_slab_dim;
+    for(int k = slab_dim + 1; k < rank; ++k) {
+      pos += (rest % dims[perm[k]]) * str_inn[perm[k]];
+      rest /= dims[perm[k]];
+    }
+
+    vector<int> slab_dims;
+    for(int const& i: slab_inn) {
+      slab_dims.push_back(
+        i == perm[slab_dim] ? int(std::min(step, dims[i] - start)) : dims[i]);
+    }
+    vector<int64_t> slab_str_out(slab_perm.size());
+    int64_t m = 1;
+    for(int k = 0; k != slab_perm.size(); ++k) {
+      slab_str_out[k] = m;
+      m *= slab_dims[slab_perm[k]];
+    }
+
+    f(slab_dims, slab_perm, slab_str_inn, slab_str_out, elem_size,
+      inn + pos * elem_size, buf);
+  }
+
+  permute_t f;
+  thread_pool_t* pool;
+  thread_pool_t::task_group_t group;
+
+  vector<int> dims;
+  vector<int> perm;
+  int elem_size;
+  char const* inn;
+  vector<int64_t> str_inn;
+
+  // Chunks are step indices of output dimension slab_dim, whose inner
+  // dimensions make up inner elements
+  int slab_dim;
+  int64_t inner;
+  int64_t step;
+  int64_t per_slab_dim;
+  int64_t num_chunks;
+
+  // The permute of one slab
+  vector<int> slab_inn;
+  vector<int> slab_perm;
+  vector<int64_t> slab_str_inn;
+
+  buffer_t scratch[2];
+  int64_t next_chunk;
+  bool ahead;
+};
@@ -0,0 +1,478 @@
+#pragma once
+
+#if defined(__SSE__)
+#include <immintrin.h>
+#endif
+
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <utility>
+
+#include "cache_size.h"
+
+// Register-tile transpose micro-kernels.
+//
+// The leaf loops copy out[j + ldo*i] = inn[i + ldi*j]. One side is always
+// strided, so the auto-vectorizer gives up on it. These kernels instead load
+// W contiguous columns of the input into W registers, shuffle them in
+// registers and store W contiguous rows of the output.
+//
+// Offsets are computed in the index type I (int or int64_t, see index_type.h).
+//
+// Which kernels exist depends on the element type T and on what the
+// compiler is allowed to emit:
+//   float:  W = 16 with AVX-512, W = 8 with AVX, W = 4 with SSE
+//   double: W = 4 with AVX
+// (So compile with -march=native to get the wider ones.) Every other element
+// type uses the scalar loop.
+//
+// With Stream set, the kernels write the output rows with non-temporal
+// (streaming) stores wherever a row is aligned to the vector width; a
+// misaligned vector would only write parts of two lines, and streaming
+// partial lines is slower than not streaming at all. The caller has to call
+// stream_fence() before anybody else reads the output.
+//
+// The kernels can also apply an epilogue on the way out (see epilogue.h):
+// a function object e, so that out = e(inn) transposed. The output type may
+// differ from the input type (e.g. float to bf16). When e can be called on
+// the kernel's registers and what it returns can be stored as an output row,
+// the kernel applies it in registers; otherwise that width is skipped and e is
+// applied element by element. Accumulating epilogues also read the output
+// rows, out = e(inn, out).
+
+inline bool is_aligned(void const* p, int bytes) {
+  return (uintptr_t(p) & (bytes - 1)) == 0;
+}
+
+inline void stream_fence() {
+#if defined(__SSE__)
+  _mm_sfence();
+#endif
+}
+
+#if defined(__SSE__)
+template <bool Stream>
+inline void store_row(float* p, __m128 x) {
+  if(Stream && is_aligned(p, 16)) {
+    _mm_stream_ps(p, x);
+  } else {
+    _mm_storeu_ps(p, x);
+  }
+}
+#endif
+
+#if defined(__AVX__)
+template <bool Stream>
+inline void store_row(float* p, __m256 x) {
+  if(Stream && is_aligned(p, 32)) {
+    _mm256_stream_ps(p, x);
+  } else {
+    _mm256_storeu_ps(p, x);
+  }
+}
+
+template <bool Stream>
+inline void store_row(double* p, __m256d x) {
+  if(Stream && is_aligned(p, 32)) {
+    _mm256_stream_pd(p, x);
+  } else {
+    _mm256_storeu_pd(p, x);
+  }
+}
+
+// 16 16 bit elements (bf16 or fp16 converted from a row of floats)
+template <bool Stream>
+inline void store_row(uint16_t* p, __m256i x) {
+  if(Stream && is_aligned(p, 32)) {
+    _mm256_stream_si256((__m256i*)p, x);
+  } else {
+    _mm256_storeu_si256((__m256i*)p, x);
+  }
+}
+#endif
+
+#if defined(__SSE2__)
+// 8 16 bit elements
+template <bool Stream>
+inline void store_row(uint16_t* p, __m128i x) {
+  if(Stream && is_aligned(p, 16)) {
+    _mm_stream_si128((__m128i*)p, x);
+  } else {
+    _mm_storeu_si128((__m128i*)p, x);
+  }
+}
+#endif
+
+#if defined(__AVX512F__)
+template <bool Stream>
+inline void store_row(float* p, __m512 x) {
+  if(Stream && is_aligned(p, 64)) {
+    _mm512_stream_ps(p, x);
+  } else {
+    _mm512_storeu_ps(p, x);
+  }
+}
+#endif
+
+// memcpy, except the destination is written with streaming stores
+inline void stream_copy(void* out, void const* inn, int64_t bytes) {
+#if defined(__SSE2__)
+  char* o = (char*)out;
+  char const* i = (char const*)inn;
+
+  int64_t head = (16 - (uintptr_t(o) & 15)) & 15;
+  if(head >= bytes) {
+    std::memcpy(o, i, bytes);
+    return;
+  }
+  std::memcpy(o, i, head);
+  o += head;
+  i += head;
+  bytes -= head;
+
+  for(; bytes >= 16; bytes -= 16, o += 16, i += 16) {
+    _mm_stream_si128((__m128i*)o, _mm_loadu_si128((__m128i const*)i));
+  }
+
+  std::memcpy(o, i, bytes);
+#else
+  std::memcpy(out, inn, bytes);
+#endif
+}
+
+// A single element, streamed when it is an aligned 4, 8 or 16 bytes
+template <bool Stream, typename T>
+inline void store_elem(T* p, T const& x) {
+#if defined(__SSE2__)
+  if constexpr (Stream && sizeof(T) == 4) {
+    int v;
+    std::memcpy(&v, &x, 4);
+    _mm_stream_si32((int*)p, v);
+    return;
+  }
+#if defined(__x86_64__)
+  if constexpr (Stream && sizeof(T) == 8) {
+    long long v;
+    std::memcpy(&v, &x, 8);
+    _mm_stream_si64((long long*)p, v);
+    return;
+  }
+#endif
+  if constexpr (Stream && sizeof(T) == 16) {
+    if(is_aligned(p, 16)) {
+      _mm_stream_si128((__m128i*)p, _mm_loadu_si128((__m128i const*)&x));
+      return;
+    }
+  }
+#endif
+  *p = x;
+}
+
+// How the output gets written.
+//   regular:   ordinary stores, so the output ends up in cache
+//   streaming: non-temporal stores that go around the cache; worth it when
+//              the output is too big to stay in cache anyway, since then the
+//              lines don't have to be read in first or evicted later
+//   automatic: streaming once the output is at least the size of the last
+//              level cache
+enum class store_mode_t { regular, streaming, automatic };
+
+inline bool use_streaming(store_mode_t mode, int64_t out_bytes) {
+  if(mode == store_mode_t::automatic) {
+    return out_bytes >= llc_cache_bytes();
+  }
+  return mode == store_mode_t::streaming;
+}
+
+// A row of the output as a register like x, for accumulating epilogues
+#if defined(__SSE__)
+inline __m128 load_row(float const* p, __m128) { return _mm_loadu_ps(p); }
+#endif
+#if defined(__AVX__)
+inline __m256  load_row(float  const* p, __m256)  { return _mm256_loadu_ps(p); }
+inline __m256d load_row(double const* p, __m256d) { return _mm256_loadu_pd(p); }
+#endif
+#if defined(__AVX512F__)
+inline __m512 load_row(float const* p, __m512) { return _mm512_loadu_ps(p); }
+#endif
+
+// The epilogue that leaves every element as it is; this is what plain
+// copies and transposes use, and it costs nothing after inlining
+struct identity_epilogue_t {
+  template <typename X>
+  X const& operator()(X const& x) const { return x; }
+};
+
+// An epilogue e normally maps each element, out = e(x). One with a static
+// constexpr bool accumulates = true instead combines it with what is already
+// there, out = e(x, out); those are never written with streaming stores,
+// since the output lines have to be read anyway.
+template <typename E, typename = void>
+struct is_accumulating: std::false_type {};
+
+template <typename E>
+struct is_accumulating<E, std::enable_if_t<E::accumulates>>: std::true_type {};
+
+// Write the element x through e to p
+template <bool Stream, typename TO, typename X, typename E>
+inline void write_elem(TO* p, X const& x, E const& e) {
+  if constexpr (is_accumulating<E>::value) {
+    *p = TO(e(x, *p));
+  } else {
+    store_elem<Stream>(p, TO(e(x)));
+  }
+}
+
+// Write the register x through e as the row at p
+template <bool Stream, typename TO, typename V, typename E>
+inline void write_row(TO* p, V const& x, E const& e) {
+  if constexpr (is_accumulating<E>::value) {
+    store_row<false>(p, e(x, load_row(p, x)));
+  } else {
+    store_row<Stream>(p, e(x));
+  }
+}
+
+// Whether e can be applied to a register x of the kernel K (of type
+// K::vec()) and what it gives stored as a row of a TO*. That is when K
+// applies e in registers.
+template <typename TO, typename E, typename K, typename = void>
+struct is_vector_map: std::false_type {};
+
+template <typename TO, typename E, typename K>
+struct is_vector_map<TO, E, K, std::void_t<decltype(
+  store_row<false>(std::declval<TO*>(), std::declval<E const&>()(K::vec())))>>:
+    std::true_type {};
+
+template <typename TO, typename E, typename K, typename = void>
+struct is_vector_accumulate: std::false_type {};
+
+template <typename TO, typename E, typename K>
+struct is_vector_accumulate<TO, E, K, std::void_t<decltype(
+  store_row<false>(std::declval<TO*>(), std::declval<E const&>()(
+    K::vec(), load_row(std::declval<TO*>(), K::vec()))))>>:
+    std::true_type {};
+
+template <typename TO, typename E, typename K>
+constexpr bool is_vector_epilogue() {
+  if constexpr (is_accumulating<E>::value) {
+    return is_vector_accumulate<TO, E, K>::value;
+  } else {
+    return is_vector_map<TO, E, K>::value;
+  }
+}
+
+template <typename T, int W>
+struct transpose_kernel_t {
+  // No register kernel of this width; transpose_tile falls back to scalar
+  static constexpr bool exists = false;
+  template <bool Stream, typename I, typename TO, typename E>
+  static inline void apply(T const*, I, TO*, I, E const&) {}
+};
+
+// Whether there is a W wide kernel for T that can apply e on the way to TO
+template <typename T, int W, typename TO, typename E>
+constexpr bool has_transpose_kernel() {
+  if constexpr (transpose_kernel_t<T, W>::exists) {
+    return is_vector_epilogue<TO, E, transpose_kernel_t<T, W>>();
+  } else {
+    return false;
+  }
+}
+
+#if defined(__SSE__)
+template <>
+struct transpose_kernel_t<float, 4> {
+  static constexpr bool exists = true;
+  static __m128 vec(); // (the register type, never called)
+  template <bool Stream, typename I, typename TO, typename E>
+  static inline void apply(float const* inn, I ldi, TO* out, I ldo, E const& e) {
+    __m128 r0 = _mm_loadu_ps(inn + 0*ldi);
+    __m128 r1 = _mm_loadu_ps(inn + 1*ldi);
+    __m128 r2 = _mm_loadu_ps(inn + 2*ldi);
+    __m128 r3 = _mm_loadu_ps(inn + 3*ldi);
+    _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+    write_row<Stream>(out + 0*ldo, r0, e);
+    write_row<Stream>(out + 1*ldo, r1, e);
+    write_row<Stream>(out + 2*ldo, r2, e);
+    write_row<Stream>(out + 3*ldo, r3, e);
+  }
+};
+#endif
+
+#if defined(__AVX__)
+template <>
+struct transpose_kernel_t<float, 8> {
+  static constexpr bool exists = true;
+  static __m256 vec(); // (the register type, never called)
+  template <bool Stream, typename I, typename TO, typename E>
+  static inline void apply(float const* inn, I ldi, TO* out, I ldo, E const& e) {
+    __m256 r[8];
+    __m256 t[8];
+    for(int k = 0; k != 8; ++k) {
+      r[k] = _mm256_loadu_ps(inn + k*ldi);
+    }
+
+    // interleave pairs of columns
+    for(int k = 0; k != 8; k += 2) {
+      t[k  ] = _mm256_unpacklo_ps(r[k], r[k+1]);
+      t[k+1] = _mm256_unpackhi_ps(r[k], r[k+1]);
+    }
+
+    // 4x4 transposes within each 128 bit lane
+    for(int k = 0; k != 8; k += 4) {
+      r[k  ] = _mm256_shuffle_ps(t[k  ], t[k+2], 0x44);
+      r[k+1] = _mm256_shuffle_ps(t[k  ], t[k+2], 0xEE);
+      r[k+2] = _mm256_shuffle_ps(t[k+1], t[k+3], 0x44);
+      r[k+3] = _mm256_shuffle_ps(t[k+1], t[k+3], 0xEE);
+    }
+
+    // swap the off-diagonal 4x4 blocks
+    for(int k = 0; k != 4; ++k) {
+      t[k  ] = _mm256_permute2f128_ps(r[k], r[k+4], 0x20);
+      t[k+4] = _mm256_permute2f128_ps(r[k], r[k+4], 0x31);
+    }
+
+    for(int k = 0; k != 8; ++k) {
+      write_row<Stream>(out + k*ldo, t[k], e);
+    }
+  }
+};
+
+template <>
+struct transpose_kernel_t<double, 4> {
+  static constexpr bool exists = true;
+  static __m256d vec(); // (the register type, never called)
+  template <bool Stream, typename I, typename TO, typename E>
+  static inline void apply(double const* inn, I ldi, TO* out, I ldo, E const& e) {
+    __m256d r0 = _mm256_loadu_pd(inn + 0*ldi);
+    __m256d r1 = _mm256_loadu_pd(inn + 1*ldi);
+    __m256d r2 = _mm256_loadu_pd(inn + 2*ldi);
+    __m256d r3 = _mm256_loadu_pd(inn + 3*ldi);
+
+    __m256d t0 = _mm256_unpacklo_pd(r0, r1);
+    __m256d t1 = _mm256_unpackhi_pd(r0, r1);
+    __m256d t2 = _mm256_unpacklo_pd(r2, r3);
+    __m256d t3 = _mm256_unpackhi_pd(r2, r3);
+
+    write_row<Stream>(out + 0*ldo, _mm256_permute2f128_pd(t0, t2, 0x20), e);
+    write_row<Stream>(out + 1*ldo, _mm256_permute2f128_pd(t1, t3, 0x20), e);
+    write_row<Stream>(out + 2*ldo, _mm256_permute2f128_pd(t0, t2, 0x31), e);
+    write_row<Stream>(out + 3*ldo, _mm256_permute2f128_pd(t1, t3, 0x31), e);
+  }
+};
+#endif
+
+#if defined(__AVX512F__)
+template <>
+struct transpose_kernel_t<float, 16> {
+  static constexpr bool exists = true;
+  static __m512 vec(); // (the register type, never called)
+  template <bool Stream, typename I, typename TO, typename E>
+  static inline void apply(float const* inn, I ldi, TO* out, I ldo, E const& e) {
+    __m512 r[16];
+    __m512 t[16];
+    for(int k = 0; k != 16; ++k) {
+      r[k] = _mm512_loadu_ps(inn + k*ldi);
+    }
+
+    for(int k = 0; k != 16; k += 2) {
+      t[k  ] = _mm512_unpacklo_ps(r[k], r[k+1]);
+      t[k+1] = _mm512_unpackhi_ps(r[k], r[k+1]);
+    }
+
+    // now every 128 bit lane holds a transposed 4x4 block
+    for(int k = 0; k != 16; k += 4) {
+      r[k  ] = _mm512_shuffle_ps(t[k  ], t[k+2], 0x44);
+      r[k+1] = _mm512_shuffle_ps(t[k  ], t[k+2], 0xEE);
+      r[k+2] = _mm512_shuffle_ps(t[k+1], t[k+3], 0x44);
+      r[k+3] = _mm512_shuffle_ps(t[k+1], t[k+3], 0xEE);
+    }
+
+    // then move the 4x4 blocks around: first within groups of 8 registers,
+    // then across the two groups
+    for(int g = 0; g != 16; g += 8) {
+      for(int k = 0; k != 4; ++k) {
+        t[g+k  ] = _mm512_shuffle_f32x4(r[g+k], r[g+k+4], 0x88);
+        t[g+k+4] = _mm512_shuffle_f32x4(r[g+k], r[g+k+4], 0xDD);
+      }
+    }
+    for(int k = 0; k != 8; ++k) {
+      r[k  ] = _mm512_shuffle_f32x4(t[k], t[k+8], 0x88);
+      r[k+8] = _mm512_shuffle_f32x4(t[k], t[k+8], 0xDD);
+    }
+
+    for(int k = 0; k != 16; ++k) {
+      write_row<Stream>(out + k*ldo, r[k], e);
+    }
+  }
+};
+#endif
+
+// Cover as much of the ni x nj tile as possible with W x W kernels, then
+// hand the two leftover strips to the next narrower width.
+template <int W, bool Stream, typename T, typename I, typename TO, typename E>
+inline void transpose_tile_w(
+  int ni, int nj,
+  T const* inn, I ldi,
+  TO* out, I ldo,
+  E const& e)
+{
+  if constexpr (W < 4 && Stream) {
+    // Walk along the output rows so that the streamed stores of a row
+    // combine into whole lines
+    for(I i = 0; i != ni; ++i) {
+    for(I j = 0; j != nj; ++j) {
+      write_elem<Stream>(out + j + ldo*i, inn[i + ldi*j], e);
+    }}
+  } else if constexpr (W < 4) {
+    for(I j = 0; j != nj; ++j) {
+    for(I i = 0; i != ni; ++i) {
+      write_elem<false>(out + j + ldo*i, inn[i + ldi*j], e);
+    }}
+  } else if constexpr (!has_transpose_kernel<T, W, TO, E>()) {
+    transpose_tile_w<W/2, Stream>(ni, nj, inn, ldi, out, ldo, e);
+  } else {
+    int mi = ni - (ni % W);
+    int mj = nj - (nj % W);
+    if constexpr (Stream) {
+      // along the output rows, so the W rows being written get finished
+      // before they are left behind
+      for(I i = 0; i != mi; i += W) {
+      for(I j = 0; j != mj; j += W) {
+        transpose_kernel_t<T, W>::template apply<Stream>(inn + i + ldi*j, ldi, out + j + ldo*i, ldo, e);
+      }}
+    } else {
+      for(I j = 0; j != mj; j += W) {
+      for(I i = 0; i != mi; i += W) {
+        transpose_kernel_t<T, W>::template apply<Stream>(inn + i + ldi*j, ldi, out + j + ldo*i, ldo, e);
+      }}
+    }
+
+    // [0,mi) x [mj,nj)
+    transpose_tile_w<W/2, Stream>(mi, nj - mj, inn + ldi*I(mj), ldi, out + mj, ldo, e);
+    // [mi,ni) x [0,nj)
+    transpose_tile_w<W/2, Stream>(ni - mi, nj, inn + mi, ldi, out + ldo*I(mi), ldo, e);
+  }
+}
+
+// out[j + ldo*i] = e(inn[i + ldi*j]) for i in [0,ni), j in [0,nj)
+template <
+  bool Stream = false, typename T, typename I,
+  typename TO = T, typename E = identity_epilogue_t>
+inline void transpose_tile(
+  int ni, int nj,
+  T const* inn, I ldi,
+  TO* out, I ldo,
+  E const& e = E())
+{
+  // On tiny tiles the kernel plus its scalar edges lose to the plain loop
+  // (measured on the 8000x20000 transpose with recursive_t(8)).
+  if(ni < 8 || nj < 8) {
+    transpose_tile_w<1, Stream>(ni, nj, inn, ldi, out, ldo, e);
+    return;
+  }
+
+  transpose_tile_w<16, Stream>(ni, nj, inn, ldi, out, ldo, e);
+}
@@ -0,0 +1,187 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <cstdint>
+
+#include "permute.h"
+#include "allocator.h"
+
+using std::vector;
+
+struct tensor_t {
+  tensor_t(std::vector<int> dims, float* data):
+    dims(dims), data(data)
+  {}
+
+  // Not zero filled: whatever fills it in overwrites all of it anyway
+  tensor_t(std::vector<int> dims):
+    dims(dims), buffer(size() * sizeof(float))
+  {
+    data = buffer.as<float>();
+  }
+
+  float& operator[](std::vector<int> const& idx) {
+    int64_t p = 1;
+    int64_t total = 0;
+    for(int i = 0; i != dims.size(); ++i) {
+      total += p*idx[i];
+      p *= dims[i];
+    }
+    return data[total];
+  }
+
+  int64_t size() const {
+    int64_t ret = 1;
+    for(int const& d: dims) {
+      ret *= d;
+    }
+    return ret;
+  }
+
+  vector<int> dims;
+  buffer_t buffer;
+  float* data;
+};
+
+// What lazy permutes saved. A chain of permutes costs one pass over memory
+// when it is finally needed, and none if it comes back to where it started.
+struct lazy_permute_stats_t {
+  uint64_t permutes = 0; // permutes asked for
+  uint64_t passes   = 0; // passes over memory done for them
+  uint64_t avoided  = 0; // permutes that didn't get a pass of their own
+};
+
+// A tensor_t as seen through a pending permutation. Permuting a view only
+// composes permutations (no data moves), so [2,0,1] followed by [1,2,0] is
+// nothing at all, and the data is only permuted, with one permute_t call,
+// when it is asked for.
+struct permuted_view_t {
+  // base, not permuted; base has to outlive the view and the views made
+  // from it, and not change while they still have to materialize
+  explicit permuted_view_t(tensor_t const& base):
+    base(&base), chained(0), stats(nullptr), handed_out(false)
+  {
+    for(int i = 0; i != base.dims.size(); ++i) {
+      perm.push_back(i);
+    }
+    set_strides();
+  }
+
+  // The same view, but counting what it and the views made from it save
+  permuted_view_t with_stats(lazy_permute_stats_t& stats) const {
+    return permuted_view_t(*base, perm, chained, &stats);
+  }
+
+  // This view permuted by p: dimension k of the result is dimension p[k]
+  // of this one
+  permuted_view_t permute(vector<int> const& p) const {
+    vector<int> composed;
+    for(int const& k: p) {
+      composed.push_back(perm[k]);
+    }
+    if(stats != nullptr) {
+      stats->permutes++;
+    }
+    return permuted_view_t(*base, composed, chained + 1, stats);
+  }
+
+  vector<int> dims() const {
+    vector<int> ret;
+    for(int const& p: perm) {
+      ret.push_back(base->dims[p]);
+    }
+    return ret;
+  }
+
+  // The permutation of the base that the view stands for
+  vector<int> const& get_perm() const { return perm; }
+
+  bool is_identity() const {
+    for(int i = 0; i != perm.size(); ++i) {
+      if(perm[i] != i) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // An element, read through the permutation; no pass over memory
+  float operator[](vector<int> const& idx) const {
+    int64_t total = 0;
+    for(int k = 0; k != strides.size(); ++k) {
+      total += strides[k] * idx[k];
+    }
+    return base->data[total];
+  }
+
+  // Write the view's data (dims()) to out with one permute_t call
+  void materialize(float* out, permute_t const& f) const {
+    f(base->dims, perm, base->data, out);
+    count(1);
+  }
+
+  tensor_t materialize(permute_t const& f) const {
+    tensor_t ret(dims());
+    materialize(ret.data, f);
+    return ret;
+  }
+
+  // The view's data (dims()): the base's own when the permutes composed to
+  // nothing, otherwise materialized with f the first time it is asked for
+  float const* data(permute_t const& f) {
+    if(is_identity()) {
+      if(!handed_out) {
+        count(0);
+        handed_out = true;
+      }
+      return base->data;
+    }
+    if(cache == nullptr) {
+      cache = std::make_shared<tensor_t>(materialize(f));
+    }
+    return cache->data;
+  }
+
+private:
+  permuted_view_t(
+    tensor_t const& base, vector<int> const& perm, int chained,
+    lazy_permute_stats_t* stats):
+      base(&base), perm(perm), chained(chained), stats(stats), handed_out(false)
+  {
+    set_strides();
+  }
+
+  // The stride in the base of each of the view's dimensions
+  void set_strides() {
+    vector<int> const& base_dims = base->dims;
+    vector<int64_t> base_strides(base_dims.size());
+    int64_t p = 1;
+    for(int i = 0; i != base_dims.size(); ++i) {
+      base_strides[i] = p;
+      p *= base_dims[i];
+    }
+    for(int const& k: perm) {
+      strides.push_back(base_strides[k]);
+    }
+  }
+
+  // The chain got passes passes
+  void count(int passes) const {
+    if(stats != nullptr) {
+      stats->passes += passes;
+      stats->avoided += std::max(0, chained - passes);
+    }
+  }
+
+  tensor_t const* base;
+  vector<int> perm;
+  vector<int64_t> strides; // of the base, by view dimension (operator[])
+  int chained; // how many permutes were composed into perm
+  lazy_permute_stats_t* stats;
+
+  // What data() handed out, when it wasn't the base's
+  std::shared_ptr<tensor_t> cache;
+  bool handed_out;
+};
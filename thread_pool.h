@@ -0,0 +1,186 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+
+// A small work-stealing thread pool.
+//
+// Every worker owns a deque of tasks. A worker pushes the tasks it spawns onto
+// the back of its own deque and pops from the back too, so each worker goes
+// depth first just like the serial recursion. An idle worker steals from the
+// front of somebody else's deque, which is where the oldest and therefore
+// biggest pieces of the recursion tree are sitting.
+//
+// Threads that are not in the pool (like main) can also spawn; those tasks
+// are dealt out round robin. Whoever calls wait helps run tasks until the
+// group is finished, so nested spawn + wait can't deadlock.
+struct thread_pool_t {
+  using task_f = std::function<void()>;
+
+  // Keeps track of how many tasks spawned into it have not yet finished.
+  struct task_group_t {
+    std::atomic<int> pending{0};
+  };
+
+  explicit thread_pool_t(int num_threads):
+    queues(num_threads < 1 ? 1 : num_threads),
+    num_queued(0), next_queue(0), done(false)
+  {
+    workers.reserve(queues.size());
+    for(int i = 0; i != queues.size(); ++i) {
+      workers.emplace_back([this, i]{ work(i); });
+    }
+  }
+
+  thread_pool_t(thread_pool_t const&) = delete;
+  thread_pool_t& operator=(thread_pool_t const&) = delete;
+
+  ~thread_pool_t() {
+    {
+      std::unique_lock<std::mutex> lk(sleep_mutex);
+      done = true;
+    }
+    sleep_cv.notify_all();
+    for(auto& w: workers) {
+      w.join();
+    }
+  }
+
+  int num_threads() const { return queues.size(); }
+
+  void spawn(task_group_t& group, task_f f) {
+    group.pending++;
+
+    int which = this_worker();
+    if(which < 0) {
+      which = next_queue++ % queues.size();
+    }
+
+    {
+      auto& q = queues[which];
+      std::unique_lock<std::mutex> lk(q.mutex);
+      q.tasks.push_back(task_t{ &group, std::move(f) });
+      num_queued++;
+    }
+
+    // Grab the lock so that a worker that just found nothing to do
+    // can't miss this notification
+    {
+      std::unique_lock<std::mutex> lk(sleep_mutex);
+    }
+    sleep_cv.notify_one();
+  }
+
+  // Run tasks (from anywhere in the pool) until everything in group is done.
+  void wait(task_group_t& group) {
+    wait_until([&group]{ return group.pending.load() == 0; });
+  }
+
+  // Run tasks until done() is true; for waiting on something that tasks
+  // of several groups (or tasks yet to be spawned) will bring about.
+  template <typename F>
+  void wait_until(F done) {
+    int me = this_worker();
+    while(!done()) {
+      if(!run_one(me)) {
+        std::this_thread::yield();
+      }
+    }
+  }
+
+private:
+  struct task_t {
+    task_group_t* group;
+    task_f        f;
+  };
+
+  struct queue_t {
+    std::mutex          mutex;
+    std::deque<task_t>  tasks;
+  };
+
+  // Which worker of this pool is the calling thread? -1 if not one of ours.
+  int this_worker() const {
+    auto const& [pool, which] = worker_id();
+    return pool == this ? which : -1;
+  }
+
+  struct worker_id_t {
+    thread_pool_t const* pool;
+    int                  which;
+  };
+
+  static worker_id_t& worker_id() {
+    static thread_local worker_id_t ret{ nullptr, -1 };
+    return ret;
+  }
+
+  bool pop(int which, bool from_back, task_t& ret) {
+    auto& q = queues[which];
+    std::unique_lock<std::mutex> lk(q.mutex);
+    if(q.tasks.empty()) {
+      return false;
+    }
+    if(from_back) {
+      ret = std::move(q.tasks.back());
+      q.tasks.pop_back();
+    } else {
+      ret = std::move(q.tasks.front());
+      q.tasks.pop_front();
+    }
+    num_queued--;
+    return true;
+  }
+
+  // Pop off of our own deque, otherwise try to steal from the others.
+  bool run_one(int me) {
+    int n = queues.size();
+    task_t task;
+    bool found = me >= 0 && pop(me, true, task);
+    int start = me >= 0 ? me + 1 : 0;
+    for(int i = 0; !found && i != n; ++i) {
+      int which = (start + i) % n;
+      if(which != me) {
+        found = pop(which, false, task);
+      }
+    }
+
+    if(!found) {
+      return false;
+    }
+
+    task.f();
+    task.group->pending--;
+    return true;
+  }
+
+  void work(int which) {
+    worker_id() = { this, which };
+    while(true) {
+      if(run_one(which)) {
+        continue;
+      }
+
+      std::unique_lock<std::mutex> lk(sleep_mutex);
+      sleep_cv.wait(lk, [this]{ return done || num_queued.load() > 0; });
+      if(done && num_queued.load() == 0) {
+        return;
+      }
+    }
+  }
+
+  std::vector<std::thread> workers;
+  std::vector<queue_t>     queues;
+
+  std::atomic<int> num_queued;
+  std::atomic<unsigned> next_queue;
+
+  std::mutex sleep_mutex;
+  std::condition_variable sleep_cv;
+  bool done;
+};
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <algorithm>
+#include <numeric>
+
+// Orders for a grid of tiles along a space filling curve, so that tiles
+// visited one after another are also close together in every dimension
+// (and so share cache lines and pages on both sides of a permute).
+//
+// Neither needs the grid to be a power of two on a side: the points are
+// sorted by where they fall on the curve over the enclosing power of two
+// cube, and the points that aren't in the grid are just never there.
+
+// Whether x has a lower most significant bit than y
+inline bool less_msb(uint32_t x, uint32_t y) {
+  return x < y && x < (x ^ y);
+}
+
+// Whether point a comes before point b along the Morton (Z) curve, which
+// interleaves the bits of the coordinates with dimension 0 the most
+// significant of each bit. Whichever coordinate differs in the highest bit
+// decides, so this works for any number of bits per coordinate.
+inline bool morton_less(uint32_t const* a, uint32_t const* b, int rank) {
+  int which = 0;
+  uint32_t highest = 0;
+  for(int i = 0; i != rank; ++i) {
+    uint32_t x = a[i] ^ b[i];
+    if(less_msb(highest, x)) {
+      which = i;
+      highest = x;
+    }
+  }
+  return a[which] < b[which];
+}
+
+// Turn a point with coordinates of bits bits into the "transposed" form of
+// its Hilbert index (J. Skilling, "Programming the Hilbert curve", 2004):
+// the index is the bits of x interleaved as morton_less interleaves them,
+// so points are in Hilbert order when their transposes are in Morton order.
+inline void hilbert_transpose(uint32_t* x, int rank, int bits) {
+  if(bits == 0) {
+    return;
+  }
+  uint32_t m = uint32_t(1) << (bits - 1);
+
+  // Inverse undo
+  for(uint32_t q = m; q > 1; q >>= 1) {
+    uint32_t p = q - 1;
+    for(int i = 0; i != rank; ++i) {
+      if(x[i] & q) {
+        x[0] ^= p;
+      } else {
+        uint32_t t = (x[0] ^ x[i]) & p;
+        x[0] ^= t;
+        x[i] ^= t;
+      }
+    }
+  }
+
+  // Gray encode
+  for(int i = 1; i < rank; ++i) {
+    x[i] ^= x[i-1];
+  }
+  uint32_t t = 0;
+  for(uint32_t q = m; q > 1; q >>= 1) {
+    if(x[rank-1] & q) {
+      t ^= q - 1;
+    }
+  }
+  for(int i = 0; i != rank; ++i) {
+    x[i] ^= t;
+  }
+}
+
+// The points of the grid with sides counts[0], ..., counts[rank-1], in
+// Morton order or (with hilbert set) in Hilbert order, rank coordinates per
+// point
+inline std::vector<uint32_t> curve_order(
+  std::vector<int> const& counts, bool hilbert)
+{
+  int rank = counts.size();
+  int64_t num = 1;
+  int bits = 0;
+  for(int const& c: counts) {
+    num *= c;
+    while((int64_t(1) << bits) < c) {
+      bits++;
+    }
+  }
+
+  // Every point, in column major order, and the keys to sort them by
+  std::vector<uint32_t> points(num * rank);
+  std::vector<uint32_t> keys(num * rank);
+  std::vector<uint32_t> idx(rank, 0);
+  for(int64_t p = 0; p != num; ++p) {
+    std::copy(idx.begin(), idx.end(), points.begin() + p*rank);
+    std::copy(idx.begin(), idx.end(), keys.begin() + p*rank);
+    if(hilbert) {
+      hilbert_transpose(keys.data() + p*rank, rank, bits);
+    }
+    for(int i = 0; i != rank; ++i) {
+      if(++idx[i] != uint32_t(counts[i])) {
+        break;
+      }
+      idx[i] = 0;
+    }
+  }
+
+  std::vector<int64_t> order(num);
+  std::iota(order.begin(), order.end(), int64_t(0));
+  std::sort(order.begin(), order.end(), [&](int64_t a, int64_t b) {
+    return morton_less(keys.data() + a*rank, keys.data() + b*rank, rank);
+  });
+
+  std::vector<uint32_t> ret(num * rank);
+  for(int64_t p = 0; p != num; ++p) {
+    std::copy(
+      points.begin() + order[p]*rank, points.begin() + (order[p]+1)*rank,
+      ret.begin() + p*rank);
+  }
+  return ret;
+}
@@ -1,35 +1,72 @@
 #pragma once
 
-void naive_hit_inn(int ni, int nj, float* inn, float* out) {
-  for(int j = 0; j != nj; ++j) {
-  for(int i = 0; i != ni; ++i) {
-    out[j + nj*i] = inn[i + ni*j];
-  }}
+#include "thread_pool.h"
+#include "simd_transpose.h"
+#include "index_type.h"
+#include "perf_counters.h"
+#include "in_place.h"
+
+#include <algorithm>
+
+// Everything here does its offset arithmetic in I, which is int unless
+// ni*nj is too big for that (see index_type.h).
+//
+// The element type T is anything trivially copyable. Block sizes are given
+// for 4 byte elements (floats) and are scaled by sizeof(T), so that every
+// element type gets tiles whose rows and columns span the same number of bytes.
+
+template <typename T>
+inline int scale_block_size(int block_size_for_floats) {
+  return std::max(1, int(block_size_for_floats * sizeof(float) / sizeof(T)));
 }
 
-void naive_hit_out(int ni, int nj, float* inn, float* out) {
-  for(int i = 0; i != ni; ++i) {
-  for(int j = 0; j != nj; ++j) {
-    out[j + nj*i] = inn[i + ni*j];
-  }}
+template <typename T>
+void naive_hit_inn(int ni, int nj, T* inn, T* out) {
+  with_index_type(int64_t(ni)*nj, [&](auto idx) {
+    using I = decltype(idx);
+    for(I j = 0; j != nj; ++j) {
+    for(I i = 0; i != ni; ++i) {
+      out[j + nj*i] = inn[i + ni*j];
+    }}
+  });
+}
+
+template <typename T>
+void naive_hit_out(int ni, int nj, T* inn, T* out) {
+  with_index_type(int64_t(ni)*nj, [&](auto idx) {
+    using I = decltype(idx);
+    for(I i = 0; i != ni; ++i) {
+    for(I j = 0; j != nj; ++j) {
+      out[j + nj*i] = inn[i + ni*j];
+    }}
+  });
 }
 
 struct with_blocks_t {
   with_blocks_t(int block_size): block_size(block_size) {}
 
-  void operator()(int ni, int nj, float* inn, float* out) const {
-    int num_block_j = nj / block_size;
-    int num_block_i = ni / block_size;
+  template <typename T>
+  void operator()(int ni, int nj, T* inn, T* out) const {
+    int block = scale_block_size<T>(block_size);
+    with_index_type(int64_t(ni)*nj, [&](auto idx) {
+      apply<decltype(idx)>(block, ni, nj, inn, out);
+    });
+  }
+private:
+  template <typename I, typename T>
+  void apply(int block_size, I ni, I nj, T* inn, T* out) const {
+    I num_block_j = nj / block_size;
+    I num_block_i = ni / block_size;
 
     // Do the portions covered by the blocks
-    for(int block_j = 0; block_j != num_block_j; ++block_j) {
-    for(int block_i = 0; block_i != num_block_i; ++block_i) {
-      int end_j = (block_j+1)*block_size;
-      int end_i = (block_i+1)*block_size;
-      for(int j = block_j*block_size; j != end_j; ++j) {
-      for(int i = block_i*block_size; i != end_i; ++i) {
-        out[j + nj*i] = inn[i + ni*j];
-      }}
+    for(I block_j = 0; block_j != num_block_j; ++block_j) {
+    for(I block_i = 0; block_i != num_block_i; ++block_i) {
+      I beg_j = block_j*block_size;
+      I beg_i = block_i*block_size;
+      transpose_tile(
+        block_size, block_size,
+        inn + beg_i + ni*beg_j, ni,
+        out + beg_j + nj*beg_i, nj);
     }}
 
     // Now there are three more portions..
@@ -38,10 +75,10 @@ struct with_blocks_t {
 
     // If the blocks covered all of i, the if prevents the
     // outer loop from happening
-    int beg_i = num_block_i * block_size;
+    I beg_i = num_block_i * block_size;
     if(beg_i != ni) {
-      for(int j = 0; j != nj; ++j) {
-        for(int i = beg_i; i != ni; ++i) {
+      for(I j = 0; j != nj; ++j) {
+        for(I i = beg_i; i != ni; ++i) {
           out[j + nj*i] = inn[i + ni*j];
         }
       }
@@ -51,13 +88,14 @@ struct with_blocks_t {
 
     // If the blocks covered all of j, the for outer for
     // loop exits immediately
-    int end_i = num_block_i * block_size;
-    for(int j = num_block_j * block_size; j != nj; ++j) {
-      for(int i = 0; i != end_i; ++i) {
+    I end_i = num_block_i * block_size;
+    for(I j = num_block_j * block_size; j != nj; ++j) {
+      for(I i = 0; i != end_i; ++i) {
         out[j + nj*i] = inn[i + ni*j];
       }
     }
   }
+
 private:
   int block_size;
 };
@@ -65,29 +103,151 @@ private:
 // This is the cache oblivious algorithm, as exemplified in
 //   https://en.wikipedia.org/wiki/Cache-oblivious_algorithm
 struct recursive_t {
-  recursive_t(int min_block_size): min_block_size(min_block_size) {}
+  recursive_t(int min_block_size):
+    min_block_size(min_block_size), pool(nullptr), grain_size(0),
+    stores(store_mode_t::regular), counters(nullptr)
+  {}
+
+  // Parallel mode; see permute_t. Pieces with more than grain_size
+  // elements are split and one half is spawned onto pool.
+  recursive_t(int min_block_size, thread_pool_t& pool, int grain_size = 1 << 16):
+    min_block_size(min_block_size), pool(&pool), grain_size(grain_size),
+    stores(store_mode_t::regular), counters(nullptr)
+  {}
+
+  // See store_mode_t in simd_transpose.h
+  recursive_t with_stores(store_mode_t mode) const {
+    recursive_t ret = *this;
+    ret.stores = mode;
+    return ret;
+  }
+
+  // See permute_t::with_counters
+  recursive_t with_counters(perf_stats_t& stats) const {
+    recursive_t ret = *this;
+    ret.counters = &stats;
+    return ret;
+  }
 
-  void operator()(int ni, int nj, float* inn, float* out) const {
-    recurse(0, ni, ni, 0, nj, nj, inn, out);
+  template <typename T>
+  void operator()(int ni, int nj, T* inn, T* out) const {
+    (*this)(ni, nj, inn, ni, out, nj);
+  }
+
+  // Strided: inn and out are parts of bigger matrices, so
+  // out[j + ldo*i] = inn[i + ldi*j] with ldi >= ni and ldo >= nj
+  template <typename T>
+  void operator()(int ni, int nj, T* inn, int64_t ldi, T* out, int64_t ldo) const {
+    perf_scope_t scope(counters, 2 * uint64_t(ni) * nj * sizeof(T));
+    int block = scale_block_size<T>(min_block_size);
+    bool stream = use_streaming(stores, int64_t(ni)*nj*sizeof(T));
+    int64_t last = std::max(ni - 1 + ldi*(nj - 1), nj - 1 + ldo*(ni - 1));
+    with_index_type(last + 1, [&](auto idx) {
+      using I = decltype(idx);
+      if(stream) {
+        apply<I, true>(block, ni, nj, inn, I(ldi), out, I(ldo));
+        stream_fence();
+      } else {
+        apply<I, false>(block, ni, nj, inn, I(ldi), out, I(ldo));
+      }
+    });
   }
 private:
+  template <typename I, bool Stream, typename T>
+  void apply(int block, int ni, int nj, T* inn, I ldi, T* out, I ldo) const {
+    if(pool == nullptr) {
+      recurse<I, Stream>(block, 0, ni, ldi, 0, nj, ldo, inn, out);
+      return;
+    }
+
+    thread_pool_t::task_group_t group;
+    recurse_parallel<I, Stream>(block, 0, ni, ldi, 0, nj, ldo, inn, out, group);
+    pool->wait(group);
+  }
+
+  // Split [beg,end) in half. With j, which runs along the output rows,
+  // the split is moved onto a cache line boundary when possible.
+  template <typename T>
+  static int split_j(int beg, int end) {
+    int half = beg + ((end - beg) / 2);
+    int line = std::max(1, int(cache_line_bytes / sizeof(T)));
+    int aligned = half - (half % line);
+    return aligned > beg ? aligned : half;
+  }
+
+  template <typename I, bool Stream, typename T>
+  void recurse_parallel(
+      int min_block_size,
+      int beg_i, int end_i, I total_i,
+      int beg_j, int end_j, I total_j,
+      T* inn, T* out,
+      thread_pool_t::task_group_t& group) const
+  {
+    int remaining_j = end_j - beg_j;
+    int remaining_i = end_i - beg_i;
+
+    if(int64_t(remaining_i) * remaining_j <= grain_size ||
+       (remaining_i <= min_block_size && remaining_j <= min_block_size))
+    {
+      recurse<I, Stream>(min_block_size,
+                         beg_i, end_i, total_i,
+                         beg_j, end_j, total_j,
+                         inn, out);
+      if(Stream) {
+        stream_fence();
+      }
+      return;
+    }
+
+    if(remaining_i > remaining_j) {
+      int half_i = beg_i + ((end_i - beg_i) / 2);
+      pool->spawn(group, [=, &group] {
+        recurse_parallel<I, Stream>(min_block_size,
+                         beg_i, half_i, total_i,
+                         beg_j, end_j,  total_j,
+                         inn, out, group);
+      });
+
+      return recurse_parallel<I, Stream>(min_block_size,
+                              half_i, end_i, total_i,
+                              beg_j,  end_j, total_j,
+                              inn, out, group);
+    } else {
+      int half_j = split_j<T>(beg_j, end_j);
+      pool->spawn(group, [=, &group] {
+        recurse_parallel<I, Stream>(min_block_size,
+                         beg_i, end_i,  total_i,
+                         beg_j, half_j, total_j,
+                         inn, out, group);
+      });
+
+      return recurse_parallel<I, Stream>(min_block_size,
+                              beg_i,  end_i, total_i,
+                              half_j, end_j, total_j,
+                              inn, out, group);
+    }
+  }
+
+  template <typename I, bool Stream, typename T>
   void recurse(
-      int beg_i, int end_i, int const& total_i,
-      int beg_j, int end_j, int const& total_j,
-      float* inn, float* out) const
+      int min_block_size,
+      int beg_i, int end_i, I const& total_i,
+      int beg_j, int end_j, I const& total_j,
+      T* inn, T* out) const
   {
-    int const& ni = total_i;
-    int const& nj = total_j;
+    // (total_i and total_j are the leading dimensions of inn and out)
+    I const& ni = total_i;
+    I const& nj = total_j;
 
     // 1. Check the base case of the recursion
     int remaining_j = end_j - beg_j;
     int remaining_i = end_i - beg_i;
 
     if(remaining_i <= min_block_size && remaining_j <= min_block_size) {
-      for(int j = beg_j; j != end_j; ++j) {
-      for(int i = beg_i; i != end_i; ++i) {
-        out[j + nj*i] = inn[i + ni*j];
-      }}
+      transpose_tile<Stream>(
+        remaining_i, remaining_j,
+        inn + beg_i + ni*I(beg_j), ni,
+        out + beg_j + nj*I(beg_i), nj);
 
       return;
     }
@@ -95,20 +255,24 @@ private:
     // 2. Pick the larger dimension and recurse
     if(remaining_i > remaining_j) {
       int half_i = beg_i + ((end_i - beg_i) / 2);
-      recurse(beg_i, half_i, total_i,
+      recurse<I, Stream>(min_block_size,
+              beg_i, half_i, total_i,
               beg_j, end_j,  total_j,
               inn, out);
 
-      return recurse(half_i, end_i, total_i,
+      return recurse<I, Stream>(min_block_size,
+                     half_i, end_i, total_i,
                      beg_j,  end_j, total_j,
                      inn, out);
     } else {
-      int half_j = beg_j + ((end_j - beg_j) / 2);
-      recurse(beg_i, end_i, total_i,
+      int half_j = split_j<T>(beg_j, end_j);
+      recurse<I, Stream>(min_block_size,
+              beg_i, end_i, total_i,
               beg_j, half_j,  total_j,
               inn, out);
 
-      return recurse(beg_i,  end_i, total_i,
+      return recurse<I, Stream>(min_block_size,
+                     beg_i,  end_i, total_i,
                      half_j, end_j, total_j,
                      inn, out);
     }
@@ -116,5 +280,38 @@ private:
 
 private:
   int min_block_size;
+  thread_pool_t* pool;
+  int grain_size;
+  store_mode_t stores;
+  perf_stats_t* counters;
 };
 
+// Transpose an ni x nj matrix in place, so there is no second copy of it.
+// Square matrices swap pairs of block_size x block_size tiles about the
+// diagonal; anything else follows the cycles of the transpose, which costs a
+// bitmap of one bit per element and an uncached access per element.
+struct transpose_in_place_t {
+  transpose_in_place_t(int block_size): block_size(block_size) {}
+
+  template <typename T>
+  void operator()(int ni, int nj, T* data) const {
+    // (see permute_plan_t::execute_in_place for why the cycles want
+    //  one more than what with_index_type checks for)
+    with_index_type(int64_t(ni)*nj + 1, [&](auto idx) {
+      using I = decltype(idx);
+      if(ni == nj) {
+        transpose_square_in_place<I>(I(ni), data, scale_block_size<T>(block_size));
+        return;
+      }
+
+      // element i + ni*j goes to j + nj*i
+      std::vector<uint64_t> visited;
+      permute_cycles_in_place<I>(I(ni)*nj, data, [&](I p) {
+        return (p % ni)*I(nj) + p / ni;
+      }, visited);
+    });
+  }
+
+private:
+  int block_size;
+};